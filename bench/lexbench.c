@@ -0,0 +1,88 @@
+// Lexer microbenchmark: lexes a synthetic script with every classifier this
+// CPU supports and reports throughput in MB/s.
+//
+// Usage: lexbench [size_in_mb]   (default 100)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lexer.h"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fill a buffer with a realistic mix of statements, indentation, strings
+// and comments.
+static char *make_script(size_t size) {
+    static const char *lines[] = {
+        "set counter = 0\n",
+        "loop 1000\n",
+        "    add counter 1\n",
+        "    if counter >= 500\n",
+        "        print \"counter is large\" counter\n",
+        "    end\n",
+        "    sub total_value 17\n",
+        "end\n",
+        "# a comment line explaining what comes next\n",
+        "\n",
+        "print \"done\"\n",
+        "\tset another_variable_name = -42\n",
+    };
+    int n = sizeof(lines) / sizeof(lines[0]);
+    char *buf = malloc(size);
+    if (!buf) { perror("malloc"); exit(1); }
+    size_t pos = 0;
+    unsigned int seed = 12345;
+    while (pos < size) {
+        seed = seed * 1103515245u + 12345u;
+        const char *line = lines[(seed >> 16) % n];
+        size_t len = strlen(line);
+        if (len > size - pos) len = size - pos;
+        memcpy(buf + pos, line, len);
+        pos += len;
+    }
+    return buf;
+}
+
+int main(int argc, char *argv[]) {
+    size_t mb = argc > 1 ? (size_t)atoi(argv[1]) : 100;
+    size_t size = mb * 1024 * 1024;
+    char *script = make_script(size);
+
+    static const struct { LexImpl impl; const char *name; } impls[] = {
+        { LEX_IMPL_SCALAR, "scalar" }, { LEX_IMPL_SSE2, "sse2" }, { LEX_IMPL_AVX2, "avx2" },
+    };
+    double scalar_rate = 0;
+    printf("lexing %zu MB of synthetic script\n", mb);
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (lex_select(impls[i].impl) != 0) {
+            printf("%-8s unsupported on this CPU\n", impls[i].name);
+            continue;
+        }
+
+        // Best of three runs, to keep page faults on the first run out of it.
+        double best = 1e30;
+        LexResult lex;
+        for (int run = 0; run < 3; run++) {
+            double start = now_seconds();
+            if (lex_buffer(script, size, &lex) != 0) { fprintf(stderr, "out of memory\n"); return 1; }
+            double elapsed = now_seconds() - start;
+            if (elapsed < best) best = elapsed;
+            if (run < 2) lex_free(&lex);
+        }
+
+        double rate = mb / best;
+        if (impls[i].impl == LEX_IMPL_SCALAR) scalar_rate = rate;
+        printf("%-8s %8.1f MB/s  %6.3f s  %d lines  %d tokens", impls[i].name, rate, best, lex.line_count, lex.token_count);
+        if (scalar_rate > 0 && impls[i].impl != LEX_IMPL_SCALAR) printf("  (%.2fx scalar)", rate / scalar_rate);
+        printf("\n");
+        lex_free(&lex);
+    }
+    free(script);
+    return 0;
+}
@@ -0,0 +1,365 @@
+// Benchmark suite: generates parameterized workloads, times the interpreter and
+// compiled binaries on each at every optimization level, checks that they all
+// print the same output, and writes the results as JSON.
+//
+// Usage: takobench [--scale N] [--repeat N] [--out FILE] [--label TEXT]
+//                  [--tako PATH] [--compiler PATH] [--work DIR] [workload...]
+//
+// Every configuration runs each workload --repeat times (default 3); the best
+// wall time and the largest peak RSS are reported. Startup time is the best of
+// ten runs of a one-line script. The exit status is 1 if any output differs
+// from the reference (the interpreter without the JIT, at -O0).
+//
+// Interpreter runs pass --no-cache, so they time lexing and compiling every
+// time, except "cached", which times warm starts from a .takoc image. Its
+// images go to a fresh directory under --work that is removed at the end.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// --- Workloads ---
+// Each generator writes a script and returns how many units of work it does;
+// ops/sec in the results is that count over the run time. Values stay well
+// inside 32 bits, where the interpreter and compiled code agree.
+
+// Deeply nested loops around a small body with a branch, so -O2 cannot close
+// them. Unit: innermost iterations.
+static uint64_t gen_nested(FILE *f, int scale) {
+    static const int counts[] = { 20, 10, 10, 10, 10, 10, 10 };
+    int depth = sizeof(counts) / sizeof(counts[0]);
+    uint64_t iterations = 1;
+    fprintf(f, "set a = 0\nset b = 0\n");
+    for (int d = 0; d < depth; d++) {
+        int count = d == 0 ? counts[d] * scale : counts[d];
+        fprintf(f, "%*sloop %d\n", 4 * d, "", count);
+        iterations *= (uint64_t)count;
+    }
+    fprintf(f, "%*sadd a 3\n%*ssub b 1\n", 4 * depth, "", 4 * depth, "");
+    fprintf(f, "%*sif a > 100000\n%*sset a = 0\n%*send\n", 4 * depth, "", 4 * depth + 4, "", 4 * depth, "");
+    for (int d = depth - 1; d >= 0; d--) fprintf(f, "%*send\n", 4 * d, "");
+    fprintf(f, "print \"a\" a\nprint \"b\" b\n");
+    return iterations;
+}
+
+// Many long-named variables rotated through each other every iteration: the
+// compiler allows at most 100. Unit: variable references.
+static uint64_t gen_wide(FILE *f, int scale) {
+    enum { VARS = 96 };
+    int iterations = 200000 * scale;
+    for (int v = 0; v < VARS; v++) fprintf(f, "set wide_variable_number_%d = %d\n", v, v);
+    fprintf(f, "set wide_variable_saved = 0\nloop %d\n", iterations);
+    fprintf(f, "    set wide_variable_saved = wide_variable_number_0\n");
+    for (int v = 0; v + 1 < VARS; v++) fprintf(f, "    set wide_variable_number_%d = wide_variable_number_%d\n", v, v + 1);
+    fprintf(f, "    set wide_variable_number_%d = wide_variable_saved\n    add wide_variable_number_7 1\nend\n", VARS - 1);
+    for (int v = 0; v < VARS; v++) fprintf(f, "print wide_variable_number_%d\n", v);
+    return (uint64_t)iterations * (2 * (VARS + 1) + 1);
+}
+
+// Output bound: one labelled number per iteration. Unit: lines printed.
+static uint64_t gen_print(FILE *f, int scale) {
+    int iterations = 500000 * scale;
+    fprintf(f, "set i = 0\nloop %d\n    print \"line\" i\n    add i 1\nend\n", iterations);
+    return (uint64_t)iterations;
+}
+
+// A long straight-line script inside a few nested blocks, with small blocks
+// throughout: mostly load, parse and block matching. Unit: source lines.
+static uint64_t gen_long(FILE *f, int scale) {
+    static const char *vars[] = { "a", "b", "c", "d", "e", "f", "g", "h" };
+    enum { WRAPPERS = 3 };
+    int chunks = 10000 * scale;
+    uint64_t lines = 0;
+    unsigned int seed = 12345;
+    for (int v = 0; v < 8; v++, lines++) fprintf(f, "set %s = %d\n", vars[v], v);
+    for (int w = 0; w < WRAPPERS; w++, lines++) fprintf(f, "if a >= -1000000000\n");
+    for (int c = 0; c < chunks; c++) {
+        for (int s = 0; s < 20; s++, lines++) {
+            seed = seed * 1103515245u + 12345u;
+            const char *dst = vars[(seed >> 16) % 8], *src = vars[(seed >> 20) % 8];
+            int k = (int)((seed >> 24) % 19) - 9;
+            switch ((seed >> 8) % 4) {
+                case 0: fprintf(f, "add %s %d\n", dst, k); break;
+                case 1: fprintf(f, "sub %s %d\n", dst, k); break;
+                case 2: fprintf(f, "set %s = %d\n", dst, k); break;
+                default: fprintf(f, "set %s = %s\n", dst, src); break;
+            }
+            if (s == 9) { fprintf(f, "if %s < %s\n    add %s 1\n    sub %s 1\nend\n", dst, src, dst, src); lines += 4; }
+            if (s == 14) { fprintf(f, "loop 3\n    add %s 2\nend\n", dst); lines += 3; }
+        }
+    }
+    for (int w = 0; w < WRAPPERS; w++, lines++) fprintf(f, "end\n");
+    for (int v = 0; v < 8; v++, lines++) fprintf(f, "print \"%s\" %s\n", vars[v], vars[v]);
+    return lines;
+}
+
+// A chain of equality tests per iteration, one of which is taken. Unit: `if`
+// statements evaluated.
+static uint64_t gen_branch(FILE *f, int scale) {
+    enum { CASES = 32 };
+    int iterations = 1000000 * scale;
+    fprintf(f, "set i = 0\nset hits = 0\nloop %d\n", iterations);
+    for (int k = 0; k < CASES; k++) fprintf(f, "    if i == %d\n        add hits %d\n    end\n", k, k + 1);
+    fprintf(f, "    add i 1\n    if i >= %d\n        set i = 0\n    end\nend\nprint \"hits\" hits\n", CASES);
+    return (uint64_t)iterations * (CASES + 1);
+}
+
+typedef struct {
+    const char *name;
+    const char *unit;
+    uint64_t (*generate)(FILE *f, int scale);
+} Workload;
+
+static const Workload workloads[] = {
+    { "nested", "iterations", gen_nested },
+    { "wide", "variable references", gen_wide },
+    { "print", "lines printed", gen_print },
+    { "long", "source lines", gen_long },
+    { "branch", "if statements", gen_branch },
+};
+#define WORKLOAD_COUNT (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+// --- Configurations ---
+// Interpreter runs pass `flags` before the script; compiled runs pass them to
+// the compiler and run the resulting binary. A cached run is an interpreter
+// run whose image is written once before timing. The first is the reference.
+typedef struct {
+    const char *name;
+    bool compiled;
+    bool cached;
+    const char *flags[3];
+} Config;
+
+static const Config configs[] = {
+    { "tako --no-jit -O0", false, false, { "--no-cache", "--no-jit", "-O0" } },
+    { "tako -O0", false, false, { "--no-cache", "-O0" } },
+    { "tako -O1", false, false, { "--no-cache", "-O1" } },
+    { "tako -O2", false, false, { "--no-cache", "-O2" } },
+    { "tako -O2 cached", false, true, { "-O2" } },
+    { "compiled -O0", true, false, { "-O0" } },
+    { "compiled -O1", true, false, { "-O1" } },
+    { "compiled -O2", true, false, { "-O2" } },
+};
+#define CONFIG_COUNT (int)(sizeof(configs) / sizeof(configs[0]))
+
+// --- Running ---
+
+typedef struct {
+    double seconds;
+    long peak_rss_kb;
+    bool ok;            // exited with status 0
+} RunResult;
+
+// Run argv with stdout and stderr sent to out_path (or discarded when NULL).
+static RunResult run(char *const argv[], const char *out_path) {
+    RunResult r = { 0, 0, false };
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); exit(1); }
+    if (pid == 0) {
+        int fd = open(out_path ? out_path : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) _exit(127);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) { perror("wait4"); exit(1); }
+    }
+    r.seconds = now_seconds() - start;
+    r.peak_rss_kb = usage.ru_maxrss;
+    r.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    return r;
+}
+
+// Build the command line for one configuration.
+static int config_argv(const Config *c, const char *tool, const char *script, const char *binary, char *argv[7]) {
+    int n = 0;
+    argv[n++] = (char *)tool;
+    for (int i = 0; i < 3 && c->flags[i]; i++) argv[n++] = (char *)c->flags[i];
+    argv[n++] = (char *)script;
+    if (c->compiled) argv[n++] = (char *)binary;
+    argv[n] = NULL;
+    return n;
+}
+
+// Compile the script, or fill the cache with its image, when the
+// configuration needs it; returns false on failure.
+static bool prepare(const Config *c, const char *tako, const char *compiler, const char *script, const char *binary, double *compile_seconds) {
+    *compile_seconds = 0;
+    if (!c->compiled && !c->cached) return true;
+    char *argv[7];
+    config_argv(c, c->compiled ? compiler : tako, script, binary, argv);
+    RunResult r = run(argv, NULL);
+    *compile_seconds = r.seconds;
+    return r.ok;
+}
+
+// Time one configuration: best wall time and largest peak RSS over `repeat` runs.
+static RunResult measure(const Config *c, const char *tako, const char *script, const char *binary, const char *out_path, int repeat) {
+    char *argv[7];
+    if (c->compiled) { argv[0] = (char *)binary; argv[1] = NULL; }
+    else config_argv(c, tako, script, NULL, argv);
+    RunResult best = { 1e30, 0, true };
+    for (int i = 0; i < repeat; i++) {
+        RunResult r = run(argv, out_path);
+        if (r.seconds < best.seconds) best.seconds = r.seconds;
+        if (r.peak_rss_kb > best.peak_rss_kb) best.peak_rss_kb = r.peak_rss_kb;
+        best.ok = best.ok && r.ok;
+    }
+    return best;
+}
+
+static bool same_file(const char *a, const char *b) {
+    FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+    bool same = fa && fb;
+    char ba[65536], bb[65536];
+    while (same) {
+        size_t na = fread(ba, 1, sizeof(ba), fa), nb = fread(bb, 1, sizeof(bb), fb);
+        if (na != nb || memcmp(ba, bb, na) != 0) same = false;
+        if (na == 0) break;
+    }
+    if (fa) fclose(fa);
+    if (fb) fclose(fb);
+    return same;
+}
+
+static long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : 0;
+}
+
+// Remove the cache directory and the images in it.
+static void remove_cache(const char *dir) {
+    DIR *d = opendir(dir);
+    if (d) {
+        char path[2048];
+        for (struct dirent *e; (e = readdir(d));) {
+            if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+            unlink(path);
+        }
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--scale N] [--repeat N] [--out FILE] [--label TEXT] [--tako PATH] [--compiler PATH] [--work DIR] [workload...]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int scale = 1, repeat = 3;
+    const char *out = NULL, *label = "", *tako = "./tako", *compiler = "./compiler", *work = "bench/work";
+    bool selected[WORKLOAD_COUNT] = { false }, any_selected = false;
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(a, "--scale") == 0 && has_value) scale = atoi(argv[++i]);
+        else if (strcmp(a, "--repeat") == 0 && has_value) repeat = atoi(argv[++i]);
+        else if (strcmp(a, "--out") == 0 && has_value) out = argv[++i];
+        else if (strcmp(a, "--label") == 0 && has_value) label = argv[++i];
+        else if (strcmp(a, "--tako") == 0 && has_value) tako = argv[++i];
+        else if (strcmp(a, "--compiler") == 0 && has_value) compiler = argv[++i];
+        else if (strcmp(a, "--work") == 0 && has_value) work = argv[++i];
+        else {
+            int w = 0;
+            while (w < WORKLOAD_COUNT && strcmp(a, workloads[w].name) != 0) w++;
+            if (w == WORKLOAD_COUNT) usage(argv[0]);
+            selected[w] = any_selected = true;
+        }
+    }
+    if (scale < 1 || repeat < 1) usage(argv[0]);
+    if (mkdir(work, 0755) != 0 && errno != EEXIST) { perror(work); return 1; }
+    char cache_dir[1024];
+    snprintf(cache_dir, sizeof(cache_dir), "%s/cache-XXXXXX", work);
+    if (!mkdtemp(cache_dir)) { perror(cache_dir); return 1; }
+    setenv("TAKO_CACHE_DIR", cache_dir, 1);
+
+    FILE *json = out ? fopen(out, "w") : stdout;
+    if (!json) { perror(out); return 1; }
+    FILE *report = out ? stdout : stderr;
+    char script[1024], binary[1024], ref_out[1024], run_out[1024];
+    bool all_match = true;
+
+    fprintf(json, "{\n  \"label\": \"%s\",\n  \"scale\": %d,\n  \"repeat\": %d,\n", label, scale, repeat);
+
+    // Startup: a script that does nothing observable.
+    snprintf(script, sizeof(script), "%s/startup.tako", work);
+    snprintf(binary, sizeof(binary), "%s/startup.bin", work);
+    FILE *f = fopen(script, "w");
+    if (!f) { perror(script); return 1; }
+    fprintf(f, "set x = 0\n");
+    fclose(f);
+    fprintf(report, "%-10s %-18s %10s\n", "startup", "", "ms");
+    fprintf(json, "  \"startup\": [\n");
+    for (int c = 0; c < CONFIG_COUNT; c++) {
+        double compile_seconds;
+        bool ok = prepare(&configs[c], tako, compiler, script, binary, &compile_seconds);
+        RunResult r = ok ? measure(&configs[c], tako, script, binary, NULL, 10) : (RunResult){ 0, 0, false };
+        fprintf(report, "%-10s %-18s %10.3f%s\n", "", configs[c].name, r.seconds * 1e3, r.ok ? "" : "  FAILED");
+        fprintf(json, "    { \"config\": \"%s\", \"seconds\": %.6f, \"peak_rss_kb\": %ld, \"ok\": %s }%s\n",
+                configs[c].name, r.seconds, r.peak_rss_kb, r.ok ? "true" : "false", c + 1 < CONFIG_COUNT ? "," : "");
+    }
+    fprintf(json, "  ],\n  \"workloads\": [\n");
+
+    bool first_workload = true;
+    for (int w = 0; w < WORKLOAD_COUNT; w++) {
+        if (any_selected && !selected[w]) continue;
+        const Workload *wl = &workloads[w];
+        snprintf(script, sizeof(script), "%s/%s.tako", work, wl->name);
+        snprintf(binary, sizeof(binary), "%s/%s.bin", work, wl->name);
+        snprintf(ref_out, sizeof(ref_out), "%s/%s.ref.out", work, wl->name);
+        snprintf(run_out, sizeof(run_out), "%s/%s.out", work, wl->name);
+        f = fopen(script, "w");
+        if (!f) { perror(script); return 1; }
+        uint64_t ops = wl->generate(f, scale);
+        fclose(f);
+
+        fprintf(report, "%-10s %-18s %10s %14s %10s  (%llu %s, %ld bytes)\n", wl->name, "", "seconds", "ops/sec", "rss KiB",
+                (unsigned long long)ops, wl->unit, file_size(script));
+        fprintf(json, "%s    {\n      \"name\": \"%s\",\n      \"unit\": \"%s\",\n      \"ops\": %llu,\n      \"script_bytes\": %ld,\n      \"runs\": [\n",
+                first_workload ? "" : ",\n", wl->name, wl->unit, (unsigned long long)ops, file_size(script));
+        first_workload = false;
+        for (int c = 0; c < CONFIG_COUNT; c++) {
+            double compile_seconds;
+            bool ok = prepare(&configs[c], tako, compiler, script, binary, &compile_seconds);
+            const char *out_path = c == 0 ? ref_out : run_out;
+            RunResult r = ok ? measure(&configs[c], tako, script, binary, out_path, repeat) : (RunResult){ 0, 0, false };
+            bool match = r.ok && (c == 0 || same_file(ref_out, run_out));
+            all_match = all_match && match;
+            double rate = r.seconds > 0 ? ops / r.seconds : 0;
+            fprintf(report, "%-10s %-18s %10.4f %14.0f %10ld%s\n", "", configs[c].name, r.seconds, rate, r.peak_rss_kb,
+                    !ok ? "  COMPILE FAILED" : !r.ok ? "  FAILED" : !match ? "  OUTPUT DIFFERS" : "");
+            fprintf(json, "        { \"config\": \"%s\", \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"peak_rss_kb\": %ld, ",
+                    configs[c].name, r.seconds, rate, r.peak_rss_kb);
+            if (configs[c].compiled) fprintf(json, "\"compile_seconds\": %.6f, ", compile_seconds);
+            fprintf(json, "\"output_matches\": %s }%s\n", match ? "true" : "false", c + 1 < CONFIG_COUNT ? "," : "");
+        }
+        fprintf(json, "      ]\n    }");
+    }
+    fprintf(json, "\n  ],\n  \"outputs_match\": %s\n}\n", all_match ? "true" : "false");
+    if (out) { fclose(json); fprintf(report, "results written to %s\n", out); }
+    remove_cache(cache_dir);
+    return all_match ? 0 : 1;
+}
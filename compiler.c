@@ -3,80 +3,533 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <stdint.h>
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#include "source.h"
+#include "x64.h"
+#include "ir.h"
 
 // --- Configuration Constants ---
 #define MAX_VARS 100
 #define MAX_VAR_NAME 32
 #define MAX_STRINGS 100
-#define MAX_ARG_LEN 128
-#define MAX_LINES 1000
-#define MAX_LINE_LEN 256
+#define MAX_TOKENS 5
+
+// --- Executable Layout ---
+// Output is a static, non-PIE ELF64. One read+exec segment holds the headers,
+// the code and the string data; a second, zero-filled read+write segment holds
+// the output buffer, the variables that did not get a register and the loop
+// counters that did not. Every address fits in 32 bits.
+#define TEXT_VADDR 0x400000
+#define BSS_VADDR 0x40000000
+#define ELF_HEADER_SIZE 64
+#define PHDR_SIZE 56
+#define PHDR_COUNT 3
+#define HEADERS_SIZE (ELF_HEADER_SIZE + PHDR_COUNT * PHDR_SIZE)
+#define CODE_VADDR (TEXT_VADDR + HEADERS_SIZE)
+#define VARS_ADDR BSS_VADDR
+#define INT_BUFFER_ADDR (BSS_VADDR + MAX_VARS * 8)
+#define INT_BUFFER_SIZE 21
+#define OUT_LEN_ADDR (INT_BUFFER_ADDR + 24)
+#define OUT_BUFFER_ADDR (OUT_LEN_ADDR + 8)
+#define OUT_BUFFER_SIZE 65536
+#define COUNTERS_ADDR (OUT_BUFFER_ADDR + OUT_BUFFER_SIZE)
+// With --instrument, the loop counters are followed by out_fd and one
+// execution counter per source line.
+#define OUT_FD_ADDR(loops) (COUNTERS_ADDR + (loops) * 8)
+#define LINE_COUNTS_ADDR(loops) (OUT_FD_ADDR(loops) + 8)
+#define BSS_SIZE(words) (COUNTERS_ADDR - BSS_VADDR + (words) * 8)
+
+// A ploop with enough passes splits them across threads made with clone(2).
+// Each thread gets a block from mmap: its copy of the variables, its own loop
+// counters, a small header, and its stack at the top.
+#define PLOOP_MIN_PASSES 65536      // fewest passes worth handing to a thread
+#define PLOOP_MAX_THREADS 64
+#define PLOOP_STACK_SIZE 16384
+#define PLOOP_COUNTERS (MAX_VARS * 8)
+#define PLOOP_ENTRY(loops) (PLOOP_COUNTERS + (loops) * 8)   // worker routine
+#define PLOOP_PASSES(loops) (PLOOP_ENTRY(loops) + 8)
+#define PLOOP_TID(loops) (PLOOP_ENTRY(loops) + 16)          // zeroed by the kernel when the thread exits
+#define PLOOP_STRIDE(loops) ((PLOOP_TID(loops) + 8 + PLOOP_STACK_SIZE + 4095) & ~4095)
+#define CLONE_THREAD_FLAGS 0x250F00 // CLONE_VM | FS | FILES | SIGHAND | THREAD | SYSVSEM | CHILD_CLEARTID
 
 // --- Compiler State and Symbol Tables ---
-typedef struct { char name[MAX_VAR_NAME]; } VariableSymbol;
-typedef struct { char label[MAX_VAR_NAME]; char value[MAX_ARG_LEN]; } StringSymbol;
+// Names point into the loaded source, which outlives compilation. String
+// constants are the exact bytes to write, kept in the read-only data.
+typedef struct { const char *name; int len; } VariableSymbol;
+typedef struct { char label[MAX_VAR_NAME]; int data; int len; } StringSymbol;
+
+// A code label: its offset once bound, and a name for the assembly listing
+// (numbered .L labels have none).
+typedef struct { size_t offset; const char *name; } Label;
+
+// A 32-bit field in the code to fill in once layout is known: a jump or call
+// displacement to a label (data -1), a label's absolute address (data
+// FIXUP_ADDRESS), or an absolute address in the string data.
+typedef struct { size_t at; int label; int data; } Fixup;
+#define FIXUP_ADDRESS -2
+
+// A parallel loop: its IR_LOOP, loop number, worker routine, and the list of
+// sum variables (byte offsets into the variables, then -1) in the data.
+typedef struct { int head, loop, label, sums, sum_count; } Ploop;
+
+// The lines over which a variable or loop counter holds a live value, how
+// heavily it is used, and where it lives: an index into alloc_regs, or NO_REG
+// for its memory slot.
+typedef struct {
+    int start, end;
+    uint64_t weight;
+    bool seen;
+    int reg;
+} LiveRange;
+
 typedef struct {
-    FILE *outfile;
-    int label_count;
+    FILE *outfile;    // assembly listing, or NULL without --emit-asm
+    X64Buf code;
+    Label *labels;
+    int label_count, label_cap;
+    Fixup *fixups;
+    int fixup_count, fixup_cap;
+    char *data;       // read-only data placed after the code
+    int data_len, data_cap;
     VariableSymbol vars[MAX_VARS];
     int var_count;
     StringSymbol strings[MAX_STRINGS];
     int string_count;
+    char *text;         // output not yet emitted, merged into one string constant
+    int text_len, text_cap;
+    LiveRange var_ranges[MAX_VARS];
+    LiveRange *loops;   // one per loop, numbered in source order
+    int loop_count, loop_cap, next_loop;
+    bool instrument;    // count executions per line (--instrument)
+    int *counted_lines; // source line of each line counter
+    int counted_count, counted_cap;
+    int threads;        // --threads: most threads per ploop, 0 for one per CPU
+    bool parallel;      // ploops may run on threads (not with --instrument or --threads=1)
+    bool worker;        // generating a ploop worker: values live in the block at r15
+    Ploop *ploops;
+    int ploop_count, ploop_cap;
+    IrBlocks blocks;    // of the optimized IR, for planning ploops
+    // Runtime routines and data shared by all generated code.
+    int write_bytes, flush, print_int, ploop_run;
+    int digit_pairs;
 } CompilerState;
 
 // --- Helper Functions ---
-char* trim_leading(char *str) { while (isspace((unsigned char)*str)) str++; return str; }
-int new_label(CompilerState *state) { return state->label_count++; }
+
+// Grow a heap array so it can hold at least `need` elements of `size` bytes.
+void *grow_array(void *ptr, int *cap, int need, size_t size) {
+    if (need <= *cap) return ptr;
+    int new_cap = *cap ? *cap : 16;
+    while (new_cap < need) new_cap *= 2;
+    ptr = realloc(ptr, (size_t)new_cap * size);
+    if (!ptr) { perror("realloc"); exit(1); }
+    *cap = new_cap;
+    return ptr;
+}
+
+int new_named_label(CompilerState *state, const char *name) {
+    state->labels = grow_array(state->labels, &state->label_cap, state->label_count + 1, sizeof(Label));
+    state->labels[state->label_count] = (Label){ 0, name };
+    return state->label_count++;
+}
+
+int new_label(CompilerState *state) { return new_named_label(state, NULL); }
+
+// Append bytes to the read-only data and return their offset.
+int add_data(CompilerState *state, const char *bytes, int len) {
+    state->data = grow_array(state->data, &state->data_cap, state->data_len + len, 1);
+    memcpy(state->data + state->data_len, bytes, len);
+    state->data_len += len;
+    return state->data_len - len;
+}
 
 // --- Symbol Table Management ---
-int get_var_offset(CompilerState *state, const char *name) {
+int get_var(CompilerState *state, const Token *tok) {
     for (int i = 0; i < state->var_count; ++i) {
-        if (strcmp(state->vars[i].name, name) == 0) return i * 8;
+        if (state->vars[i].len == tok->len && memcmp(state->vars[i].name, tok->start, tok->len) == 0) return i;
     }
     if (state->var_count >= MAX_VARS) { fprintf(stderr, "Compiler Error: Too many variables.\n"); exit(1); }
     int index = state->var_count++;
-    strncpy(state->vars[index].name, name, MAX_VAR_NAME - 1); state->vars[index].name[MAX_VAR_NAME - 1] = '\0';
-    return index * 8;
+    state->vars[index].name = tok->start; state->vars[index].len = tok->len;
+    return index;
 }
 
-const char* get_string_label(CompilerState *state, const char *str) {
+int get_string(CompilerState *state, const char *bytes, int len) {
     for (int i = 0; i < state->string_count; ++i) {
-        if (strcmp(state->strings[i].value, str) == 0) return state->strings[i].label;
+        if (state->strings[i].len == len && memcmp(state->data + state->strings[i].data, bytes, len) == 0) return i;
     }
     if (state->string_count >= MAX_STRINGS) { fprintf(stderr, "Compiler Error: Too many string literals.\n"); exit(1); }
     int index = state->string_count++;
-    sprintf(state->strings[index].label, "str%d", index);
-    strncpy(state->strings[index].value, str, MAX_ARG_LEN - 1); state->strings[index].value[MAX_ARG_LEN - 1] = '\0';
-    return state->strings[index].label;
+    StringSymbol *s = &state->strings[index];
+    sprintf(s->label, "str%d", index);
+    s->len = len;
+    s->data = add_data(state, bytes, len);
+    return index;
 }
 
-bool is_number(const char* s) {
-    if (!s || *s == '\0') return false;
+bool is_number(const Token *tok) {
+    const char *s = tok->start, *end = tok->start + tok->len;
+    if (tok->is_string || s == end) return false;
     if (*s == '-') s++;
-    if (*s == '\0') return false;
-    while(*s) { if (!isdigit((unsigned char)*s)) return false; s++; }
+    if (s == end) return false;
+    while (s < end) { if (!isdigit((unsigned char)*s)) return false; s++; }
     return true;
 }
 
-// --- Code Generation ---
-void emit_load_value(CompilerState *state, const char *value_str) {
-    if (is_number(value_str)) {
-        fprintf(state->outfile, "    mov rax, %s\n", value_str);
+// Value of a numeric token, wrapping to 64 bits as the assembler would.
+int64_t number_value(const Token *tok) {
+    const char *s = tok->start, *end = tok->start + tok->len;
+    bool negative = *s == '-';
+    uint64_t value = 0;
+    for (s += negative; s < end; s++) value = value * 10 + (uint64_t)(*s - '0');
+    return (int64_t)(negative ? 0 - value : value);
+}
+
+// --- Instruction Emission ---
+// Each helper encodes one instruction into the code buffer and, with
+// --emit-asm, writes the same instruction to the NASM listing.
+
+static const char *reg64[] = { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                               "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" };
+static const char *reg32[] = { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+                               "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" };
+static const char *reg16[] = { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+                               "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w" };
+static const char *reg8[] = { "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+                              "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" };
+
+void emit_asm(CompilerState *state, const char *fmt, ...) {
+    if (!state->outfile) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(state->outfile, fmt, ap);
+    va_end(ap);
+}
+
+const char *alu_name(X64Alu op) { return op == ALU_ADD ? "add" : op == ALU_SUB ? "sub" : op == ALU_CMP ? "cmp" : op == ALU_XOR ? "xor" : op == ALU_AND ? "and" : "or"; }
+
+const char *jcc_name(X64Cond cc) {
+    switch (cc) {
+        case CC_E: return "je";
+        case CC_NE: return "jne";
+        case CC_L: return "jl";
+        case CC_GE: return "jge";
+        case CC_LE: return "jle";
+        case CC_B: return "jb";
+        case CC_AE: return "jae";
+        case CC_BE: return "jbe";
+        case CC_A: return "ja";
+        default: return "jg";
+    }
+}
+
+void emit_label(CompilerState *state, int label) {
+    Label *l = &state->labels[label];
+    l->offset = state->code.len;
+    if (l->name) emit_asm(state, "%s:\n", l->name);
+    else emit_asm(state, ".L%d:\n", label);
+}
+
+void add_fixup(CompilerState *state, size_t at, int label, int data) {
+    state->fixups = grow_array(state->fixups, &state->fixup_cap, state->fixup_count + 1, sizeof(Fixup));
+    state->fixups[state->fixup_count++] = (Fixup){ at, label, data };
+}
+
+void asm_label_ref(CompilerState *state, int label) {
+    if (state->labels[label].name) emit_asm(state, "%s\n", state->labels[label].name);
+    else emit_asm(state, ".L%d\n", label);
+}
+
+void emit_jump(CompilerState *state, int label) { emit_asm(state, "    jmp "); asm_label_ref(state, label); add_fixup(state, x64_jmp(&state->code), label, -1); }
+void emit_jcc(CompilerState *state, X64Cond cc, int label) { emit_asm(state, "    %s ", jcc_name(cc)); asm_label_ref(state, label); add_fixup(state, x64_jcc(&state->code, cc), label, -1); }
+void emit_call(CompilerState *state, int label) { emit_asm(state, "    call "); asm_label_ref(state, label); add_fixup(state, x64_call(&state->code), label, -1); }
+
+void emit_mov_imm(CompilerState *state, X64Reg r, int64_t v) {
+    emit_asm(state, "    mov %s, %lld\n", reg64[r], (long long)v);
+    if (v >= INT32_MIN && v <= INT32_MAX) x64_mov_ri_sx(&state->code, r, (int32_t)v);
+    else x64_mov_ri64(&state->code, r, (uint64_t)v);
+}
+
+// Load the address of a code label.
+void emit_mov_label(CompilerState *state, X64Reg r, int label) {
+    emit_asm(state, "    mov %s, ", reg64[r]); asm_label_ref(state, label);
+    x64_mov_ri(&state->code, r, 0);
+    add_fixup(state, state->code.len - 4, label, FIXUP_ADDRESS);
+}
+
+// Load the address of a piece of string data, named `name` in the listing.
+void emit_mov_data(CompilerState *state, X64Reg r, const char *name, int data) {
+    emit_asm(state, "    mov %s, %s\n", reg64[r], name);
+    x64_mov_ri(&state->code, r, 0);
+    add_fixup(state, state->code.len - 4, -1, data);
+}
+
+// Load the address of the integer formatting buffer plus `offset`.
+void emit_mov_int_buffer(CompilerState *state, X64Reg r, int offset) {
+    emit_asm(state, "    mov %s, int_buffer + %d\n", reg64[r], offset);
+    x64_mov_ri(&state->code, r, INT_BUFFER_ADDR + offset);
+}
+
+void emit_mov_rr(CompilerState *state, X64Reg d, X64Reg s) { emit_asm(state, "    mov %s, %s\n", reg64[d], reg64[s]); x64_mov_rr(&state->code, true, d, s); }
+void emit_alu_rr(CompilerState *state, X64Alu op, X64Reg d, X64Reg s) { emit_asm(state, "    %s %s, %s\n", alu_name(op), reg64[d], reg64[s]); x64_alu_rr(&state->code, op, true, d, s); }
+void emit_alu_ri(CompilerState *state, X64Alu op, X64Reg r, int32_t imm) { emit_asm(state, "    %s %s, %d\n", alu_name(op), reg64[r], imm); x64_alu_ri(&state->code, op, true, r, imm); }
+void emit_test_rr(CompilerState *state, X64Reg a, X64Reg b) { emit_asm(state, "    test %s, %s\n", reg64[a], reg64[b]); x64_test_rr(&state->code, true, a, b); }
+void emit_push(CompilerState *state, X64Reg r) { emit_asm(state, "    push %s\n", reg64[r]); x64_push(&state->code, r); }
+void emit_pop(CompilerState *state, X64Reg r) { emit_asm(state, "    pop %s\n", reg64[r]); x64_pop(&state->code, r); }
+void emit_inc(CompilerState *state, X64Reg r) { emit_asm(state, "    inc %s\n", reg64[r]); x64_inc_r(&state->code, true, r); }
+void emit_dec(CompilerState *state, X64Reg r) { emit_asm(state, "    dec %s\n", reg64[r]); x64_dec_r(&state->code, true, r); }
+void emit_neg(CompilerState *state, X64Reg r) { emit_asm(state, "    neg %s\n", reg64[r]); x64_neg_r(&state->code, true, r); }
+void emit_imul_ri(CompilerState *state, X64Reg r, int32_t imm) { emit_asm(state, "    imul %s, %s, %d\n", reg64[r], reg64[r], imm); x64_imul_rri(&state->code, true, r, r, imm); }
+void emit_div(CompilerState *state, X64Reg r) { emit_asm(state, "    div %s\n", reg64[r]); x64_div_r(&state->code, true, r); }
+void emit_syscall(CompilerState *state) { emit_asm(state, "    syscall\n"); x64_syscall(&state->code); }
+void emit_call_r(CompilerState *state, X64Reg r) { emit_asm(state, "    call %s\n", reg64[r]); x64_call_r(&state->code, r); }
+void emit_load(CompilerState *state, X64Reg r, X64Reg base, int32_t disp) { emit_asm(state, "    mov %s, [%s + %d]\n", reg64[r], reg64[base], disp); x64_load(&state->code, true, r, base, disp); }
+void emit_store(CompilerState *state, X64Reg base, int32_t disp, X64Reg r) { emit_asm(state, "    mov [%s + %d], %s\n", reg64[base], disp, reg64[r]); x64_store(&state->code, true, base, disp, r); }
+void emit_ret(CompilerState *state) { emit_asm(state, "    ret\n"); x64_ret(&state->code); }
+
+// --- Register Allocation ---
+// Before any code is generated, one pass over the block structure gives every
+// variable and loop counter a live range in IR positions. A range that reaches
+// into a loop body is widened to the whole loop, since the value travels around
+// the back edge. Ranges then get registers by linear scan; when none is free,
+// the range with the lightest use count (weighted by loop depth) stays in its
+// memory slot for its whole life.
+//
+// The runtime routines only clobber rax, rcx, rdx, rsi, rdi and r11 (the last
+// by syscall), so allocated registers survive calls with no spill or reload.
+
+static const X64Reg alloc_regs[] = { RBX, R12, R13, R14, R15, RBP, R8, R9, R10 };
+#define ALLOC_REG_COUNT (int)(sizeof(alloc_regs) / sizeof(alloc_regs[0]))
+#define NO_REG -1
+
+// One reference weighs ten times more per enclosing loop.
+uint64_t depth_weight(int loop_depth) {
+    uint64_t w = 1;
+    for (int i = 0; i < loop_depth && i < 6; i++) w *= 10;
+    return w;
+}
+
+// A variable's range starts at its first reference if that is an assignment
+// every run executes; otherwise it may be read as 0, so it starts at entry.
+void note_ref(CompilerState *state, IrValue v, int at, int loop_depth, bool unconditional_def) {
+    if (v.is_const) return;
+    LiveRange *r = &state->var_ranges[v.var];
+    if (!r->seen) { r->seen = true; r->start = unconditional_def ? at : 0; }
+    r->end = at;
+    r->weight += depth_weight(loop_depth);
+}
+
+// Record every reference and loop of the optimized program. Positions are
+// node indices.
+void analyze_program(CompilerState *state, const IrProgram *ir) {
+    int *open = NULL, open_count = 0, open_cap = 0;   // loop number of each open block, -1 for 'if'
+    int loop_depth = 0;
+    for (int i = 0; i < ir->count; i++) {
+        const IrNode *n = &ir->nodes[i];
+        if (n->op == IR_SET) { note_ref(state, n->a, i, loop_depth, false); note_ref(state, ir_var(n->dest), i, loop_depth, open_count == 0); }
+        else if (n->op == IR_IF || n->op == IR_LOOP) {
+            int loop = -1;
+            note_ref(state, n->a, i, loop_depth, false);
+            if (n->op == IR_LOOP) {
+                state->loops = grow_array(state->loops, &state->loop_cap, state->loop_count + 1, sizeof(LiveRange));
+                loop = state->loop_count++;
+                // The counter is tested and decremented once per iteration.
+                state->loops[loop] = (LiveRange){ i, ir->count, 2 * depth_weight(loop_depth + 1), true, NO_REG };
+                loop_depth++;
+            } else note_ref(state, n->b, i, loop_depth, false);
+            open = grow_array(open, &open_cap, open_count + 1, sizeof(int));
+            open[open_count++] = loop;
+        } else if (n->op == IR_END) {
+            int loop = open[--open_count];
+            if (loop >= 0) { state->loops[loop].end = i; loop_depth--; }
+        } else {
+            // Stores other than set read their destination too.
+            if (n->op <= IR_SUB_TIMES) note_ref(state, ir_var(n->dest), i, loop_depth, false);
+            note_ref(state, n->a, i, loop_depth, false);
+            note_ref(state, n->b, i, loop_depth, false);
+        }
+    }
+    free(open);
+}
+
+// Widen ranges over the loops whose bodies they reach into, until stable
+// (widening over an inner loop can make a range reach an outer one).
+void widen_ranges(CompilerState *state) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int v = 0; v < state->var_count; v++) {
+            LiveRange *r = &state->var_ranges[v];
+            if (!r->seen) continue;
+            for (int l = 0; l < state->loop_count; l++) {
+                const LiveRange *loop = &state->loops[l];
+                if (r->start >= loop->end || r->end <= loop->start) continue;
+                if (r->start <= loop->start && r->end >= loop->end) continue;
+                if (r->start > loop->start) r->start = loop->start;
+                if (r->end < loop->end) r->end = loop->end;
+                changed = true;
+            }
+        }
+    }
+}
+
+int compare_ranges(const void *a, const void *b) {
+    const LiveRange *x = *(LiveRange *const *)a, *y = *(LiveRange *const *)b;
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+    return (x->end > y->end) - (x->end < y->end);
+}
+
+void allocate_registers(CompilerState *state, const IrProgram *ir) {
+    analyze_program(state, ir);
+    widen_ranges(state);
+
+    // Variables the optimizer removed entirely keep their (unused) slots.
+    int total = 0;
+    LiveRange **order = malloc((size_t)(state->var_count + state->loop_count + 1) * sizeof(LiveRange *));
+    if (!order) { perror("malloc"); exit(1); }
+    for (int v = 0; v < state->var_count; v++) if (state->var_ranges[v].seen) order[total++] = &state->var_ranges[v];
+    for (int l = 0; l < state->loop_count; l++) order[total++] = &state->loops[l];
+    qsort(order, total, sizeof(LiveRange *), compare_ranges);
+
+    LiveRange *active[ALLOC_REG_COUNT];
+    int active_count = 0;
+    bool used[ALLOC_REG_COUNT] = { false };
+    for (int i = 0; i < total; i++) {
+        LiveRange *r = order[i];
+        for (int a = 0; a < active_count;) {
+            if (active[a]->end < r->start) { used[active[a]->reg] = false; active[a] = active[--active_count]; }
+            else a++;
+        }
+        int reg = 0;
+        while (reg < ALLOC_REG_COUNT && used[reg]) reg++;
+        if (reg < ALLOC_REG_COUNT) { r->reg = reg; used[reg] = true; active[active_count++] = r; continue; }
+        // All registers taken: whichever range is lightest lives in memory.
+        int lightest = 0;
+        for (int a = 1; a < active_count; a++) if (active[a]->weight < active[lightest]->weight) lightest = a;
+        if (active[lightest]->weight < r->weight) { r->reg = active[lightest]->reg; active[lightest]->reg = NO_REG; active[lightest] = r; }
+        else r->reg = NO_REG;
+    }
+    free(order);
+}
+
+// --- Operands ---
+// Where a script value lives while code is generated: a constant, an
+// allocated register, or a memory slot in the .bss segment. Inside a ploop
+// worker every slot is instead at `addr` in the thread's block, based at r15.
+typedef enum { OPND_IMM, OPND_REG, OPND_MEM } OperandKind;
+typedef struct { OperandKind kind; int64_t imm; X64Reg reg; int32_t addr; X64Reg base; } Operand;
+
+bool fits_imm32(int64_t v) { return v >= INT32_MIN && v <= INT32_MAX; }
+
+Operand reg_operand(X64Reg r) { return (Operand){ OPND_REG, 0, r, 0, X64_ABS }; }
+Operand imm_operand(int64_t v) { return (Operand){ OPND_IMM, v, RAX, 0, X64_ABS }; }
+
+Operand mem_operand(int32_t addr) { return (Operand){ OPND_MEM, 0, RAX, addr, X64_ABS }; }
+
+Operand range_operand(const LiveRange *r, int32_t addr) {
+    if (r->reg == NO_REG) return mem_operand(addr);
+    return reg_operand(alloc_regs[r->reg]);
+}
+
+Operand block_operand(int32_t offset) { return (Operand){ OPND_MEM, 0, RAX, offset, R15 }; }
+
+Operand var_operand(CompilerState *state, int var) {
+    if (state->worker) return block_operand(var * 8);
+    return range_operand(&state->var_ranges[var], VARS_ADDR + var * 8);
+}
+
+Operand value_operand(CompilerState *state, IrValue v) { return v.is_const ? imm_operand(v.value) : var_operand(state, v.var); }
+
+Operand loop_operand(CompilerState *state, int loop) {
+    if (state->worker) return block_operand(PLOOP_COUNTERS + loop * 8);
+    return range_operand(&state->loops[loop], COUNTERS_ADDR + loop * 8);
+}
+
+// Listing text for an operand, formatted into `buf` when needed.
+const char *operand_text(Operand o, char *buf, size_t size) {
+    if (o.kind == OPND_REG) return reg64[o.reg];
+    if (o.kind == OPND_IMM) snprintf(buf, size, "%lld", (long long)o.imm);
+    else if (o.base != X64_ABS) snprintf(buf, size, "[%s + %d]", reg64[o.base], o.addr);
+    else if (o.addr >= COUNTERS_ADDR) snprintf(buf, size, "[counters + %d]", o.addr - COUNTERS_ADDR);
+    else snprintf(buf, size, "[vars + %d]", o.addr - VARS_ADDR);
+    return buf;
+}
+
+// Size keyword the listing needs when no register fixes the operand size.
+const char *size_text(Operand dst, Operand src) { return dst.kind == OPND_MEM && src.kind == OPND_IMM ? "qword " : ""; }
+
+void emit_move(CompilerState *state, Operand dst, Operand src) {
+    if (dst.kind == OPND_REG && src.kind == OPND_REG && dst.reg == src.reg) return;
+    if (dst.kind == OPND_MEM && (src.kind == OPND_MEM || (src.kind == OPND_IMM && !fits_imm32(src.imm)))) {
+        emit_move(state, reg_operand(RAX), src);
+        src = reg_operand(RAX);
+    }
+    char a[48], b[48];
+    emit_asm(state, "    mov %s%s, %s\n", size_text(dst, src), operand_text(dst, a, sizeof(a)), operand_text(src, b, sizeof(b)));
+    if (dst.kind == OPND_MEM) {
+        if (src.kind == OPND_IMM) x64_store_imm(&state->code, true, dst.base, dst.addr, (int32_t)src.imm);
+        else x64_store(&state->code, true, dst.base, dst.addr, src.reg);
+    } else if (src.kind == OPND_IMM) {
+        if (fits_imm32(src.imm)) x64_mov_ri_sx(&state->code, dst.reg, (int32_t)src.imm);
+        else x64_mov_ri64(&state->code, dst.reg, (uint64_t)src.imm);
+    } else if (src.kind == OPND_REG) x64_mov_rr(&state->code, true, dst.reg, src.reg);
+    else x64_load(&state->code, true, dst.reg, src.base, src.addr);
+}
+
+// dst op= src, for a register or memory dst. Forms the instruction set lacks
+// go through a scratch register.
+void emit_alu(CompilerState *state, X64Alu op, Operand dst, Operand src) {
+    if ((src.kind == OPND_IMM && !fits_imm32(src.imm)) || (dst.kind == OPND_MEM && src.kind == OPND_MEM)) {
+        X64Reg scratch = dst.kind == OPND_REG && dst.reg == RAX ? RCX : RAX;
+        emit_move(state, reg_operand(scratch), src);
+        src = reg_operand(scratch);
+    }
+    char a[48], b[48];
+    emit_asm(state, "    %s %s%s, %s\n", alu_name(op), size_text(dst, src), operand_text(dst, a, sizeof(a)), operand_text(src, b, sizeof(b)));
+    if (dst.kind == OPND_REG) {
+        if (src.kind == OPND_IMM) x64_alu_ri(&state->code, op, true, dst.reg, (int32_t)src.imm);
+        else if (src.kind == OPND_REG) x64_alu_rr(&state->code, op, true, dst.reg, src.reg);
+        else x64_alu_rm(&state->code, op, true, dst.reg, src.base, src.addr);
     } else {
-        int offset = get_var_offset(state, value_str);
-        fprintf(state->outfile, "    mov rax, [vars + %d]\n", offset);
+        if (src.kind == OPND_IMM) x64_alu_mi(&state->code, op, true, dst.base, dst.addr, (int32_t)src.imm);
+        else x64_alu_mr(&state->code, op, true, dst.base, dst.addr, src.reg);
+    }
+}
+
+void emit_dec_operand(CompilerState *state, Operand o) {
+    if (o.kind == OPND_REG) { emit_dec(state, o.reg); return; }
+    char a[48];
+    emit_asm(state, "    dec qword %s\n", operand_text(o, a, sizeof(a)));
+    x64_dec_m(&state->code, true, o.base, o.addr);
+}
+
+// At entry, zero the registers of variables that may be read before they are
+// set (memory slots start out zeroed), and list the allocation.
+void emit_register_setup(CompilerState *state, const IrProgram *ir) {
+    for (int v = 0; v < state->var_count; v++) {
+        const LiveRange *r = &state->var_ranges[v];
+        if (!r->seen || r->reg == NO_REG) continue;
+        emit_asm(state, "    ; %.*s -> %s (lines %d-%d)\n", state->vars[v].len, state->vars[v].name, reg64[alloc_regs[r->reg]], ir->nodes[r->start].line, ir->nodes[r->end].line);
+        if (r->start == 0) emit_alu_rr(state, ALU_XOR, alloc_regs[r->reg], alloc_regs[r->reg]);
     }
 }
 
-void compile_script(CompilerState *state, char lines[][MAX_LINE_LEN], int line_count, int start_line, int end_line);
+// --- Parsing ---
+// The script becomes IR with variables numbered by first appearance. Errors
+// are reported as the line is read, whether or not it would ever run.
 
-int find_matching_end(char lines[][MAX_LINE_LEN], int line_count, int start_line) {
+int find_matching_end(const SourceFile *src, int start_line) {
     int depth = 1;
-    for (int i = start_line; i < line_count; i++) {
-        char temp_line[MAX_LINE_LEN]; strncpy(temp_line, lines[i], MAX_LINE_LEN);
-        char *line = trim_leading(temp_line);
-        if (strncmp(line, "if ", 3) == 0 || strncmp(line, "loop ", 5) == 0) depth++;
-        else if (strcmp(line, "end") == 0) {
+    Token toks[MAX_TOKENS];
+    for (int i = start_line; i < src->line_count; i++) {
+        int n = source_tokens(src, i, toks, MAX_TOKENS);
+        if (n >= 2 && (token_is(&toks[0], "if") || token_is(&toks[0], "loop") || token_is(&toks[0], "ploop"))) depth++;
+        else if (n == 1 && token_is(&toks[0], "end")) {
             depth--;
             if (depth == 0) return i;
         }
@@ -84,109 +537,664 @@ int find_matching_end(char lines[][MAX_LINE_LEN], int line_count, int start_line
     return -1;
 }
 
-void compile_script(CompilerState *state, char lines[][MAX_LINE_LEN], int line_count, int start_line, int end_line) {
-    for (int i = start_line; i < end_line; ++i) {
-        char line_buffer[MAX_LINE_LEN]; strncpy(line_buffer, lines[i], MAX_LINE_LEN - 1); line_buffer[MAX_LINE_LEN-1] = '\0';
-        char *clean_line = trim_leading(line_buffer);
-        if (*clean_line == '\0' || *clean_line == '#') continue;
-        fprintf(state->outfile, "\n    ; Line %d: %s\n", i + 1, clean_line);
-        char arg1[MAX_ARG_LEN] = {0}, arg2[MAX_ARG_LEN] = {0}, op[4] = {0};
+// The statement on a line, from its first token to the end without trailing
+// whitespace.
+const char *statement_text(const SourceFile *src, int line, int *text_len) {
+    Token toks[MAX_TOKENS];
+    size_t len; const char *start = source_line(src, line, &len);
+    if (source_tokens(src, line, toks, MAX_TOKENS) == 0) { *text_len = 0; return start; }
+    const char *text = toks[0].is_string ? toks[0].start - 1 : toks[0].start; *text_len = (int)(start + len - text);
+    while (*text_len > 0 && isspace((unsigned char)text[*text_len - 1])) (*text_len)--;
+    return text;
+}
+
+IrValue token_value(CompilerState *state, const Token *tok) { return is_number(tok) ? ir_const(number_value(tok)) : ir_var(get_var(state, tok)); }
 
-        if (sscanf(clean_line, "set %s = %s", arg1, arg2) == 2) { int offset = get_var_offset(state, arg1); emit_load_value(state, arg2); fprintf(state->outfile, "    mov [vars + %d], rax\n", offset); }
-        else if (sscanf(clean_line, "add %s %s", arg1, arg2) == 2) { int offset = get_var_offset(state, arg1); emit_load_value(state, arg2); fprintf(state->outfile, "    add [vars + %d], rax\n", offset); }
-        else if (sscanf(clean_line, "sub %s %s", arg1, arg2) == 2) { int offset = get_var_offset(state, arg1); emit_load_value(state, arg2); fprintf(state->outfile, "    sub [vars + %d], rax\n", offset); }
-        else if (sscanf(clean_line, "print \"%[^\"]\" %s", arg1, arg2) == 2) { const char* str_label = get_string_label(state, arg1); fprintf(state->outfile, "    mov rdi, %s\n    call print_string\n    mov rdi, ' '\n    call print_char\n", str_label); emit_load_value(state, arg2); fprintf(state->outfile, "    mov rdi, rax\n    call print_int\n    call print_newline\n"); }
-        else if (sscanf(clean_line, "print \"%[^\"]\"", arg1) == 1) { const char* str_label = get_string_label(state, arg1); fprintf(state->outfile, "    mov rdi, %s\n    call print_string\n    call print_newline\n", str_label); }
-        else if (sscanf(clean_line, "print %s", arg1) == 1) { emit_load_value(state, arg1); fprintf(state->outfile, "    mov rdi, rax\n    call print_int\n    call print_newline\n"); }
-        else if (strncmp(clean_line, "loop ", 5) == 0) { int start_label = new_label(state), end_label = new_label(state); emit_load_value(state, clean_line + 5); fprintf(state->outfile, "    mov rcx, rax\n.L%d:\n    cmp rcx, 0\n    jle .L%d\n", start_label, end_label); int block_end = find_matching_end(lines, line_count, i + 1); if (block_end == -1) { fprintf(stderr, "Syntax Error: 'loop' on line %d has no matching 'end'.\n", i + 1); exit(1); } compile_script(state, lines, line_count, i + 1, block_end); fprintf(state->outfile, "    dec rcx\n    jmp .L%d\n.L%d:\n", start_label, end_label); i = block_end; }
-        else if (strncmp(clean_line, "if ", 3) == 0) { if (sscanf(clean_line, "if %s %s %s", arg1, op, arg2) != 3) { fprintf(stderr, "Syntax Error: Malformed 'if' statement on line %d.\n", i + 1); exit(1); } int end_label = new_label(state); emit_load_value(state, arg1); fprintf(state->outfile, "    push rax\n"); emit_load_value(state, arg2); fprintf(state->outfile, "    pop rbx\n    cmp rbx, rax\n"); if (strcmp(op, "==") == 0) fprintf(state->outfile, "    jne .L%d\n", end_label); else if (strcmp(op, "!=") == 0) fprintf(state->outfile, "    je .L%d\n", end_label); else if (strcmp(op, ">") == 0) fprintf(state->outfile, "    jle .L%d\n", end_label); else if (strcmp(op, "<") == 0) fprintf(state->outfile, "    jge .L%d\n", end_label); else if (strcmp(op, ">=") == 0) fprintf(state->outfile, "    jl .L%d\n", end_label); else if (strcmp(op, "<=") == 0) fprintf(state->outfile, "    jg .L%d\n", end_label); else { fprintf(stderr, "Syntax Error: Unknown operator '%s' in 'if' on line %d.\n", op, i + 1); exit(1); } int block_end = find_matching_end(lines, line_count, i + 1); if (block_end == -1) { fprintf(stderr, "Syntax Error: 'if' on line %d has no matching 'end'.\n", i + 1); exit(1); } compile_script(state, lines, line_count, i + 1, block_end); fprintf(state->outfile, ".L%d:\n", end_label); i = block_end; }
-        else if (strcmp(clean_line, "end") != 0) { fprintf(stderr, "Syntax Error: Unknown command on line %d: '%s'\n", i+1, clean_line); exit(1); }
+void parse_script(CompilerState *state, const SourceFile *src, IrProgram *ir) {
+    Token toks[MAX_TOKENS];
+    int *ends = NULL, depth = 0, ends_cap = 0;   // line of the 'end' closing each open block
+    for (int i = 0; i < src->line_count; ++i) {
+        int n = source_tokens(src, i, toks, MAX_TOKENS);
+        if (n == 0) continue;
+        const Token *cmd = &toks[0]; IrNode *node;
+        if (depth > 0 && ends[depth - 1] == i) { ir_emit(ir, IR_END, i + 1); depth--; }
+        else if (token_is(cmd, "set") && n >= 4 && token_is(&toks[2], "=")) { node = ir_emit(ir, IR_SET, i + 1); node->dest = get_var(state, &toks[1]); node->a = token_value(state, &toks[3]); }
+        else if ((token_is(cmd, "add") || token_is(cmd, "sub")) && n >= 3) { node = ir_emit(ir, token_is(cmd, "add") ? IR_ADD : IR_SUB, i + 1); node->dest = get_var(state, &toks[1]); node->a = token_value(state, &toks[2]); }
+        else if (token_is(cmd, "print") && n >= 3 && toks[1].is_string) { node = ir_emit(ir, IR_PRINT_PAIR, i + 1); node->str = toks[1].start; node->str_len = toks[1].len; node->a = token_value(state, &toks[2]); }
+        else if (token_is(cmd, "print") && n == 2 && toks[1].is_string) { node = ir_emit(ir, IR_PRINT_STR, i + 1); node->str = toks[1].start; node->str_len = toks[1].len; }
+        else if (token_is(cmd, "print") && n >= 2) { node = ir_emit(ir, IR_PRINT_VAL, i + 1); node->a = token_value(state, &toks[1]); }
+        else if (token_is(cmd, "yield") && n == 1) ir_emit(ir, IR_YIELD, i + 1);
+        else if (token_is(cmd, "sleep") && n >= 2) { node = ir_emit(ir, IR_SLEEP, i + 1); node->a = token_value(state, &toks[1]); }
+        else if ((token_is(cmd, "loop") || token_is(cmd, "ploop") || token_is(cmd, "if")) && n >= 2) {
+            bool is_loop = !token_is(cmd, "if");
+            if (is_loop) { node = ir_emit(ir, IR_LOOP, i + 1); node->a = token_value(state, &toks[1]); node->parallel = token_is(cmd, "ploop"); }
+            else {
+                if (n < 4) { fprintf(stderr, "Syntax Error: Malformed 'if' statement on line %d.\n", i + 1); exit(1); }
+                const Token *op = &toks[2]; IrCmp cmp;
+                if (token_is(op, "==")) cmp = IR_EQ; else if (token_is(op, "!=")) cmp = IR_NE; else if (token_is(op, ">")) cmp = IR_GT; else if (token_is(op, "<")) cmp = IR_LT; else if (token_is(op, ">=")) cmp = IR_GE; else if (token_is(op, "<=")) cmp = IR_LE;
+                else { fprintf(stderr, "Syntax Error: Unknown operator '%.*s' in 'if' on line %d.\n", op->len, op->start, i + 1); exit(1); }
+                node = ir_emit(ir, IR_IF, i + 1); node->cmp = cmp; node->a = token_value(state, &toks[1]); node->b = token_value(state, &toks[3]);
+            }
+            int block_end = find_matching_end(src, i + 1); if (block_end == -1) { fprintf(stderr, "Syntax Error: '%.*s' on line %d has no matching 'end'.\n", cmd->len, cmd->start, i + 1); exit(1); }
+            ends = grow_array(ends, &ends_cap, depth + 1, sizeof(int));
+            ends[depth++] = block_end;
+        }
+        else if (!(n == 1 && token_is(cmd, "end"))) { int text_len; const char *text = statement_text(src, i, &text_len); fprintf(stderr, "Syntax Error: Unknown command on line %d: '%.*s'\n", i+1, text_len, text); exit(1); }
     }
+    free(ends);
 }
 
-void emit_prologue(CompilerState *state) {
-    fprintf(state->outfile, "section .data\n    minus_sign db '-', 0\n    newline db 10\n");
-    for (int i = 0; i < state->string_count; i++) { fprintf(state->outfile, "    %s db \"%s\", 0\n", state->strings[i].label, state->strings[i].value); }
-    fprintf(state->outfile, "\nsection .bss\n    vars resq %d\n    int_buffer resb 21\n", MAX_VARS);
-    fprintf(state->outfile, "\nsection .text\n    global _start\n\n");
-    fprintf(state->outfile, "print_string:\n    mov rbx, rdi\n    mov rdx, 0\n.strlen_loop:\n    cmp byte [rbx], 0\n    je .strlen_done\n    inc rdx\n    inc rbx\n    jmp .strlen_loop\n.strlen_done:\n    mov rax, 1\n    mov rsi, rdi\n    mov rdi, 1\n    syscall\n    ret\n\n");
-    fprintf(state->outfile, "print_int:\n    mov rax, rdi\n    mov rsi, int_buffer + 20\n    mov byte [rsi], 10\n    mov rcx, 10\n    cmp rax, 0\n    jge .p_loop\n    neg rax\n    push rax\n    mov rdi, minus_sign\n    call print_string\n    pop rax\n.p_loop:\n    xor rdx, rdx\n    div rcx\n    add rdx, '0'\n    dec rsi\n    mov [rsi], dl\n    test rax, rax\n    jnz .p_loop\n    inc rsi\n    mov rdi, rsi\n    mov rbx, int_buffer + 21\n    sub rbx, rsi\n    mov rdx, rbx\n    mov rax, 1\n    mov rsi, rdi\n    mov rdi, 1\n    syscall\n    ret\n\n");
-    fprintf(state->outfile, "print_newline:\n    mov rax, 1\n    mov rdi, 1\n    mov rsi, newline\n    mov rdx, 1\n    syscall\n    ret\n\n");
-    fprintf(state->outfile, "print_char:\n    mov [int_buffer], dil\n    mov rax, 1\n    mov rdi, 1\n    mov rsi, int_buffer\n    mov rdx, 1\n    syscall\n    ret\n\n");
-    fprintf(state->outfile, "_start:\n");
+// Every ploop must be able to run its passes in parallel; checked as written,
+// before optimization.
+void check_parallel(const CompilerState *state, const IrProgram *ir) {
+    bool ok = true;
+    IrBlocks blocks;
+    if (!ir_blocks_build(ir, &blocks)) { fprintf(stderr, "Compiler Error: Out of memory.\n"); exit(1); }
+    for (int i = 0; i < ir->count; i++) {
+        const IrNode *n = &ir->nodes[i];
+        if (n->op != IR_LOOP || !n->parallel) continue;
+        IrParallel plan;
+        if (!ir_parallel_plan(ir, &blocks, i, &plan)) {
+            char name[64] = "", why[256];
+            if (plan.var >= 0) snprintf(name, sizeof(name), "%.*s", state->vars[plan.var].len, state->vars[plan.var].name);
+            snprintf(why, sizeof(why), plan.reason, name);
+            fprintf(stderr, "Syntax Error: 'ploop' on line %d cannot run in parallel: line %d %s.\n", n->line, ir->nodes[plan.blocker].line, why);
+            ok = false;
+        }
+    }
+    ir_blocks_free(&blocks);
+    if (!ok) exit(1);
 }
 
-void emit_epilogue(CompilerState *state) { fprintf(state->outfile, "\n    mov rax, 60\n    xor rdi, rdi\n    syscall\n"); }
+// --- Code Generation ---
 
-// --- Main Compiler Driver ---
-int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <source_file.tako> <output_executable_name>\n", argv[0]);
-        return 1;
+// Output text known at compile time is collected here and written with a
+// single copy once something else has to be emitted.
+void add_text(CompilerState *state, const char *bytes, int len) {
+    state->text = grow_array(state->text, &state->text_cap, state->text_len + len, 1);
+    memcpy(state->text + state->text_len, bytes, len);
+    state->text_len += len;
+}
+
+void emit_text(CompilerState *state) {
+    if (state->text_len == 0) return;
+    int s = get_string(state, state->text, state->text_len);
+    emit_mov_data(state, RSI, state->strings[s].label, state->strings[s].data); emit_mov_imm(state, RDX, state->text_len); emit_call(state, state->write_bytes);
+    state->text_len = 0;
+}
+
+// rax *= src.
+void emit_imul(CompilerState *state, Operand src) {
+    char a[48];
+    if (src.kind == OPND_IMM && !fits_imm32(src.imm)) { emit_move(state, reg_operand(RCX), src); src = reg_operand(RCX); }
+    if (src.kind == OPND_IMM) { emit_asm(state, "    imul rax, rax, %lld\n", (long long)src.imm); x64_imul_rri(&state->code, true, RAX, RAX, (int32_t)src.imm); }
+    else if (src.kind == OPND_REG) { emit_asm(state, "    imul rax, %s\n", reg64[src.reg]); x64_imul_rr(&state->code, true, RAX, src.reg); }
+    else { emit_asm(state, "    imul rax, %s\n", operand_text(src, a, sizeof(a))); x64_imul_rm(&state->code, true, RAX, src.base, src.addr); }
+}
+
+// dst op= a * max(count, 0): a counted loop of adds in closed form.
+void emit_scaled(CompilerState *state, X64Alu op, Operand dst, Operand a, Operand count) {
+    if (count.kind == OPND_IMM) { emit_move(state, reg_operand(RAX), a); emit_imul(state, imm_operand(count.imm > 0 ? count.imm : 0)); }
+    else {
+        int positive = new_label(state);
+        emit_move(state, reg_operand(RAX), count); emit_test_rr(state, RAX, RAX); emit_jcc(state, CC_G, positive); emit_alu_rr(state, ALU_XOR, RAX, RAX); emit_label(state, positive);
+        emit_imul(state, a);
     }
-    const char *source_filename = argv[1];
-    const char *output_filename = argv[2];
+    emit_alu(state, op, dst, reg_operand(RAX));
+}
 
-    FILE *fp = fopen(source_filename, "r");
-    if (!fp) { perror("Error opening source file"); return 1; }
-    static char lines[MAX_LINES][MAX_LINE_LEN];
-    int line_count = 0;
-    while (line_count < MAX_LINES && fgets(lines[line_count], MAX_LINE_LEN, fp)) {
-        lines[line_count][strcspn(lines[line_count], "\r\n")] = 0;
-        line_count++;
+// Count one execution of `line` (--instrument).
+void emit_count_line(CompilerState *state, int line) {
+    state->counted_lines = grow_array(state->counted_lines, &state->counted_cap, state->counted_count + 1, sizeof(int));
+    int k = state->counted_count++;
+    state->counted_lines[k] = line;
+    emit_asm(state, "    inc qword [line_counts + %d]\n", 8 * k);
+    x64_inc_m(&state->code, true, X64_ABS, LINE_COUNTS_ADDR(state->loop_count) + 8 * k);
+}
+
+// Send flushed output to `fd` (--instrument only; otherwise it is always 1).
+void emit_set_out_fd(CompilerState *state, int fd) {
+    emit_asm(state, "    mov qword [out_fd], %d\n", fd);
+    x64_store_imm(&state->code, true, X64_ABS, OUT_FD_ADDR(state->loop_count), fd);
+}
+
+// Write "line count" pairs for every counted line to stderr, after the
+// program's own output has been flushed to stdout.
+void emit_line_report(CompilerState *state) {
+    emit_asm(state, "\n    ; Line counts\n");
+    emit_call(state, state->flush);
+    emit_set_out_fd(state, 2);
+    add_text(state, "--- line counts ---\n", 20);
+    for (int k = 0; k < state->counted_count; k++) {
+        emit_text(state); emit_mov_imm(state, RDI, state->counted_lines[k]); emit_call(state, state->print_int); add_text(state, " ", 1); emit_text(state);
+        emit_asm(state, "    mov rdi, [line_counts + %d]\n", 8 * k); x64_load(&state->code, true, RDI, X64_ABS, LINE_COUNTS_ADDR(state->loop_count) + 8 * k);
+        emit_call(state, state->print_int); add_text(state, "\n", 1);
     }
-    fclose(fp);
+    emit_text(state);
+}
 
-    char asm_filename[256], obj_filename[256];
-    snprintf(asm_filename, sizeof(asm_filename), "%s.asm", output_filename);
-    snprintf(obj_filename, sizeof(obj_filename), "%s.o", output_filename);
-    
-    FILE *outfile = fopen(asm_filename, "w");
-    if (!outfile) { perror("Error creating assembly file"); return 1; }
+// A ploop's first try: hand its passes to ploop_run, and on success continue
+// at `done`, past the sequential loop that follows. Variables kept in
+// registers are written to their slots first, so the threads copy them, and
+// read back after.
+void emit_ploop(CompilerState *state, const IrProgram *ir, int head, int loop, int done) {
+    IrParallel plan;
+    if (!ir_parallel_plan(ir, &state->blocks, head, &plan)) return;
+    state->ploops = grow_array(state->ploops, &state->ploop_cap, state->ploop_count + 1, sizeof(Ploop));
+    Ploop *p = &state->ploops[state->ploop_count++];
+    int64_t *sums = malloc((size_t)(plan.sum_count + 1) * sizeof(int64_t));
+    if (!sums) { perror("malloc"); exit(1); }
+    for (int k = 0; k < plan.sum_count; k++) sums[k] = plan.sums[k] * 8;
+    sums[plan.sum_count] = -1;
+    *p = (Ploop){ head, loop, new_label(state), add_data(state, (const char *)sums, (plan.sum_count + 1) * (int)sizeof(int64_t)), plan.sum_count };
+    free(sums);
 
-    CompilerState state;
-    memset(&state, 0, sizeof(CompilerState));
-    state.outfile = outfile;
-
-    for (int i=0; i < line_count; i++) {
-        char line_buffer[MAX_LINE_LEN], arg1[MAX_ARG_LEN];
-        strncpy(line_buffer, lines[i], MAX_LINE_LEN);
-        char *clean_line = trim_leading(line_buffer);
-        if (sscanf(clean_line, "print \"%[^\"]\"", arg1) == 1 || sscanf(clean_line, "print \"%[^\"]\" %*s", arg1) == 1) {
-            get_string_label(&state, arg1);
+    char name[32]; snprintf(name, sizeof(name), "ploop%d_sums", state->ploop_count - 1);
+    int sequential = new_label(state);
+    for (int v = 0; v < state->var_count; v++) {
+        const LiveRange *r = &state->var_ranges[v];
+        if (r->seen && r->reg != NO_REG && r->start <= head && r->end >= head) emit_move(state, mem_operand(VARS_ADDR + v * 8), var_operand(state, v));
+    }
+    emit_move(state, reg_operand(RSI), value_operand(state, ir->nodes[head].a)); emit_mov_label(state, RDI, p->label); emit_mov_data(state, RDX, name, p->sums); emit_call(state, state->ploop_run);
+    emit_test_rr(state, RAX, RAX); emit_jcc(state, CC_E, sequential);
+    for (int v = 0; v < state->var_count; v++) {
+        const LiveRange *r = &state->var_ranges[v];
+        if (r->seen && r->reg != NO_REG && r->start <= head && r->end >= head) emit_move(state, var_operand(state, v), mem_operand(VARS_ADDR + v * 8));
+    }
+    emit_jump(state, done);
+    emit_label(state, sequential);
+}
+
+// An open block while generating code.
+typedef struct { int body_label, end_label; Operand counter; bool is_loop; } OpenBlock;
+
+// Generate nodes [from, to), a whole number of blocks.
+void compile_range(CompilerState *state, const IrProgram *ir, const SourceFile *src, int from, int to) {
+    // Skip the block when the condition fails.
+    static const X64Cond skip[] = { [IR_EQ] = CC_NE, [IR_NE] = CC_E, [IR_GT] = CC_LE, [IR_LT] = CC_GE, [IR_GE] = CC_L, [IR_LE] = CC_G };
+    OpenBlock *open = NULL; int open_count = 0, open_cap = 0;
+    int listed_line = 0;
+    for (int i = from; i < to; i++) {
+        const IrNode *n = &ir->nodes[i];
+        // Text cannot be carried past the end of a block: it is jumped over or repeated.
+        if (n->op < IR_PRINT_STR || n->op > IR_PRINT_VAL) emit_text(state);
+        if (n->line != listed_line) {
+            int text_len; const char *text = statement_text(src, n->line - 1, &text_len); emit_asm(state, "\n    ; Line %d: %.*s\n", n->line, text_len, text); listed_line = n->line;
+            // An if's 'end' runs no code in the interpreter either.
+            if (state->instrument && !(n->op == IR_END && !open[open_count - 1].is_loop)) emit_count_line(state, n->line);
+        }
+
+        switch (n->op) {
+            case IR_SET: emit_move(state, var_operand(state, n->dest), value_operand(state, n->a)); break;
+            case IR_ADD: emit_alu(state, ALU_ADD, var_operand(state, n->dest), value_operand(state, n->a)); break;
+            case IR_SUB: emit_alu(state, ALU_SUB, var_operand(state, n->dest), value_operand(state, n->a)); break;
+            case IR_ADD_TIMES: emit_scaled(state, ALU_ADD, var_operand(state, n->dest), value_operand(state, n->a), value_operand(state, n->b)); break;
+            case IR_SUB_TIMES: emit_scaled(state, ALU_SUB, var_operand(state, n->dest), value_operand(state, n->a), value_operand(state, n->b)); break;
+            case IR_PRINT_STR: add_text(state, n->str, n->str_len); add_text(state, "\n", 1); break;
+            case IR_PRINT_PAIR: add_text(state, n->str, n->str_len); add_text(state, " ", 1); // fall through
+            case IR_PRINT_VAL:
+                // A value the optimizer folded to a constant is printed as text.
+                if (n->a.is_const) { char digits[24]; add_text(state, digits, snprintf(digits, sizeof(digits), "%lld", (long long)n->a.value)); }
+                else { emit_text(state); emit_move(state, reg_operand(RDI), value_operand(state, n->a)); emit_call(state, state->print_int); }
+                add_text(state, "\n", 1);
+                break;
+            case IR_YIELD: break;   // a binary is a single task
+            case IR_SLEEP: {
+                // Flush first, so output written before the pause shows
+                // before it, then nanosleep({ ms / 1000, ms % 1000 * 1000000 }).
+                int awake = new_label(state);
+                emit_move(state, reg_operand(RAX), value_operand(state, n->a)); emit_test_rr(state, RAX, RAX); emit_jcc(state, CC_LE, awake);
+                emit_call(state, state->flush);
+                emit_move(state, reg_operand(RAX), value_operand(state, n->a));
+                emit_alu_rr(state, ALU_XOR, RDX, RDX); emit_mov_imm(state, RCX, 1000); emit_div(state, RCX); emit_imul_ri(state, RDX, 1000000);
+                emit_push(state, RDX); emit_push(state, RAX);
+                emit_mov_imm(state, RAX, 35); emit_mov_rr(state, RDI, RSP); emit_alu_rr(state, ALU_XOR, RSI, RSI); emit_syscall(state);
+                emit_alu_ri(state, ALU_ADD, RSP, 16);
+                emit_label(state, awake);
+                break;
+            }
+            case IR_LOOP: case IR_IF: {
+                open = grow_array(open, &open_cap, open_count + 1, sizeof(OpenBlock));
+                OpenBlock *b = &open[open_count++];
+                b->is_loop = n->op == IR_LOOP; b->end_label = new_label(state);
+                if (b->is_loop) {
+                    if (n->parallel && state->parallel && !state->worker) emit_ploop(state, ir, i, state->next_loop, b->end_label);
+                    // Rotated: one test on entry, then decrement-and-branch at the bottom.
+                    b->counter = loop_operand(state, state->next_loop++); b->body_label = new_label(state);
+                    emit_move(state, b->counter, value_operand(state, n->a)); emit_alu(state, ALU_CMP, b->counter, imm_operand(0)); emit_jcc(state, CC_LE, b->end_label); emit_label(state, b->body_label);
+                } else {
+                    Operand lhs = value_operand(state, n->a);
+                    if (lhs.kind == OPND_IMM) { emit_move(state, reg_operand(RAX), lhs); lhs = reg_operand(RAX); }
+                    emit_alu(state, ALU_CMP, lhs, value_operand(state, n->b)); emit_jcc(state, skip[n->cmp], b->end_label);
+                }
+                break;
+            }
+            case IR_END: {
+                OpenBlock *b = &open[--open_count];
+                if (b->is_loop) { emit_dec_operand(state, b->counter); emit_jcc(state, CC_G, b->body_label); }
+                emit_label(state, b->end_label);
+                break;
+            }
+            // Not produced: variables start at 0 and errors stop the parse.
+            case IR_CHECK: case IR_BAD: break;
         }
     }
+    emit_text(state);
+    free(open);
+}
 
-    emit_prologue(&state);
-    compile_script(&state, lines, line_count, 0, line_count);
-    emit_epilogue(&state);
-    fclose(outfile);
-    printf("Generated assembly file: %s\n", asm_filename);
-
-    char command[512];
-    
-    // Assemble with NASM
-    snprintf(command, sizeof(command), "nasm -f elf64 -o %s %s", obj_filename, asm_filename);
-    printf("Running: %s\n", command);
-    if (system(command) != 0) {
-        fprintf(stderr, "Assembly failed. Make sure 'nasm' is installed.\n");
-        return 1;
+void compile_program(CompilerState *state, const IrProgram *ir, const SourceFile *src) { compile_range(state, ir, src, 0, ir->count); }
+
+// A ploop's worker routine, run by every thread on its own block: r15 points
+// at the block, which holds the number of passes. The body's variables and
+// loop counters all live in the block. Clobbers rax, rcx, rdx and rbx.
+void emit_ploop_worker(CompilerState *state, const IrProgram *ir, const SourceFile *src, const Ploop *p) {
+    int end = p->head + 1;
+    for (int depth = 1; depth > 0; end++) {
+        if (ir->nodes[end].op == IR_IF || ir->nodes[end].op == IR_LOOP) depth++;
+        else if (ir->nodes[end].op == IR_END) depth--;
     }
+    int body = new_label(state);
+    emit_asm(state, "\n    ; ploop worker for line %d\n", ir->nodes[p->head].line);
+    emit_label(state, p->label);
+    emit_load(state, RBX, R15, PLOOP_PASSES(state->loop_count));
+    emit_label(state, body);
+    state->worker = true; state->next_loop = p->loop + 1;
+    compile_range(state, ir, src, p->head + 1, end - 1);
+    state->worker = false;
+    emit_dec(state, RBX); emit_jcc(state, CC_NE, body); emit_ret(state);
+}
+
+// Load the address of a bss object, named `name` in the listing.
+void emit_mov_bss(CompilerState *state, X64Reg r, const char *name, uint32_t addr) { emit_asm(state, "    mov %s, %s\n", reg64[r], name); x64_mov_ri(&state->code, r, addr); }
+
+// Store the two digits of the table entry at pairs + 2 * r just below rsi.
+void emit_digit_pair(CompilerState *state, X64Reg r, X64Reg pairs) {
+    emit_alu_rr(state, ALU_ADD, r, r); emit_alu_rr(state, ALU_ADD, r, pairs);
+    emit_asm(state, "    movzx %s, word [%s]\n", reg32[r], reg64[r]); x64_movzx16(&state->code, r, r, 0);
+    emit_alu_ri(state, ALU_SUB, RSI, 2);
+    emit_asm(state, "    mov [rsi], %s\n", reg16[r]); x64_store16(&state->code, RSI, 0, r);
+}
+
+void emit_rep_movsq(CompilerState *state) { emit_asm(state, "    rep movsq\n"); x64_rep_movsq(&state->code); }
+void emit_store_tid(CompilerState *state, int32_t disp, int32_t v) { emit_asm(state, "    mov dword [rbx + %d], %d\n", disp, v); x64_store_imm(&state->code, false, RBX, disp, v); }
+
+// ploop_run(rdi = worker, rsi = passes, rdx = sum list): run a ploop's passes
+// on threads, one block (see PLOOP_STRIDE) per thread, with the calling thread
+// taking the last. Each block starts as a copy of the variables; afterwards
+// every sum gets the change each block made, and every other variable the
+// value the last block left, as if the passes had run in order. Returns 0 in
+// rax, having changed nothing, when the loop should run sequentially: too
+// few passes or CPUs, or no memory. Keeps every allocated register.
+void emit_ploop_run(CompilerState *state) {
+    static const X64Reg saved[] = { RBX, RBP, R8, R9, R10, R12, R13, R14, R15, RDX };
+    int saved_count = (int)(sizeof(saved) / sizeof(saved[0]));
+    int loops = state->loop_count; int32_t stride = PLOOP_STRIDE(loops);
+    state->ploop_run = new_named_label(state, "ploop_run");
+    int word = new_named_label(state, ".pr_word"), bits = new_named_label(state, ".pr_bits"), next_word = new_named_label(state, ".pr_next_word");
+    int counted = new_named_label(state, ".pr_counted"), capped = new_named_label(state, ".pr_capped"), enough = new_named_label(state, ".pr_enough");
+    int setup = new_named_label(state, ".pr_setup"), spawn = new_named_label(state, ".pr_spawn"), started = new_named_label(state, ".pr_started");
+    int join = new_named_label(state, ".pr_join"), joined = new_named_label(state, ".pr_joined"), sum = new_named_label(state, ".pr_sum");
+    int sum_block = new_named_label(state, ".pr_sum_block"), copy = new_named_label(state, ".pr_copy"), sequential = new_named_label(state, ".pr_sequential");
+    int done = new_named_label(state, ".pr_done"), run_block = new_named_label(state, ".pr_run_block"), child = new_named_label(state, ".pr_child");
+
+    emit_label(state, state->ploop_run);
+    for (int k = 0; k < saved_count; k++) emit_push(state, saved[k]);
+    emit_mov_rr(state, R12, RDI); emit_mov_rr(state, R13, RSI);
+    emit_test_rr(state, R13, R13); emit_jcc(state, CC_LE, sequential);
+    if (state->threads > 0) emit_mov_imm(state, RCX, state->threads);
+    else {
+        // One thread per CPU this process may run on: the bits set in its
+        // sched_getaffinity mask.
+        emit_alu_ri(state, ALU_SUB, RSP, 128);
+        emit_mov_imm(state, RAX, 204); emit_alu_rr(state, ALU_XOR, RDI, RDI); emit_mov_imm(state, RSI, 128); emit_mov_rr(state, RDX, RSP); emit_syscall(state);
+        emit_alu_rr(state, ALU_XOR, RCX, RCX); emit_alu_rr(state, ALU_XOR, RDX, RDX);
+        emit_label(state, word);
+        emit_alu_rr(state, ALU_CMP, RDX, RAX); emit_jcc(state, CC_GE, counted);
+        emit_mov_rr(state, R11, RSP); emit_alu_rr(state, ALU_ADD, R11, RDX); emit_load(state, R11, R11, 0);
+        emit_label(state, bits);
+        emit_test_rr(state, R11, R11); emit_jcc(state, CC_E, next_word);
+        emit_mov_rr(state, RSI, R11); emit_dec(state, RSI); emit_alu_rr(state, ALU_AND, R11, RSI); emit_inc(state, RCX); emit_jump(state, bits);
+        emit_label(state, next_word);
+        emit_alu_ri(state, ALU_ADD, RDX, 8); emit_jump(state, word);
+        emit_label(state, counted);
+        emit_alu_ri(state, ALU_ADD, RSP, 128);
+    }
+    // threads = min(that, PLOOP_MAX_THREADS, passes / PLOOP_MIN_PASSES),
+    // at least 2
+    emit_alu_ri(state, ALU_CMP, RCX, PLOOP_MAX_THREADS); emit_jcc(state, CC_BE, capped); emit_mov_imm(state, RCX, PLOOP_MAX_THREADS);
+    emit_label(state, capped);
+    emit_mov_rr(state, RAX, R13); emit_alu_rr(state, ALU_XOR, RDX, RDX); emit_mov_imm(state, R11, PLOOP_MIN_PASSES); emit_div(state, R11);
+    emit_alu_rr(state, ALU_CMP, RCX, RAX); emit_jcc(state, CC_BE, enough); emit_mov_rr(state, RCX, RAX);
+    emit_label(state, enough);
+    emit_alu_ri(state, ALU_CMP, RCX, 2); emit_jcc(state, CC_B, sequential);
+    emit_mov_rr(state, R14, RCX);
+
+    // mmap(NULL, threads * stride, PROT_READ | PROT_WRITE,
+    //      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+    emit_mov_rr(state, RSI, R14); emit_imul_ri(state, RSI, stride);
+    emit_mov_imm(state, RAX, 9); emit_alu_rr(state, ALU_XOR, RDI, RDI); emit_mov_imm(state, RDX, 3); emit_mov_imm(state, R10, 0x22); emit_mov_imm(state, R8, -1); emit_alu_rr(state, ALU_XOR, R9, R9); emit_syscall(state);
+    emit_alu_ri(state, ALU_CMP, RAX, -4096); emit_jcc(state, CC_A, sequential);
+    emit_mov_rr(state, R15, RAX);
+
+    // Fill in the blocks: passes / threads each, the last one the rest.
+    emit_mov_rr(state, RAX, R13); emit_alu_rr(state, ALU_XOR, RDX, RDX); emit_div(state, R14); emit_mov_rr(state, RBP, RAX);
+    emit_mov_rr(state, RBX, R15); emit_mov_rr(state, R8, R14);
+    emit_label(state, setup);
+    emit_mov_bss(state, RSI, "vars", VARS_ADDR); emit_mov_rr(state, RDI, RBX); emit_mov_imm(state, RCX, MAX_VARS); emit_rep_movsq(state);
+    emit_store(state, RBX, PLOOP_ENTRY(loops), R12); emit_store(state, RBX, PLOOP_PASSES(loops), RBP); emit_store_tid(state, PLOOP_TID(loops), 1);
+    emit_alu_ri(state, ALU_ADD, RBX, stride); emit_dec(state, R8); emit_jcc(state, CC_NE, setup);
+    emit_mov_rr(state, RAX, R14); emit_dec(state, RAX);
+    emit_asm(state, "    imul rax, rbp\n"); x64_imul_rr(&state->code, true, RAX, RBP);
+    emit_mov_rr(state, RCX, R13); emit_alu_rr(state, ALU_SUB, RCX, RAX); emit_store(state, RBX, PLOOP_PASSES(loops) - stride, RCX);
 
-    // Link with GCC driver - this is the robust way
-    
-    snprintf(command, sizeof(command), "gcc -no-pie -nostartfiles -o %s %s", output_filename, obj_filename);
-    printf("Running: %s\n", command);
-    if (system(command) != 0) {
-        fprintf(stderr, "Linking failed. Make sure 'gcc' is installed.\n");
+    // clone(flags, stack, NULL, &tid, 0) for every block but the last, which
+    // this thread runs; a block whose thread could not start runs here too.
+    emit_mov_rr(state, RBX, R15); emit_mov_rr(state, RBP, R14); emit_dec(state, RBP);
+    emit_label(state, spawn);
+    emit_mov_imm(state, RAX, 56); emit_mov_imm(state, RDI, CLONE_THREAD_FLAGS); emit_mov_rr(state, RSI, RBX); emit_alu_ri(state, ALU_ADD, RSI, stride);
+    emit_alu_rr(state, ALU_XOR, RDX, RDX); emit_mov_rr(state, R10, RBX); emit_alu_ri(state, ALU_ADD, R10, PLOOP_TID(loops)); emit_alu_rr(state, ALU_XOR, R8, R8); emit_syscall(state);
+    emit_test_rr(state, RAX, RAX); emit_jcc(state, CC_E, child); emit_jcc(state, CC_G, started);
+    emit_call(state, run_block);
+    emit_label(state, started);
+    emit_alu_ri(state, ALU_ADD, RBX, stride); emit_dec(state, RBP); emit_jcc(state, CC_NE, spawn);
+    emit_call(state, run_block);
+
+    // Join: futex(&tid, FUTEX_WAIT, tid) until the kernel clears each tid.
+    emit_mov_rr(state, RBX, R15); emit_mov_rr(state, RBP, R14); emit_dec(state, RBP);
+    emit_label(state, join);
+    emit_asm(state, "    mov eax, [rbx + %d]\n", PLOOP_TID(loops)); x64_load(&state->code, false, RAX, RBX, PLOOP_TID(loops));
+    emit_test_rr(state, RAX, RAX); emit_jcc(state, CC_E, joined);
+    emit_mov_rr(state, RDX, RAX); emit_mov_rr(state, RDI, RBX); emit_alu_ri(state, ALU_ADD, RDI, PLOOP_TID(loops)); emit_alu_rr(state, ALU_XOR, RSI, RSI); emit_alu_rr(state, ALU_XOR, R10, R10);
+    emit_mov_imm(state, RAX, 202); emit_syscall(state); emit_jump(state, join);
+    emit_label(state, joined);
+    emit_alu_ri(state, ALU_ADD, RBX, stride); emit_dec(state, RBP); emit_jcc(state, CC_NE, join);
+
+    // rbx is the last block. Each sum there becomes its old value plus
+    // every block's change to it.
+    emit_mov_rr(state, RDI, RBX); emit_load(state, RSI, RSP, 0);
+    emit_label(state, sum);
+    emit_load(state, R11, RSI, 0); emit_test_rr(state, R11, R11); emit_jcc(state, CC_L, copy);
+    emit_mov_rr(state, RDX, R11); emit_alu_ri(state, ALU_ADD, RDX, VARS_ADDR); emit_load(state, R8, RDX, 0); emit_mov_rr(state, RAX, R8);
+    emit_mov_rr(state, RBX, R15); emit_mov_rr(state, RBP, R14);
+    emit_label(state, sum_block);
+    emit_mov_rr(state, RCX, RBX); emit_alu_rr(state, ALU_ADD, RCX, R11); emit_load(state, RCX, RCX, 0); emit_alu_rr(state, ALU_SUB, RCX, R8); emit_alu_rr(state, ALU_ADD, RAX, RCX);
+    emit_alu_ri(state, ALU_ADD, RBX, stride); emit_dec(state, RBP); emit_jcc(state, CC_NE, sum_block);
+    emit_mov_rr(state, RCX, RDI); emit_alu_rr(state, ALU_ADD, RCX, R11); emit_store(state, RCX, 0, RAX);
+    emit_alu_ri(state, ALU_ADD, RSI, 8); emit_jump(state, sum);
+    // Then the last block becomes the variables, and the blocks are unmapped.
+    emit_label(state, copy);
+    emit_mov_rr(state, RSI, RDI); emit_mov_bss(state, RDI, "vars", VARS_ADDR); emit_mov_imm(state, RCX, MAX_VARS); emit_rep_movsq(state);
+    emit_mov_imm(state, RAX, 11); emit_mov_rr(state, RDI, R15); emit_mov_rr(state, RSI, R14); emit_imul_ri(state, RSI, stride); emit_syscall(state);
+    emit_mov_imm(state, RAX, 1); emit_jump(state, done);
+    emit_label(state, sequential);
+    emit_alu_rr(state, ALU_XOR, RAX, RAX);
+    emit_label(state, done);
+    for (int k = saved_count - 1; k >= 0; k--) emit_pop(state, saved[k]);
+    emit_ret(state);
+    emit_asm(state, "\n");
+
+    // run_block(rbx = block): run its passes on this thread.
+    emit_label(state, run_block);
+    emit_push(state, R15); emit_push(state, RBX); emit_mov_rr(state, R15, RBX); emit_load(state, RAX, R15, PLOOP_ENTRY(loops)); emit_call_r(state, RAX);
+    emit_pop(state, RBX); emit_pop(state, R15); emit_store_tid(state, PLOOP_TID(loops), 0);
+    emit_ret(state);
+    emit_asm(state, "\n");
+
+    // A new thread starts here with its stack at the top of its block, and
+    // exits when its passes are done.
+    emit_label(state, child);
+    emit_mov_rr(state, R15, RSP); emit_alu_ri(state, ALU_SUB, R15, stride); emit_load(state, RAX, R15, PLOOP_ENTRY(loops)); emit_call_r(state, RAX);
+    emit_mov_imm(state, RAX, 60); emit_alu_rr(state, ALU_XOR, RDI, RDI); emit_syscall(state);
+    emit_asm(state, "\n");
+}
+
+// Runtime routines, emitted ahead of _start. Output is appended to out_buffer,
+// which is written out when it fills up and at exit. The routines may clobber
+// only rax, rcx, rdx, rsi, rdi and r11: the rest hold allocated variables.
+void emit_prologue(CompilerState *state) {
+    char pairs[200];
+    for (int i = 0; i < 100; i++) { pairs[2 * i] = (char)('0' + i / 10); pairs[2 * i + 1] = (char)('0' + i % 10); }
+    state->digit_pairs = add_data(state, pairs, sizeof(pairs));
+    state->write_bytes = new_named_label(state, "write_bytes");
+    state->flush = new_named_label(state, "flush");
+    state->print_int = new_named_label(state, "print_int");
+    int wb_copy = new_named_label(state, ".wb_copy"), write_all = new_named_label(state, "write_all"), wa_done = new_named_label(state, ".wa_done");
+    int pi_pairs = new_named_label(state, ".pi_pairs"), pi_last = new_named_label(state, ".pi_last"), pi_digit = new_named_label(state, ".pi_digit");
+    int pi_sign = new_named_label(state, ".pi_sign"), pi_out = new_named_label(state, ".pi_out");
+
+    emit_asm(state, "section .text\n    global _start\n\n");
+
+    // write_bytes(rsi = bytes, rdx = length): flush first if they do not fit;
+    // anything longer than the whole buffer is written directly.
+    emit_label(state, state->write_bytes);
+    emit_asm(state, "    mov rax, [out_len]\n"); x64_load(&state->code, true, RAX, X64_ABS, OUT_LEN_ADDR);
+    emit_mov_rr(state, RCX, RAX); emit_alu_rr(state, ALU_ADD, RCX, RDX); emit_alu_ri(state, ALU_CMP, RCX, OUT_BUFFER_SIZE); emit_jcc(state, CC_BE, wb_copy);
+    emit_push(state, RSI); emit_push(state, RDX); emit_call(state, state->flush); emit_pop(state, RDX); emit_pop(state, RSI); emit_alu_rr(state, ALU_XOR, RAX, RAX);
+    emit_alu_ri(state, ALU_CMP, RDX, OUT_BUFFER_SIZE); emit_jcc(state, CC_A, write_all);
+    emit_label(state, wb_copy);
+    emit_mov_bss(state, RDI, "out_buffer", OUT_BUFFER_ADDR); emit_alu_rr(state, ALU_ADD, RDI, RAX); emit_mov_rr(state, RCX, RDX);
+    emit_asm(state, "    rep movsb\n"); x64_rep_movsb(&state->code);
+    emit_asm(state, "    add [out_len], rdx\n"); x64_alu_mr(&state->code, ALU_ADD, true, X64_ABS, OUT_LEN_ADDR, RDX);
+    emit_ret(state);
+    emit_asm(state, "\n");
+
+    // flush(): write out and empty the buffer, falling into write_all.
+    emit_label(state, state->flush);
+    emit_asm(state, "    mov rdx, [out_len]\n"); x64_load(&state->code, true, RDX, X64_ABS, OUT_LEN_ADDR);
+    emit_mov_bss(state, RSI, "out_buffer", OUT_BUFFER_ADDR);
+    emit_asm(state, "    mov qword [out_len], 0\n"); x64_store_imm(&state->code, true, X64_ABS, OUT_LEN_ADDR, 0);
+    // write_all(rsi = bytes, rdx = length): loops over short writes; on an
+    // error the rest is dropped.
+    emit_label(state, write_all);
+    emit_test_rr(state, RDX, RDX); emit_jcc(state, CC_E, wa_done);
+    emit_mov_imm(state, RAX, 1);
+    if (state->instrument) { emit_asm(state, "    mov rdi, [out_fd]\n"); x64_load(&state->code, true, RDI, X64_ABS, OUT_FD_ADDR(state->loop_count)); }
+    else emit_mov_imm(state, RDI, 1);
+    emit_syscall(state);
+    emit_test_rr(state, RAX, RAX); emit_jcc(state, CC_LE, wa_done);
+    emit_alu_rr(state, ALU_ADD, RSI, RAX); emit_alu_rr(state, ALU_SUB, RDX, RAX); emit_jump(state, write_all);
+    emit_label(state, wa_done);
+    emit_ret(state);
+    emit_asm(state, "\n");
+
+    // print_int(rdi = value): digits are built backwards from the end of
+    // int_buffer two at a time, dividing by 100 as a multiply by its
+    // reciprocal, then appended like any other bytes.
+    emit_label(state, state->print_int);
+    emit_mov_rr(state, RAX, RDI); emit_mov_int_buffer(state, RSI, INT_BUFFER_SIZE); emit_mov_data(state, R11, "digit_pairs", state->digit_pairs);
+    emit_test_rr(state, RAX, RAX); emit_jcc(state, CC_GE, pi_pairs); emit_neg(state, RAX);
+    emit_label(state, pi_pairs);
+    emit_alu_ri(state, ALU_CMP, RAX, 100); emit_jcc(state, CC_B, pi_last);
+    emit_mov_rr(state, RCX, RAX);
+    emit_asm(state, "    shr rax, 2\n"); x64_shr_ri(&state->code, true, RAX, 2);
+    emit_mov_imm(state, RDX, 0x28F5C28F5C28F5C3);
+    emit_asm(state, "    mul rdx\n"); x64_mul_r(&state->code, true, RDX);
+    emit_asm(state, "    shr rdx, 2\n"); x64_shr_ri(&state->code, true, RDX, 2);
+    emit_mov_rr(state, RAX, RDX);
+    emit_asm(state, "    imul rdx, rdx, 100\n"); x64_imul_rri(&state->code, true, RDX, RDX, 100);
+    emit_alu_rr(state, ALU_SUB, RCX, RDX); emit_digit_pair(state, RCX, R11); emit_jump(state, pi_pairs);
+    emit_label(state, pi_last);
+    emit_alu_ri(state, ALU_CMP, RAX, 10); emit_jcc(state, CC_B, pi_digit);
+    emit_digit_pair(state, RAX, R11); emit_jump(state, pi_sign);
+    emit_label(state, pi_digit);
+    emit_alu_ri(state, ALU_ADD, RAX, '0'); emit_dec(state, RSI);
+    emit_asm(state, "    mov [rsi], %s\n", reg8[RAX]); x64_store8(&state->code, RSI, 0, RAX);
+    emit_label(state, pi_sign);
+    emit_test_rr(state, RDI, RDI); emit_jcc(state, CC_GE, pi_out); emit_dec(state, RSI);
+    emit_asm(state, "    mov byte [rsi], '-'\n"); x64_store8_imm(&state->code, RSI, 0, '-');
+    emit_label(state, pi_out);
+    emit_mov_int_buffer(state, RDX, INT_BUFFER_SIZE); emit_alu_rr(state, ALU_SUB, RDX, RSI); emit_jump(state, state->write_bytes);
+    emit_asm(state, "\n");
+
+    if (state->parallel) emit_ploop_run(state);
+    emit_label(state, new_named_label(state, "_start"));
+}
+
+// Listing form of raw bytes: quoted runs of printable characters, other bytes
+// as numbers.
+void emit_asm_bytes(CompilerState *state, const char *bytes, int len) {
+    for (int i = 0; i < len;) {
+        if (i > 0) emit_asm(state, ", ");
+        int run = 0;
+        while (i + run < len && isprint((unsigned char)bytes[i + run]) && bytes[i + run] != '"') run++;
+        if (run > 0) { emit_asm(state, "\"%.*s\"", run, bytes + i); i += run; }
+        else emit_asm(state, "%d", (unsigned char)bytes[i++]);
+    }
+    emit_asm(state, "\n");
+}
+
+void emit_epilogue(CompilerState *state, const IrProgram *ir, const SourceFile *src) {
+    emit_asm(state, "\n");
+    emit_call(state, state->flush);
+    // exit_group, so no ploop thread can outlive the program.
+    emit_mov_imm(state, RAX, 231); emit_alu_rr(state, ALU_XOR, RDI, RDI); emit_syscall(state);
+    for (int k = 0; k < state->ploop_count; k++) emit_ploop_worker(state, ir, src, &state->ploops[k]);
+
+    // The listing places the data after the code, as the binary does.
+    emit_asm(state, "\nsection .data\n    digit_pairs db ");
+    emit_asm_bytes(state, state->data + state->digit_pairs, 200);
+    for (int i = 0; i < state->string_count; i++) { emit_asm(state, "    %s db ", state->strings[i].label); emit_asm_bytes(state, state->data + state->strings[i].data, state->strings[i].len); }
+    for (int k = 0; k < state->ploop_count; k++) {
+        emit_asm(state, "    ploop%d_sums dq ", k);
+        for (int s = 0; s < state->ploops[k].sum_count; s++) { int64_t offset; memcpy(&offset, state->data + state->ploops[k].sums + 8 * s, 8); emit_asm(state, "%lld, ", (long long)offset); }
+        emit_asm(state, "-1\n");
+    }
+    emit_asm(state, "\nsection .bss\n    vars resq %d\n    int_buffer resb %d\n    alignb 8\n    out_len resq 1\n    out_buffer resb %d\n", MAX_VARS, INT_BUFFER_SIZE, OUT_BUFFER_SIZE);
+    if (state->loop_count > 0) emit_asm(state, "    counters resq %d\n", state->loop_count);
+    if (state->instrument) emit_asm(state, "    out_fd resq 1\n    line_counts resq %d\n", state->counted_count);
+}
+
+// Resolve every label and data reference now that the code size is final.
+void resolve_fixups(CompilerState *state) {
+    uint32_t data_vaddr = CODE_VADDR + (uint32_t)state->code.len;
+    for (int i = 0; i < state->fixup_count; i++) {
+        Fixup *f = &state->fixups[i];
+        if (f->label >= 0 && f->data != FIXUP_ADDRESS) { x64_patch(&state->code, f->at, state->labels[f->label].offset); continue; }
+        uint32_t addr = f->label >= 0 ? CODE_VADDR + (uint32_t)state->labels[f->label].offset : data_vaddr + (uint32_t)f->data;
+        for (int k = 0; k < 4; k++) state->code.code[f->at + k] = (unsigned char)(addr >> (8 * k));
+    }
+}
+
+// --- ELF Output ---
+
+void put16(unsigned char *p, uint16_t v) { p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8); }
+void put32(unsigned char *p, uint32_t v) { put16(p, (uint16_t)v); put16(p + 2, (uint16_t)(v >> 16)); }
+void put64(unsigned char *p, uint64_t v) { put32(p, (uint32_t)v); put32(p + 4, (uint32_t)(v >> 32)); }
+
+void put_phdr(unsigned char *p, uint32_t type, uint32_t flags, uint64_t offset, uint64_t vaddr, uint64_t filesz, uint64_t memsz, uint64_t align) {
+    put32(p, type); put32(p + 4, flags); put64(p + 8, offset); put64(p + 16, vaddr); put64(p + 24, vaddr);
+    put64(p + 32, filesz); put64(p + 40, memsz); put64(p + 48, align);
+}
+
+// Write a static executable: ELF header, program headers, code, data.
+int write_elf(const char *path, const CompilerState *state, uint32_t entry) {
+    unsigned char hdr[HEADERS_SIZE] = {0};
+    uint64_t text_size = HEADERS_SIZE + state->code.len + (uint64_t)state->data_len;
+    uint64_t bss_size = BSS_SIZE(state->loop_count + (state->instrument ? 1 + state->counted_count : 0));
+
+    memcpy(hdr, "\x7f" "ELF", 4);
+    hdr[4] = 2;                           // 64-bit
+    hdr[5] = 1;                           // little-endian
+    hdr[6] = 1;                           // ELF version
+    put16(hdr + 16, 2);                   // ET_EXEC
+    put16(hdr + 18, 62);                  // EM_X86_64
+    put32(hdr + 20, 1);
+    put64(hdr + 24, entry);
+    put64(hdr + 32, ELF_HEADER_SIZE);     // program headers follow the ELF header
+    put16(hdr + 52, ELF_HEADER_SIZE);
+    put16(hdr + 54, PHDR_SIZE);
+    put16(hdr + 56, PHDR_COUNT);
+    put16(hdr + 58, 64);                  // section header size (there are none)
+
+    unsigned char *ph = hdr + ELF_HEADER_SIZE;
+    put_phdr(ph, 1, 4 | 1, 0, TEXT_VADDR, text_size, text_size, 0x1000);          // PT_LOAD, R+X
+    put_phdr(ph + PHDR_SIZE, 1, 4 | 2, 0, BSS_VADDR, 0, bss_size, 0x1000);        // PT_LOAD, R+W
+    put_phdr(ph + 2 * PHDR_SIZE, 0x6474e551, 4 | 2, 0, 0, 0, 0, 16);              // PT_GNU_STACK, no exec
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return -1;
+    bool ok = fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr) &&
+              fwrite(state->code.code, 1, state->code.len, fp) == state->code.len &&
+              fwrite(state->data, 1, state->data_len, fp) == (size_t)state->data_len;
+    if (fclose(fp) != 0 || !ok) return -1;
+#ifndef _WIN32
+    chmod(path, 0755);
+#endif
+    return 0;
+}
+
+// --- Main Compiler Driver ---
+int main(int argc, char *argv[]) {
+    bool emit_asm_file = false, instrument = false;
+    int opt_level = IR_OPT_DEFAULT, threads = 0;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "--emit-asm") == 0) emit_asm_file = true;
+        else if (strcmp(argv[arg], "--instrument") == 0) instrument = true;
+        else if (strncmp(argv[arg], "--threads=", 10) == 0) threads = atoi(argv[arg] + 10);
+        else if (argv[arg][1] == 'O' && argv[arg][2] >= '0' && argv[arg][2] <= '2' && argv[arg][3] == '\0') opt_level = argv[arg][2] - '0';
+        else break;
+    }
+    if (argc - arg < 2) {
+        fprintf(stderr, "Usage: %s [--emit-asm] [--instrument] [--threads=N] [-O0|-O1|-O2] <source_file.tako> <output_executable_name>\n", argv[0]);
         return 1;
     }
+    const char *source_filename = argv[arg];
+    const char *output_filename = argv[arg + 1];
+
+    SourceFile src;
+    if (source_load(&src, source_filename) != 0) { perror("Error opening source file"); return 1; }
 
-    printf("\nSuccess! Created executable: %s\n", output_filename);
+    CompilerState state;
+    memset(&state, 0, sizeof(CompilerState));
+    state.instrument = instrument;
+    state.threads = threads > 0 ? threads : 0;
+
+    // With --emit-asm, the same program is also written out as NASM source.
+    char asm_filename[1024];
+    if (emit_asm_file) {
+        snprintf(asm_filename, sizeof(asm_filename), "%s.asm", output_filename);
+        state.outfile = fopen(asm_filename, "w");
+        if (!state.outfile) { perror("Error creating assembly file"); return 1; }
+    }
+
+    IrProgram ir;
+    ir_init(&ir, 64, true);
+    parse_script(&state, &src, &ir);
+    if (ir.oom) { fprintf(stderr, "Compiler Error: Out of memory.\n"); return 1; }
+    check_parallel(&state, &ir);
+    ir_optimize(&ir, opt_level);
+    if (ir.oom || !ir_blocks_build(&ir, &state.blocks)) { fprintf(stderr, "Compiler Error: Out of memory.\n"); return 1; }
+    allocate_registers(&state, &ir);
+    // Line counts are not shared between threads, so --instrument runs every
+    // ploop sequentially.
+    for (int i = 0; i < ir.count; i++) state.parallel |= ir.nodes[i].parallel && !instrument && state.threads != 1;
+    emit_prologue(&state);
+    uint32_t entry = CODE_VADDR + (uint32_t)state.code.len;
+    if (state.instrument) emit_set_out_fd(&state, 1);
+    emit_register_setup(&state, &ir);
+    compile_program(&state, &ir, &src);
+    if (state.instrument) emit_line_report(&state);
+    emit_epilogue(&state, &ir, &src);
+    ir_blocks_free(&state.blocks);
+    ir_free(&ir);
+    source_free(&src);
+    if (state.outfile) { fclose(state.outfile); printf("Generated assembly file: %s\n", asm_filename); }
 
-    // Clean up intermediate files
-    remove(asm_filename);
-    remove(obj_filename);
+    if (state.code.oom) { fprintf(stderr, "Compiler Error: Out of memory.\n"); return 1; }
+    if (TEXT_VADDR + HEADERS_SIZE + state.code.len + (size_t)state.data_len > BSS_VADDR) { fprintf(stderr, "Compiler Error: Program too large.\n"); return 1; }
+    resolve_fixups(&state);
+    if (write_elf(output_filename, &state, entry) != 0) { perror("Error writing executable"); return 1; }
 
+    printf("Success! Created executable: %s\n", output_filename);
+    x64_free(&state.code);
+    free(state.labels);
+    free(state.loops);
+    free(state.counted_lines);
+    free(state.ploops);
+    free(state.text);
+    free(state.fixups);
+    free(state.data);
     return 0;
 }
@@ -0,0 +1,505 @@
+#include "ir.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// --- Building ---
+
+void ir_init(IrProgram *ir, int bits, bool zero_init) {
+    memset(ir, 0, sizeof(IrProgram));
+    ir->bits = bits;
+    ir->zero_init = zero_init;
+}
+
+void ir_free(IrProgram *ir) {
+    free(ir->nodes);
+    ir->nodes = NULL;
+    ir->count = ir->cap = 0;
+}
+
+IrValue ir_const(int64_t value) { return (IrValue){ true, value, 0 }; }
+IrValue ir_var(int var) { return (IrValue){ false, 0, var }; }
+
+static IrNode *push(IrProgram *ir, IrNode node) {
+    if (ir->count == ir->cap && !ir->oom) {
+        int cap = ir->cap ? ir->cap * 2 : 64;
+        IrNode *grown = realloc(ir->nodes, (size_t)cap * sizeof(IrNode));
+        if (grown) {
+            ir->nodes = grown;
+            ir->cap = cap;
+        } else {
+            ir->oom = true;
+        }
+    }
+    if (ir->oom) {
+        ir->spare = node;
+        return &ir->spare;
+    }
+    ir->nodes[ir->count] = node;
+    return &ir->nodes[ir->count++];
+}
+
+IrNode *ir_emit(IrProgram *ir, IrOp op, int line) {
+    IrNode node = { .op = op, .line = line, .a = ir_const(0), .b = ir_const(0) };
+    return push(ir, node);
+}
+
+// --- Helpers ---
+
+static bool is_store(IrOp op) { return op <= IR_SUB_TIMES; }
+
+// For every IR_IF/IR_LOOP the index of its IR_END, and the reverse. NULL
+// when out of memory.
+static int *match_blocks(const IrProgram *ir) {
+    int *match = malloc(((size_t)ir->count + 1) * sizeof(int));
+    int *stack = malloc(((size_t)ir->count + 1) * sizeof(int));
+    if (!match || !stack) {
+        free(match);
+        free(stack);
+        return NULL;
+    }
+    int depth = 0;
+    for (int i = 0; i < ir->count; i++) {
+        match[i] = -1;
+        if (ir->nodes[i].op == IR_IF || ir->nodes[i].op == IR_LOOP) stack[depth++] = i;
+        else if (ir->nodes[i].op == IR_END) { match[i] = stack[--depth]; match[match[i]] = i; }
+    }
+    free(stack);
+    return match;
+}
+
+static int var_count(const IrProgram *ir) {
+    int count = 0;
+    for (int i = 0; i < ir->count; i++) {
+        const IrNode *n = &ir->nodes[i];
+        if (is_store(n->op) && n->dest >= count) count = n->dest + 1;
+        if (!n->a.is_const && n->a.var >= count) count = n->a.var + 1;
+        if (!n->b.is_const && n->b.var >= count) count = n->b.var + 1;
+    }
+    return count;
+}
+
+// Arithmetic as the backend does it: two's complement, wrapped to its width.
+static int64_t wrap(const IrProgram *ir, uint64_t v) {
+    return ir->bits == 32 ? (int64_t)(int32_t)(uint32_t)v : (int64_t)v;
+}
+
+static int64_t times(const IrProgram *ir, int64_t a, int64_t b) {
+    return b > 0 ? wrap(ir, (uint64_t)a * (uint64_t)b) : 0;
+}
+
+static bool compare(IrCmp cmp, int64_t a, int64_t b) {
+    switch (cmp) {
+        case IR_EQ: return a == b;
+        case IR_NE: return a != b;
+        case IR_GT: return a > b;
+        case IR_LT: return a < b;
+        case IR_GE: return a >= b;
+        default:    return a <= b;
+    }
+}
+
+// --- Constant Propagation ---
+// One forward pass that tracks what is known about each variable, substitutes
+// known values into operands and folds what it can. Blocks whose outcome is
+// known are spliced in or dropped, as are blocks left empty.
+
+typedef enum { KNOWN_UNSET, KNOWN_SET, KNOWN_CONST } KnownState;
+typedef struct { KnownState state; int64_t value; } Known;
+
+typedef struct {
+    const IrProgram *in;
+    IrProgram *out;
+    const int *match;
+    int vars;
+} Fold;
+
+static IrValue subst(const Known *k, IrValue v) {
+    if (!v.is_const && k[v.var].state == KNOWN_CONST) return ir_const(k[v.var].value);
+    return v;
+}
+
+// What holds after either of two paths: agreement, or the weaker fact.
+static Known meet(Known k, Known other) {
+    if (k.state == other.state && k.value == other.value) return k;
+    k.state = k.state == KNOWN_UNSET || other.state == KNOWN_UNSET ? KNOWN_UNSET : KNOWN_SET;
+    return k;
+}
+
+static void fold_block(Fold *f, int from, int to, Known *k);
+
+// Emit a block head, its folded body and its end, unless the body folds away.
+// Only variables the body stores to or checks can differ after it, so just
+// those are saved beforehand and met afterwards; the cost follows the size
+// of the block rather than the number of variables.
+static void fold_nested(Fold *f, IrNode head, int i, Known *k) {
+    int end = f->match[i], at = f->out->count, touched = 0;
+    int *vars = malloc((size_t)(end - i) * sizeof(int));
+    Known *saved = malloc((size_t)(end - i) * sizeof(Known));
+    if (!vars || !saved) {
+        free(vars);
+        free(saved);
+        f->out->oom = true;
+        return;
+    }
+    for (int j = i + 1; j < end; j++) {
+        const IrNode *m = &f->in->nodes[j];
+        int v = is_store(m->op) ? m->dest : m->op == IR_CHECK ? m->a.var : -1;
+        if (v < 0) continue;
+        vars[touched] = v;
+        saved[touched++] = k[v];
+    }
+    push(f->out, head);
+    fold_block(f, i + 1, end, k);
+    if (f->out->count == at + 1) f->out->count = at;
+    else push(f->out, f->in->nodes[end]);
+    for (int t = 0; t < touched; t++) k[vars[t]] = meet(saved[t], k[vars[t]]);
+    free(vars);
+    free(saved);
+}
+
+static void fold_block(Fold *f, int from, int to, Known *k) {
+    const IrProgram *ir = f->in;
+    for (int i = from; i < to; i++) {
+        IrNode n = ir->nodes[i];
+        n.a = subst(k, n.a);
+        n.b = subst(k, n.b);
+        switch (n.op) {
+            case IR_SET:
+                k[n.dest] = n.a.is_const ? (Known){ KNOWN_CONST, n.a.value } : (Known){ KNOWN_SET, 0 };
+                push(f->out, n);
+                break;
+            case IR_ADD_TIMES:
+            case IR_SUB_TIMES:
+                if (n.a.is_const && n.b.is_const) {
+                    n.op = n.op == IR_ADD_TIMES ? IR_ADD : IR_SUB;
+                    n.a = ir_const(times(ir, n.a.value, n.b.value));
+                    n.b = ir_const(0);
+                }
+                // fall through
+            case IR_ADD:
+            case IR_SUB:
+                if ((n.op == IR_ADD || n.op == IR_SUB) && n.a.is_const) {
+                    if (n.a.value == 0) break;
+                    if (k[n.dest].state == KNOWN_CONST) {
+                        uint64_t v = (uint64_t)k[n.dest].value;
+                        v = n.op == IR_ADD ? v + (uint64_t)n.a.value : v - (uint64_t)n.a.value;
+                        k[n.dest].value = wrap(ir, v);
+                        n.op = IR_SET;
+                        n.a = ir_const(k[n.dest].value);
+                        push(f->out, n);
+                        break;
+                    }
+                }
+                k[n.dest] = (Known){ KNOWN_SET, 0 };
+                push(f->out, n);
+                break;
+            case IR_CHECK: {
+                int v = ir->nodes[i].a.var;
+                if (k[v].state != KNOWN_UNSET) break;
+                k[v].state = KNOWN_SET; // or the script has stopped
+                push(f->out, ir->nodes[i]);
+                break;
+            }
+            case IR_IF:
+                if (n.a.is_const && n.b.is_const) {
+                    if (compare(n.cmp, n.a.value, n.b.value)) fold_block(f, i + 1, f->match[i], k);
+                } else {
+                    fold_nested(f, n, i, k);
+                }
+                i = f->match[i];
+                break;
+            case IR_LOOP:
+                if (n.a.is_const && n.a.value == 1) {
+                    fold_block(f, i + 1, f->match[i], k);
+                } else if (!n.a.is_const || n.a.value > 1) {
+                    // Nothing the body assigns is known on entry to a later pass.
+                    for (int j = i + 1; j < f->match[i]; j++) {
+                        const IrNode *m = &ir->nodes[j];
+                        if (is_store(m->op) && k[m->dest].state == KNOWN_CONST) k[m->dest].state = KNOWN_SET;
+                    }
+                    fold_nested(f, n, i, k);
+                }
+                i = f->match[i];
+                break;
+            default:
+                push(f->out, n);
+                break;
+        }
+    }
+}
+
+// Out of memory, the input is kept and `oom` set.
+static void fold(IrProgram *ir) {
+    if (ir->oom) return;
+    IrProgram out;
+    ir_init(&out, ir->bits, ir->zero_init);
+    Fold f = { ir, &out, match_blocks(ir), var_count(ir) };
+    Known *k = malloc(((size_t)f.vars + 1) * sizeof(Known));
+    if (f.match && k) {
+        for (int v = 0; v < f.vars; v++) k[v] = ir->zero_init ? (Known){ KNOWN_CONST, 0 } : (Known){ KNOWN_UNSET, 0 };
+        fold_block(&f, 0, ir->count, k);
+    }
+    free(k);
+    free((void *)f.match);
+    if (!f.match || !k || out.oom) {
+        ir_free(&out);
+        ir->oom = true;
+        return;
+    }
+    ir_free(ir);
+    *ir = out;
+}
+
+// --- Dead Store Elimination ---
+// A backward liveness pass; a store to a variable that is not live after it
+// is removed. Nothing is live at the end of the script. Around a loop, every
+// variable the body reads counts as live at the end of the body.
+
+typedef struct {
+    const IrProgram *ir;
+    const int *match;
+    bool *dead;
+    int words;
+    bool oom;
+} Dse;
+
+static bool live_has(const uint64_t *live, int v) { return (live[v / 64] >> (v % 64)) & 1; }
+static void live_add(uint64_t *live, IrValue v) { if (!v.is_const) live[v.var / 64] |= 1ull << (v.var % 64); }
+static void live_remove(uint64_t *live, int v) { live[v / 64] &= ~(1ull << (v % 64)); }
+
+static void dse_block(Dse *d, int from, int to, uint64_t *live) {
+    for (int i = to - 1; i >= from; i--) {
+        const IrNode *n = &d->ir->nodes[i];
+        if (is_store(n->op)) {
+            if (!live_has(live, n->dest)) { d->dead[i] = true; continue; }
+            if (n->op == IR_SET) live_remove(live, n->dest);
+            live_add(live, n->a);
+            live_add(live, n->b);
+            continue;
+        }
+        if (n->op != IR_END) {
+            live_add(live, n->a);
+            live_add(live, n->b);
+            continue;
+        }
+        int head = d->match[i];
+        if (d->ir->nodes[head].op == IR_LOOP) {
+            for (int j = head + 1; j < i; j++) {
+                live_add(live, d->ir->nodes[j].a);
+                live_add(live, d->ir->nodes[j].b);
+                if (d->ir->nodes[j].op >= IR_ADD && d->ir->nodes[j].op <= IR_SUB_TIMES) live_add(live, ir_var(d->ir->nodes[j].dest));
+            }
+        }
+        uint64_t *body = malloc(((size_t)d->words + 1) * sizeof(uint64_t));
+        if (!body) {
+            d->oom = true;
+            return;
+        }
+        memcpy(body, live, (size_t)d->words * sizeof(uint64_t));
+        dse_block(d, head + 1, i, body);
+        for (int w = 0; w < d->words; w++) live[w] |= body[w];
+        free(body);
+        live_add(live, d->ir->nodes[head].a);
+        live_add(live, d->ir->nodes[head].b);
+        i = head;
+    }
+}
+
+// Out of memory, nothing is removed and `oom` is set.
+static void remove_dead_stores(IrProgram *ir) {
+    if (ir->oom) return;
+    Dse d = { ir, match_blocks(ir), calloc((size_t)ir->count + 1, sizeof(bool)), (var_count(ir) + 63) / 64, false };
+    uint64_t *live = calloc((size_t)d.words + 1, sizeof(uint64_t));
+    if (d.match && d.dead && live) dse_block(&d, 0, ir->count, live);
+    if (!d.match || !d.dead || !live || d.oom) {
+        ir->oom = true;
+    } else {
+        int kept = 0;
+        for (int i = 0; i < ir->count; i++) if (!d.dead[i]) ir->nodes[kept++] = ir->nodes[i];
+        ir->count = kept;
+    }
+    free(live);
+    free(d.dead);
+    free((void *)d.match);
+}
+
+// --- Loop Closed Forms ---
+// A loop whose body only adds or subtracts amounts that the body does not
+// change, into variables the body reads nowhere else, ends with each of them
+// moved by amount * count. Bodies are rewritten innermost first, so nests of
+// such loops collapse completely.
+
+static bool closed_form(IrProgram *out, int at, IrValue count) {
+    IrNode *body = &out->nodes[at + 1];
+    int len = out->count - at - 1;
+    if (len == 0) return false;
+    for (int j = 0; j < len; j++) {
+        if (body[j].op != IR_ADD && body[j].op != IR_SUB) return false;
+        for (int m = 0; m < len; m++) {
+            int dest = body[m].dest;
+            if ((!body[j].a.is_const && body[j].a.var == dest) || (!count.is_const && count.var == dest)) return false;
+        }
+    }
+    for (int j = 0; j < len; j++) {
+        IrNode n = body[j];
+        if (n.a.is_const && count.is_const) {
+            n.a = ir_const(times(out, n.a.value, count.value));
+        } else {
+            n.op = n.op == IR_ADD ? IR_ADD_TIMES : IR_SUB_TIMES;
+            n.b = count;
+        }
+        out->nodes[at + j] = n;
+    }
+    out->count = at + len;
+    return true;
+}
+
+static void close_loops(const IrProgram *in, const int *match, int from, int to, IrProgram *out) {
+    for (int i = from; i < to; i++) {
+        const IrNode *n = &in->nodes[i];
+        if (n->op != IR_LOOP) {
+            push(out, *n);
+            continue;
+        }
+        int at = out->count;
+        push(out, *n);
+        close_loops(in, match, i + 1, match[i], out);
+        if (!closed_form(out, at, n->a)) push(out, in->nodes[match[i]]);
+        i = match[i];
+    }
+}
+
+// Out of memory, the input is kept and `oom` set.
+static void rewrite_loops(IrProgram *ir) {
+    if (ir->oom) return;
+    IrProgram out;
+    ir_init(&out, ir->bits, ir->zero_init);
+    int *match = match_blocks(ir);
+    if (match) close_loops(ir, match, 0, ir->count, &out);
+    free(match);
+    if (!match || out.oom) {
+        ir_free(&out);
+        ir->oom = true;
+        return;
+    }
+    ir_free(ir);
+    *ir = out;
+}
+
+// --- Parallel Loops ---
+
+typedef enum { USE_NONE, USE_READ, USE_PRIVATE, USE_SUM } VarUse;
+
+static bool block(IrParallel *plan, int at, const char *reason, int var) {
+    plan->blocker = at;
+    plan->reason = reason;
+    plan->var = var;
+    return false;
+}
+
+// A read of `v` at node `at`: fine unless `v` is a sum.
+static bool parallel_read(IrParallel *plan, unsigned char *use, IrValue v, int at) {
+    if (v.is_const) return true;
+    if (use[v.var] == USE_SUM) return block(plan, at, "reads '%s', which the loop sums", v.var);
+    if (use[v.var] == USE_NONE) use[v.var] = USE_READ;
+    return true;
+}
+
+static bool parallel_body(const IrProgram *ir, int head, int end, IrParallel *plan, unsigned char *use) {
+    int depth = 0;
+    for (int i = head + 1; i < end; i++) {
+        const IrNode *n = &ir->nodes[i];
+        switch (n->op) {
+            case IR_PRINT_STR:
+            case IR_PRINT_PAIR:
+            case IR_PRINT_VAL:
+                return block(plan, i, "prints", -1);
+            case IR_YIELD:
+                return block(plan, i, "yields", -1);
+            case IR_SLEEP:
+                return block(plan, i, "sleeps", -1);
+            case IR_BAD:
+                return block(plan, i, "has an unknown command", -1);
+            case IR_CHECK:
+                break;  // a guard, not a use
+            case IR_END:
+                depth--;
+                break;
+            case IR_IF:
+            case IR_LOOP:
+                if (!parallel_read(plan, use, n->a, i) || !parallel_read(plan, use, n->b, i)) return false;
+                depth++;
+                break;
+            case IR_SET:
+                if (!parallel_read(plan, use, n->a, i)) return false;
+                if (use[n->dest] == USE_PRIVATE) break;
+                if (use[n->dest] == USE_READ) return block(plan, i, "sets '%s' after reading the value from the pass before", n->dest);
+                if (use[n->dest] == USE_SUM) return block(plan, i, "sets '%s', which the loop sums", n->dest);
+                if (depth > 0) return block(plan, i, "sets '%s' only on some passes", n->dest);
+                use[n->dest] = USE_PRIVATE;
+                break;
+            default:  // add, sub and their closed forms
+                if (!parallel_read(plan, use, n->a, i) || !parallel_read(plan, use, n->b, i)) return false;
+                if (use[n->dest] == USE_PRIVATE || use[n->dest] == USE_SUM) break;
+                if (use[n->dest] == USE_READ) return block(plan, i, "changes '%s' after reading it", n->dest);
+                use[n->dest] = USE_SUM;
+                plan->sums[plan->sum_count++] = n->dest;
+                break;
+        }
+    }
+    return true;
+}
+
+bool ir_blocks_build(const IrProgram *ir, IrBlocks *blocks) {
+    blocks->vars = var_count(ir);
+    blocks->match = match_blocks(ir);
+    blocks->use = calloc((size_t)blocks->vars + 1, 1);
+    blocks->sums = malloc(((size_t)blocks->vars + 1) * sizeof(int));
+    if (!blocks->match || !blocks->use || !blocks->sums) {
+        ir_blocks_free(blocks);
+        return false;
+    }
+    return true;
+}
+
+void ir_blocks_free(IrBlocks *blocks) {
+    free(blocks->match);
+    free(blocks->use);
+    free(blocks->sums);
+    memset(blocks, 0, sizeof(IrBlocks));
+}
+
+bool ir_parallel_plan(const IrProgram *ir, IrBlocks *blocks, int head, IrParallel *plan) {
+    int end = blocks->match[head];
+    memset(plan, 0, sizeof(IrParallel));
+    plan->blocker = -1;
+    plan->var = -1;
+    plan->sums = blocks->sums;
+    bool ok = parallel_body(ir, head, end, plan, blocks->use);
+    if (!ok) plan->sum_count = 0;
+    // Only variables named in the body were touched; clear just those, so a
+    // plan costs the size of its loop rather than of the program.
+    for (int i = head + 1; i < end; i++) {
+        const IrNode *n = &ir->nodes[i];
+        if (is_store(n->op)) blocks->use[n->dest] = USE_NONE;
+        if (!n->a.is_const) blocks->use[n->a.var] = USE_NONE;
+        if (!n->b.is_const) blocks->use[n->b.var] = USE_NONE;
+    }
+    return ok;
+}
+
+// --- Pipeline ---
+
+void ir_optimize(IrProgram *ir, int level) {
+    if (level <= 0 || ir->count == 0) return;
+    fold(ir);
+    remove_dead_stores(ir);
+    if (level >= 2) {
+        rewrite_loops(ir);
+        fold(ir);
+        remove_dead_stores(ir);
+    }
+    // Removing stores can leave blocks empty.
+    fold(ir);
+}
@@ -0,0 +1,115 @@
+#ifndef TAKO_IR_H
+#define TAKO_IR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// --- Intermediate Representation ---
+// Both the interpreter and the native compiler parse a script into this form,
+// optimize it, and generate their own code from the result. Statements keep
+// source order and block structure: an IR_IF or IR_LOOP opens a block that the
+// matching IR_END closes. Operands are constants or variable ids; what a
+// variable id means is up to the front end.
+
+typedef enum {
+    IR_SET,         // dest = a
+    IR_ADD,         // dest = dest + a
+    IR_SUB,         // dest = dest - a
+    IR_ADD_TIMES,   // dest = dest + a * b if b > 0 (a loop in closed form)
+    IR_SUB_TIMES,   // dest = dest - a * b if b > 0
+    IR_PRINT_STR,   // print "str"
+    IR_PRINT_PAIR,  // print "str" a
+    IR_PRINT_VAL,   // print a
+    IR_YIELD,       // let other tasks run
+    IR_SLEEP,       // pause for a milliseconds
+    IR_IF,          // run the block if a cmp b
+    IR_LOOP,        // run the block a times (split across threads if parallel)
+    IR_END,
+    IR_CHECK,       // stop the script unless variable a has been assigned
+    IR_BAD          // unknown command (str is the line), reported when reached
+} IrOp;
+
+typedef enum { IR_EQ, IR_NE, IR_GT, IR_LT, IR_GE, IR_LE } IrCmp;
+
+typedef struct {
+    bool is_const;
+    int64_t value;  // when is_const
+    int var;        // otherwise
+} IrValue;
+
+typedef struct {
+    IrOp op;
+    int line;           // 1-based source line
+    int dest;
+    IrValue a, b;
+    IrCmp cmp;
+    const char *str;    // print text or bad line; must outlive the program
+    int str_len;
+    bool parallel;      // IR_LOOP from 'ploop': passes may run on several threads
+} IrNode;
+
+// Allocation failures are sticky: once `oom` is set, ir_emit adds no more
+// nodes and ir_optimize leaves the program as it is, so callers check once
+// at the end.
+typedef struct {
+    IrNode *nodes;
+    int count;
+    int cap;
+    int bits;           // width of the backend's integers; arithmetic wraps to it
+    bool zero_init;     // unassigned variables read as 0 rather than failing an IR_CHECK
+    bool oom;
+    IrNode spare;       // what ir_emit hands out once `oom` is set
+} IrProgram;
+
+void ir_init(IrProgram *ir, int bits, bool zero_init);
+void ir_free(IrProgram *ir);
+
+IrValue ir_const(int64_t value);
+IrValue ir_var(int var);
+
+// Append a node with constant-zero operands. The pointer is valid until the
+// next append; after a failed allocation it points at `spare`.
+IrNode *ir_emit(IrProgram *ir, IrOp op, int line);
+
+// --- Optimization ---
+// -O0 leaves the program alone. -O1 propagates and folds constants, removes
+// `if` blocks with constant conditions and loops that run at most once, and
+// deletes stores that are never read. -O2 also replaces loops whose bodies
+// only add loop-invariant amounts with a multiply.
+#define IR_OPT_DEFAULT 1
+
+void ir_optimize(IrProgram *ir, int level);
+
+// --- Parallel Loops ---
+// A 'ploop' body may run its passes on several threads when no pass depends
+// on another: every variable it changes is either set unconditionally before
+// the pass reads it (private to the pass; the last pass's value survives) or
+// only moved by add/sub and never read (a sum, combined at the end). Nothing
+// in the body may print, yield or sleep. `blocker` is the first node that
+// breaks this, or -1; `reason` is then a format for the variable's name.
+typedef struct {
+    int blocker;
+    const char *reason;
+    int var;
+    int *sums;          // variables combined as sums, in first-use order
+    int sum_count;
+} IrParallel;
+
+// What the plans of one program share, built once so that planning every
+// ploop stays linear. Any change to the program's nodes invalidates it.
+typedef struct {
+    int *match;         // for every if/loop the index of its end, and the reverse
+    unsigned char *use; // per-variable scratch, all clear between plans
+    int *sums;          // storage for the latest plan's sums
+    int vars;
+} IrBlocks;
+
+// Returns false when out of memory.
+bool ir_blocks_build(const IrProgram *ir, IrBlocks *blocks);
+void ir_blocks_free(IrBlocks *blocks);
+
+// Analyze the loop opened at node `head`. Returns true if it may run in
+// parallel. `plan->sums` lives in `blocks` until the next plan.
+bool ir_parallel_plan(const IrProgram *ir, IrBlocks *blocks, int head, IrParallel *plan);
+
+#endif
@@ -0,0 +1,372 @@
+#include "lexer.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LEX_X86 1
+#include <immintrin.h>
+#else
+#define LEX_X86 0
+#endif
+
+// --- Byte Classification ---
+
+// Lexing works on 64-byte blocks. Each block is classified into bitmasks,
+// one bit per byte, and the tokenizer then works on whole masks instead of
+// testing bytes one at a time.
+typedef struct {
+    uint64_t space;     // ' ', '\t', '\r', '\v', '\f'
+    uint64_t newline;
+    uint64_t quote;
+    uint64_t hash;
+} BlockMasks;
+
+typedef void (*ClassifyFn)(const unsigned char *block, BlockMasks *m);
+
+enum { CLASS_OTHER, CLASS_SPACE, CLASS_NEWLINE, CLASS_QUOTE, CLASS_HASH };
+
+static const unsigned char byte_class[256] = {
+    [' '] = CLASS_SPACE, ['\t'] = CLASS_SPACE, ['\r'] = CLASS_SPACE,
+    ['\v'] = CLASS_SPACE, ['\f'] = CLASS_SPACE, ['\n'] = CLASS_NEWLINE,
+    ['"'] = CLASS_QUOTE, ['#'] = CLASS_HASH,
+};
+
+static void classify_scalar(const unsigned char *block, BlockMasks *m) {
+    uint64_t masks[5] = {0};
+    for (int i = 0; i < 64; i++) masks[byte_class[block[i]]] |= 1ull << i;
+    m->space = masks[CLASS_SPACE];
+    m->newline = masks[CLASS_NEWLINE];
+    m->quote = masks[CLASS_QUOTE];
+    m->hash = masks[CLASS_HASH];
+}
+
+#if LEX_X86
+__attribute__((target("sse2")))
+static void classify_sse2(const unsigned char *block, BlockMasks *m) {
+    const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), cr = _mm_set1_epi8('\r');
+    const __m128i vt = _mm_set1_epi8('\v'), ff = _mm_set1_epi8('\f'), nl = _mm_set1_epi8('\n');
+    const __m128i qt = _mm_set1_epi8('"'), hs = _mm_set1_epi8('#');
+    uint64_t space = 0, newline = 0, quote = 0, hash = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(block + 16 * i));
+        __m128i s = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)),
+                                 _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, vt)), _mm_cmpeq_epi8(v, ff)));
+        space |= (uint64_t)(uint16_t)_mm_movemask_epi8(s) << (16 * i);
+        newline |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) << (16 * i);
+        quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, qt)) << (16 * i);
+        hash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, hs)) << (16 * i);
+    }
+    m->space = space;
+    m->newline = newline;
+    m->quote = quote;
+    m->hash = hash;
+}
+
+__attribute__((target("avx2")))
+static void classify_avx2(const unsigned char *block, BlockMasks *m) {
+    const __m256i sp = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), cr = _mm256_set1_epi8('\r');
+    const __m256i vt = _mm256_set1_epi8('\v'), ff = _mm256_set1_epi8('\f'), nl = _mm256_set1_epi8('\n');
+    const __m256i qt = _mm256_set1_epi8('"'), hs = _mm256_set1_epi8('#');
+    uint64_t space = 0, newline = 0, quote = 0, hash = 0;
+    for (int i = 0; i < 2; i++) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(block + 32 * i));
+        __m256i s = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, tab)),
+                                    _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, vt)), _mm256_cmpeq_epi8(v, ff)));
+        space |= (uint64_t)(uint32_t)_mm256_movemask_epi8(s) << (32 * i);
+        newline |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)) << (32 * i);
+        quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, qt)) << (32 * i);
+        hash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, hs)) << (32 * i);
+    }
+    m->space = space;
+    m->newline = newline;
+    m->quote = quote;
+    m->hash = hash;
+}
+#endif
+
+// --- Implementation Selection ---
+
+typedef struct {
+    ClassifyFn fn;
+    const char *name;
+} Classifier;
+
+static const Classifier scalar_classifier = { classify_scalar, "scalar" };
+#if LEX_X86
+static const Classifier sse2_classifier = { classify_sse2, "sse2" };
+static const Classifier avx2_classifier = { classify_avx2, "avx2" };
+#endif
+
+// Picked on first use. Scripts may be lexed on several threads at once, so
+// the choice is published with a single atomic pointer store.
+static const Classifier *classifier;
+
+#if defined(__GNUC__)
+#define LOAD_CLASSIFIER() __atomic_load_n(&classifier, __ATOMIC_ACQUIRE)
+#define STORE_CLASSIFIER(c) __atomic_store_n(&classifier, (c), __ATOMIC_RELEASE)
+#else
+#define LOAD_CLASSIFIER() classifier
+#define STORE_CLASSIFIER(c) (classifier = (c))
+#endif
+
+int lex_select(LexImpl impl) {
+#if LEX_X86
+    __builtin_cpu_init();
+    bool has_sse2 = __builtin_cpu_supports("sse2");
+    bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (impl == LEX_IMPL_AUTO) impl = has_avx2 ? LEX_IMPL_AVX2 : has_sse2 ? LEX_IMPL_SSE2 : LEX_IMPL_SCALAR;
+    if (impl == LEX_IMPL_AVX2) {
+        if (!has_avx2) return -1;
+        STORE_CLASSIFIER(&avx2_classifier);
+        return 0;
+    }
+    if (impl == LEX_IMPL_SSE2) {
+        if (!has_sse2) return -1;
+        STORE_CLASSIFIER(&sse2_classifier);
+        return 0;
+    }
+#else
+    if (impl == LEX_IMPL_SSE2 || impl == LEX_IMPL_AVX2) return -1;
+#endif
+    STORE_CLASSIFIER(&scalar_classifier);
+    return 0;
+}
+
+static const Classifier *current_classifier(void) {
+    const Classifier *c = LOAD_CLASSIFIER();
+    if (!c) {
+        lex_select(LEX_IMPL_AUTO);
+        c = LOAD_CLASSIFIER();
+    }
+    return c;
+}
+
+const char *lex_impl_name(void) {
+    return current_classifier()->name;
+}
+
+// --- Token Stream ---
+
+// A string or comment whose bytes may run past the block it started in.
+// Strings cover [open, close] where both ends are quotes; comments cover
+// [open, close) where close is the newline (or the end of the buffer).
+typedef struct {
+    size_t open, close;
+    bool is_comment;
+} Span;
+
+// Bits describing one block once strings and comments have been resolved.
+typedef struct {
+    uint64_t delim;       // quotes that open or close a string
+    uint64_t inner;       // string contents
+    uint64_t commented;   // comment text, including the '#'
+    uint64_t str_start;   // first content byte of a non-empty string
+    uint64_t str_end;     // closing quote of a non-empty string
+    uint64_t empty;       // closing quote of an empty string
+    uint64_t lone_quote;  // quote with no partner on its line: starts a word
+} BlockBits;
+
+// Bits for the byte range [lo, hi) that fall inside the block at `base`.
+static inline uint64_t range_bits(size_t lo, size_t hi, size_t base) {
+    if (hi <= base || lo >= base + 64) return 0;
+    size_t a = lo > base ? lo - base : 0;
+    size_t b = hi < base + 64 ? hi - base : 64;
+    uint64_t m = b - a == 64 ? ~0ull : (1ull << (b - a)) - 1;
+    return m << a;
+}
+
+static inline uint64_t pos_bit(size_t pos, size_t base) {
+    return pos >= base && pos < base + 64 ? 1ull << (pos - base) : 0;
+}
+
+// Position of the first newline (or quote, if `quote` is set) after `p`,
+// or `size` if there is none. The current block's mask answers most lookups.
+static inline size_t find_after(const unsigned char *bytes, size_t size, uint64_t mask,
+                                size_t base, size_t p, bool quote) {
+    int i = (int)(p - base);
+    uint64_t rest = i == 63 ? 0 : mask & (~0ull << (i + 1));
+    if (rest) return base + (size_t)__builtin_ctzll(rest);
+    size_t q = base + 64;
+    while (q < size && bytes[q] != '\n' && !(quote && bytes[q] == '"')) q++;
+    return q < size ? q : size;
+}
+
+static inline void mark_span(const Span *sp, size_t base, BlockBits *bb) {
+    if (sp->is_comment) {
+        bb->commented |= range_bits(sp->open, sp->close, base);
+        return;
+    }
+    bb->delim |= pos_bit(sp->open, base) | pos_bit(sp->close, base);
+    bb->inner |= range_bits(sp->open + 1, sp->close, base);
+    if (sp->close == sp->open + 1) {
+        bb->empty |= pos_bit(sp->close, base);
+    } else {
+        bb->str_start |= pos_bit(sp->open + 1, base);
+        bb->str_end |= pos_bit(sp->close, base);
+    }
+}
+
+// Tokens started but not yet ended: at most one carried in plus one per byte.
+#define OPEN_RING_MASK 127
+
+static bool reserve(void **ptr, int *cap, int need, size_t size) {
+    if (need <= *cap) return true;
+    int new_cap = *cap ? *cap : 1024;
+    while (new_cap < need) new_cap *= 2;
+    void *grown = realloc(*ptr, (size_t)new_cap * size);
+    if (!grown) return false;
+    *ptr = grown;
+    *cap = new_cap;
+    return true;
+}
+
+// Lexing runs block by block. Quotes and '#' are rare, so they are resolved
+// one at a time into the masks above; everything else is found with shifts
+// over the whitespace masks. Token starts, token ends and newlines then come
+// out of their masks with count-trailing-zeros.
+int lex_buffer(const char *data, size_t size, LexResult *out) {
+    ClassifyFn classify = current_classifier()->fn;
+    memset(out, 0, sizeof(LexResult));
+
+    const unsigned char *bytes = (const unsigned char *)data;
+    int lines_cap = 0, line_tokens_cap = 0, token_cap = 0;
+    int guess = (int)(size / 32) + 66;
+    if (!reserve((void **)&out->lines, &lines_cap, guess, sizeof(size_t)) ||
+        !reserve((void **)&out->line_tokens, &line_tokens_cap, guess + 1, sizeof(int)) ||
+        !reserve((void **)&out->tokens, &token_cap, (int)(size / 8) + 66, sizeof(LexToken))) goto oom;
+    out->line_tokens[0] = 0;
+    if (size == 0) return 0;
+
+    int count = 0, lc = 1;
+    out->lines[0] = 0;
+    int done = 0;
+    size_t line_start = 0, skip_until = 0, last_close = (size_t)-1;
+    size_t open_at[OPEN_RING_MASK + 1];
+    uint64_t carry_word = 0;
+    Span pending;
+    bool has_pending = false;
+    unsigned char tail[64];
+
+    for (size_t base = 0; base < size; base += 64) {
+        // Each block adds at most 64 tokens and 64 lines.
+        if (!reserve((void **)&out->tokens, &token_cap, count + 65, sizeof(LexToken)) ||
+            !reserve((void **)&out->lines, &lines_cap, lc + 65, sizeof(size_t)) ||
+            !reserve((void **)&out->line_tokens, &line_tokens_cap, lc + 66, sizeof(int))) goto oom;
+        LexToken *tokens = out->tokens;
+        size_t *lines = out->lines;
+        int *line_tokens = out->line_tokens;
+
+        const unsigned char *block = bytes + base;
+        uint64_t valid = ~0ull;
+        if (size - base < 64) {
+            memset(tail, '\n', sizeof(tail));
+            memcpy(tail, block, size - base);
+            block = tail;
+            valid = (1ull << (size - base)) - 1;
+        }
+        BlockMasks m;
+        classify(block, &m);
+
+        // Resolve strings and comments, carrying one that continues in from
+        // an earlier block.
+        BlockBits bb = {0};
+        if (has_pending) {
+            mark_span(&pending, base, &bb);
+            has_pending = pending.close >= base + 64;
+        }
+        uint64_t specials = (m.quote | m.hash) & valid;
+        while (specials) {
+            size_t p = base + (size_t)__builtin_ctzll(specials);
+            specials &= specials - 1;
+            if (p < skip_until) continue;
+            Span sp;
+            if (bytes[p] == '#') {
+                // Only a '#' that begins a token starts a comment.
+                bool at_token_start = p == 0 || p - 1 == last_close ||
+                                      byte_class[bytes[p - 1]] == CLASS_SPACE || bytes[p - 1] == '\n';
+                if (!at_token_start) continue;
+                sp = (Span){ p, find_after(bytes, size, m.newline, base, p, false), true };
+                skip_until = sp.close;
+            } else {
+                size_t close = find_after(bytes, size, m.newline | m.quote, base, p, true);
+                if (close == size || bytes[close] != '"') {
+                    bb.lone_quote |= 1ull << (p - base);
+                    continue;
+                }
+                sp = (Span){ p, close, false };
+                skip_until = close + 1;
+                last_close = close;
+            }
+            mark_span(&sp, base, &bb);
+            if (sp.close >= base + 64) {
+                pending = sp;
+                has_pending = true;
+            }
+        }
+
+        // Words are runs of anything else. A lone quote ends the word before
+        // it and starts a new one. An empty string starts and ends at its
+        // closing quote.
+        uint64_t sep = m.space | m.newline | bb.delim | bb.inner | bb.commented;
+        uint64_t word = ~sep & valid;
+        uint64_t prev = (word << 1) | carry_word;
+        uint64_t starts = ((word & ~prev) | bb.lone_quote | bb.str_start | bb.empty) & valid;
+        uint64_t strings = bb.str_start | bb.empty;
+        uint64_t ends = (prev & (~word | bb.lone_quote)) | bb.str_end | bb.empty;
+        uint64_t newlines = m.newline & valid;
+        carry_word = word >> 63;
+
+        // Starts and ends each come out in order, so the n-th end closes the
+        // n-th token; start positions wait in a small ring until then. A
+        // token's line is the last newline before its start.
+        int block_first = count;
+        for (uint64_t bits = starts; bits; bits &= bits - 1) {
+            int i = __builtin_ctzll(bits);
+            size_t p = base + (size_t)i;
+            uint64_t before = newlines & ((1ull << i) - 1);
+            size_t has_line = (size_t)0 - (size_t)(before != 0);
+            size_t ls = (line_start & ~has_line) | ((base + 64 - (size_t)__builtin_clzll(before | 1)) & has_line);
+            open_at[count & OPEN_RING_MASK] = p;
+            tokens[count].offset = (uint32_t)(p - ls);
+            tokens[count].len = (uint32_t)((strings >> i) & 1) << 31;
+            count++;
+        }
+        for (uint64_t bits = ends; bits; bits &= bits - 1) {
+            size_t p = base + (size_t)__builtin_ctzll(bits);
+            tokens[done].len |= (uint32_t)(p - open_at[done & OPEN_RING_MASK]);
+            done++;
+        }
+        for (uint64_t bits = newlines; bits; bits &= bits - 1) {
+            int i = __builtin_ctzll(bits);
+            lines[lc] = base + (size_t)i + 1;
+            line_tokens[lc] = block_first + __builtin_popcountll(starts & ((2ull << i) - 1));
+            lc++;
+        }
+        if (newlines) line_start = base + 64 - (size_t)__builtin_clzll(newlines);
+    }
+
+    // A word running to the very end of a block-aligned buffer is still open.
+    if (done < count) {
+        out->tokens[done].len |= (uint32_t)(size - open_at[done & OPEN_RING_MASK]);
+        done++;
+    }
+    // A trailing newline does not open an extra line.
+    if (out->lines[lc - 1] == size) lc--;
+    out->line_tokens[lc] = count;
+    out->line_count = lc;
+    out->token_count = count;
+    return 0;
+
+oom:
+    lex_free(out);
+    return -1;
+}
+
+void lex_free(LexResult *lex) {
+    free(lex->lines);
+    free(lex->line_tokens);
+    free(lex->tokens);
+    memset(lex, 0, sizeof(LexResult));
+}
@@ -0,0 +1,49 @@
+#ifndef TAKO_LEXER_H
+#define TAKO_LEXER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// --- Token Stream ---
+
+// A token as stored in the stream: its byte offset from the start of its
+// line and its length. The top bit of `len` marks a "quoted" string, whose
+// offset and length exclude the quotes.
+typedef struct {
+    uint32_t offset;
+    uint32_t len;
+} LexToken;
+
+#define LEX_STRING 0x80000000u
+
+// The result of lexing a whole buffer in one pass. Comments are dropped;
+// everything else on a line becomes a word or a string token.
+typedef struct {
+    size_t *lines;        // byte offset where each line starts
+    int *line_tokens;     // index of each line's first token, plus an end entry
+    LexToken *tokens;
+    int line_count;
+    int token_count;
+} LexResult;
+
+// Lex `size` bytes of script text. Lines end at '\n'; a trailing newline does
+// not open an extra line. A '"' starts a string that runs to the next quote on
+// the same line; a '#' at the start of a token comments out the rest of the
+// line. Returns 0 on success, or -1 if memory runs out.
+int lex_buffer(const char *data, size_t size, LexResult *out);
+
+void lex_free(LexResult *lex);
+
+// --- Implementation Selection ---
+
+// The byte classifier is picked once at run time from what the CPU supports.
+typedef enum { LEX_IMPL_AUTO, LEX_IMPL_SCALAR, LEX_IMPL_SSE2, LEX_IMPL_AVX2 } LexImpl;
+
+// Force a classifier (for benchmarks). Returns 0, or -1 if this CPU or
+// build cannot run it.
+int lex_select(LexImpl impl);
+
+// Name of the classifier currently in use.
+const char *lex_impl_name(void);
+
+#endif
@@ -0,0 +1,2365 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "tako.h"
+#include "ir.h"
+#include "source.h"
+
+// The JIT emits x86-64 code into mmap'd memory, so it needs both.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_WIN32)
+#define TAKO_JIT 1
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "x64.h"
+#else
+#define TAKO_JIT 0
+#endif
+
+// The script cache maps images and writes them with rename.
+#if !defined(_WIN32)
+#define TAKO_CACHE 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define TAKO_CACHE 0
+#endif
+
+// ploop passes run on POSIX threads.
+#if !defined(_WIN32)
+#define TAKO_THREADS 1
+#include <pthread.h>
+#include <unistd.h>
+#else
+#define TAKO_THREADS 0
+#endif
+
+// --profile times instructions with the time stamp counter where there is one.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define TAKO_RDTSC 1
+#include <x86intrin.h>
+#else
+#define TAKO_RDTSC 0
+#endif
+
+// --- Configuration Constants ---
+#define MAX_BLOCK_DEPTH 256   // deepest allowed if/loop nesting
+#define MAX_TOKENS 5          // the longest statement, 'if a == b', needs four
+#define JIT_THRESHOLD 1000    // loop body repetitions before it is compiled
+#define PLOOP_MIN_PASSES 4096 // fewest ploop passes worth handing to a thread
+
+// --- Bytecode ---
+
+// Scripts are parsed into the shared IR (ir.h), optimized, and lowered once
+// into a flat instruction stream that a dispatch loop executes, so loop
+// bodies are never re-lexed. Every operand is a value slot: variables and
+// literals alike are resolved at compile time.
+typedef enum {
+    OP_SET,         // dest = a
+    OP_ADD,         // dest = dest + a
+    OP_SUB,         // dest = dest - a
+    OP_ADD_TIMES,   // dest = dest + a * b if b > 0
+    OP_SUB_TIMES,   // dest = dest - a * b if b > 0
+    OP_PRINT_STR,   // print "str"
+    OP_PRINT_PAIR,  // print "str" a
+    OP_PRINT_VAL,   // print a
+    OP_YIELD,       // end a task's slice; does nothing outside a task
+    OP_SLEEP,       // end a task's slice and keep it waiting a ms; outside a task, block
+    OP_IF,          // if !(a cmp b) jump to target
+    OP_PLOOP,       // as OP_LOOP, but passes may run on threads; sums are sums[dest .. dest + str)
+    OP_LOOP,        // push counter a, or jump to target if a <= 0; b is the loop id
+    OP_NEXT,        // if --top > 0 jump to target (first body instruction), else pop; b as OP_LOOP
+    OP_PEND,        // follows the OP_NEXT of an OP_PLOOP; ends a thread's share of the passes
+    OP_CHECK,       // fail unless slot a has been assigned
+    OP_BAD,         // unknown command, reported each time it is reached
+    OP_HALT,
+    OP_COUNT
+} OpCode;
+
+typedef struct {
+    OpCode op;
+    int line;       // 1-based source line, for diagnostics
+    int dest;       // slot of the assigned variable (set/add/sub)
+    int a, b;       // operand slots
+    int str;        // pool offset of a string literal (print) or bad line text
+    int target;     // jump target (if/loop/next)
+    IrCmp cmp;
+} Instr;
+
+// An interned identifier or numeric literal. Its index is its value slot.
+typedef struct {
+    int name;       // pool offset of the identifier or literal text
+    bool is_const;
+    int value;      // value of a literal
+} Symbol;
+
+// Maps names to slots with an open-addressed hash table. Buckets hold
+// slot + 1, so zero marks an empty bucket.
+typedef struct {
+    Symbol *symbols;
+    int count;
+    int cap;
+    int *buckets;
+    int bucket_cap;
+} SymbolTable;
+
+// A compiled script. Strings are stored as offsets into `pool` so the
+// instruction stream holds no pointers.
+typedef struct {
+    Instr *code;
+    int code_count;
+    int code_cap;
+    char *pool;
+    int pool_len;
+    int pool_cap;
+    SymbolTable syms;
+    int loop_depth;   // deepest loop nesting, sizes the control stack
+    int loop_count;   // number of loops; OP_LOOP/OP_NEXT carry their id in b
+    int *sums;        // slots each ploop combines as sums, see OP_PLOOP
+    int sum_count;
+    int sum_cap;
+    uint64_t id;      // unique per compiled script, keys the JIT cache
+    bool oom;         // an allocation failed while building it; it is incomplete
+} Program;
+
+// A compiled script. The source stays loaded for the line text in reports.
+// A script loaded from the cache runs straight out of the mapped image, and
+// its source is not kept.
+struct TakoScript {
+    Program prog;
+    SourceFile src;
+    double compile_seconds;
+    void *image;        // mapped .takoc image, or NULL
+    size_t image_size;
+    int line_count;
+    int *match, *parent;    // block tables kept for tako_compile_edit, or NULL
+    int reused;             // slots of the seed this text names again
+};
+
+typedef struct Profile Profile;
+typedef struct JitLoop JitLoop;
+
+// Everything one line of execution owns. The program it runs is shared and
+// only ever read, so states on different threads never touch common data.
+struct TakoState {
+    int *values;      // one value per program slot
+    bool *assigned;   // whether each slot has been given a value
+    int slot_count;
+    bool jit;         // compile hot loops to native code where supported
+    int threads;      // most threads a ploop may use; 0 for one per CPU
+    JitLoop *jit_loops;     // compiled loops of the program with id jit_program
+    int jit_loop_count;
+    uint64_t jit_program;
+    Profile *profile; // profiling counters, or NULL
+    double run_seconds;
+    TakoSink sink;
+    void *sink_ctx;
+    char *out;        // output not yet handed to the sink
+    size_t out_len, out_cap;
+    int *counters;    // loop control stack, as deep as the program's loops nest
+    int counter_cap;
+    // A task run a slice at a time (tako_task_step) keeps its place here
+    // between slices: the instruction to resume at and the live counters.
+    const Program *task;  // program of the task under way, or NULL
+    int task_pc;
+    int task_depth;
+};
+
+// --- Errors ---
+
+const char *tako_status_name(TakoStatus status) {
+    switch (status) {
+        case TAKO_OK: return "ok";
+        case TAKO_ERR_IO: return "I/O error";
+        case TAKO_ERR_SYNTAX: return "syntax error";
+        case TAKO_ERR_RUNTIME: return "runtime error";
+        default: return "out of memory";
+    }
+}
+
+static void clear_error(TakoError *err) {
+    err->status = TAKO_OK;
+    err->line = 0;
+    err->message[0] = '\0';
+}
+
+// Record a failure and return its status. The first failure sets the status
+// and line; messages accumulate one per line, so every unclosed block can be
+// reported at once.
+static TakoStatus set_error(TakoError *err, TakoStatus status, int line, const char *fmt, ...) {
+    if (err->status == TAKO_OK) {
+        err->status = status;
+        err->line = line;
+    }
+    size_t used = strlen(err->message);
+    if (used > 0 && used + 1 < sizeof(err->message)) {
+        err->message[used++] = '\n';
+        err->message[used] = '\0';
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(err->message + used, sizeof(err->message) - used, fmt, ap);
+    va_end(ap);
+    return err->status;
+}
+
+// --- String and Parsing Helpers ---
+
+// Check whether a token is a numeric literal (handles negative numbers).
+static bool is_literal(const Token *tok) {
+    const char *s = tok->start;
+    if (tok->is_string || tok->len == 0) return false;
+    return isdigit((unsigned char)s[0]) || (s[0] == '-' && tok->len > 1 && isdigit((unsigned char)s[1]));
+}
+
+// Convert a numeric literal token the way atoi would, without reading past it.
+static int parse_int(const Token *tok) {
+    const char *s = tok->start, *end = tok->start + tok->len;
+    bool negative = s < end && *s == '-';
+    unsigned int value = 0;
+    for (s += negative; s < end && isdigit((unsigned char)*s); s++) value = value * 10 + (unsigned int)(*s - '0');
+    return (int)(negative ? 0u - value : value);
+}
+
+// A quoted token used where a name is expected keeps its quotes, so it
+// reports as an unknown variable just as it always has.
+static Token name_token(const Token *tok) {
+    Token t = *tok;
+    if (t.is_string) {
+        t.start--;
+        t.len += 2;
+        t.is_string = false;
+    }
+    return t;
+}
+
+// Grow a heap array so it can hold at least `need` elements of `size` bytes.
+// Returns NULL when out of memory, leaving the array as it was.
+static void *grow_array(void *ptr, int *cap, int need, size_t size) {
+    if (need <= *cap) return ptr;
+    int new_cap = *cap ? *cap : 16;
+    while (new_cap < need) new_cap *= 2;
+    void *grown = realloc(ptr, (size_t)new_cap * size);
+    if (!grown) return NULL;
+    *cap = new_cap;
+    return grown;
+}
+
+// --- Compilation ---
+
+// Append `len` bytes plus a NUL terminator to the pool and return the offset,
+// or -1 with `oom` set.
+static int pool_add(Program *prog, const char *str, int len) {
+    char *pool = grow_array(prog->pool, &prog->pool_cap, prog->pool_len + len + 1, 1);
+    if (!pool) {
+        prog->oom = true;
+        return -1;
+    }
+    prog->pool = pool;
+    memcpy(prog->pool + prog->pool_len, str, len);
+    prog->pool[prog->pool_len + len] = '\0';
+    prog->pool_len += len + 1;
+    return prog->pool_len - len - 1;
+}
+
+// Append an instruction and return its index, or -1 with `oom` set.
+static int emit(Program *prog, OpCode op, int line) {
+    Instr *code = grow_array(prog->code, &prog->code_cap, prog->code_count + 1, sizeof(Instr));
+    if (!code) {
+        prog->oom = true;
+        return -1;
+    }
+    prog->code = code;
+    Instr *in = &prog->code[prog->code_count];
+    memset(in, 0, sizeof(Instr));
+    in->op = op;
+    in->line = line;
+    return prog->code_count++;
+}
+
+// FNV-1a hash of a name.
+static unsigned int hash_name(const char *s, int len) {
+    unsigned int h = 2166136261u;
+    while (len-- > 0) { h ^= (unsigned char)*s++; h *= 16777619u; }
+    return h;
+}
+
+// Double the bucket array and reinsert every symbol. Returns false, with the
+// table unchanged, when out of memory.
+static bool rehash_symbols(Program *prog) {
+    SymbolTable *t = &prog->syms;
+    int cap = t->bucket_cap ? t->bucket_cap * 2 : 64;
+    int *buckets = calloc(cap, sizeof(int));
+    if (!buckets) return false;
+    free(t->buckets);
+    t->buckets = buckets;
+    t->bucket_cap = cap;
+    for (int slot = 0; slot < t->count; slot++) {
+        const char *name = prog->pool + t->symbols[slot].name;
+        unsigned int i = hash_name(name, (int)strlen(name)) & (t->bucket_cap - 1);
+        while (t->buckets[i]) i = (i + 1) & (t->bucket_cap - 1);
+        t->buckets[i] = slot + 1;
+    }
+    return true;
+}
+
+// Return the slot for a variable name or numeric literal, interning it on
+// first use, or -1 with `oom` set. Literals are keyed by their canonical
+// decimal text.
+static int intern(Program *prog, const Token *tok) {
+    char canonical[16];
+    bool is_const = is_literal(tok);
+    int value = 0;
+    const char *key = tok->start;
+    int key_len = tok->len;
+    if (is_const) {
+        value = parse_int(tok);
+        key_len = snprintf(canonical, sizeof(canonical), "%d", value);
+        key = canonical;
+    }
+
+    SymbolTable *t = &prog->syms;
+    if ((t->count + 1) * 2 > t->bucket_cap && !rehash_symbols(prog)) {
+        prog->oom = true;
+        return -1;
+    }
+    unsigned int i = hash_name(key, key_len) & (t->bucket_cap - 1);
+    while (t->buckets[i]) {
+        int slot = t->buckets[i] - 1;
+        const char *name = prog->pool + t->symbols[slot].name;
+        if (strncmp(name, key, key_len) == 0 && name[key_len] == '\0') return slot;
+        i = (i + 1) & (t->bucket_cap - 1);
+    }
+
+    int slot = t->count;
+    Symbol *symbols = grow_array(t->symbols, &t->cap, slot + 1, sizeof(Symbol));
+    int name = symbols ? pool_add(prog, key, key_len) : -1;
+    if (symbols) t->symbols = symbols;
+    if (name < 0) {
+        prog->oom = true;
+        return -1;
+    }
+    t->symbols[slot].name = name;
+    t->symbols[slot].is_const = is_const;
+    t->symbols[slot].value = value;
+    t->count++;
+    t->buckets[i] = slot + 1;
+    return slot;
+}
+
+// Compile-time context. Besides the IR being built it tracks which slots are
+// definitely assigned at the current point, so IR_CHECK is only emitted for
+// reads that could hit an unassigned variable. Variable ids in the IR are
+// slots in the program's symbol table.
+typedef struct {
+    Program *prog;
+    IrProgram *ir;
+    TakoError *err;   // set once compilation has failed
+    bool *assigned;
+    int assigned_cap;
+    int *undo;        // slots marked assigned inside the open blocks
+    int undo_count;
+    int undo_cap;
+    bool *named;      // which seeded slots the text has named so far
+    int seeded;       // slots taken from the seed
+    int reused;       // how many of those the text names
+} Compiler;
+
+// Mark a slot as assigned from this point until the enclosing block closes.
+static void mark_assigned(Compiler *c, int slot) {
+    if (c->assigned[slot]) return;
+    int *undo = grow_array(c->undo, &c->undo_cap, c->undo_count + 1, sizeof(int));
+    if (!undo) {
+        set_error(c->err, TAKO_ERR_NOMEM, 0, "Error: Out of memory");
+        return;
+    }
+    c->undo = undo;
+    c->assigned[slot] = true;
+    c->undo[c->undo_count++] = slot;
+}
+
+// Forget assignments made since `mark`; a block body may never run.
+static void undo_assigned(Compiler *c, int mark) {
+    while (c->undo_count > mark) c->assigned[c->undo[--c->undo_count]] = false;
+}
+
+// Intern a token and keep the assignment table as large as the symbol table.
+// Returns -1 after reporting that memory ran out.
+static int intern_tracked(Compiler *c, const Token *tok) {
+    Token name = name_token(tok);
+    int slot = intern(c->prog, &name);
+    int old_cap = c->assigned_cap;
+    bool *assigned = slot < 0 ? NULL : grow_array(c->assigned, &c->assigned_cap, c->prog->syms.count, sizeof(bool));
+    if (!assigned) {
+        set_error(c->err, TAKO_ERR_NOMEM, 0, "Error: Out of memory");
+        return -1;
+    }
+    c->assigned = assigned;
+    memset(c->assigned + old_cap, 0, (c->assigned_cap - old_cap) * sizeof(bool));
+    if (slot < c->seeded && !c->named[slot]) {
+        c->named[slot] = true;
+        c->reused++;
+    }
+    return slot;
+}
+
+// Resolve an operand to a constant or a variable slot, guarding reads of
+// possibly unassigned variables with IR_CHECK.
+static IrValue use_operand(Compiler *c, const Token *tok, int line_no) {
+    if (is_literal(tok)) return ir_const(parse_int(tok));
+    int slot = intern_tracked(c, tok);
+    if (slot < 0) return ir_const(0);
+    if (!c->assigned[slot]) {
+        ir_emit(c->ir, IR_CHECK, line_no)->a = ir_var(slot);
+        mark_assigned(c, slot); // a failed check stops the script
+    }
+    return ir_var(slot);
+}
+
+// Resolve the destination of an assignment to its slot, or -1 after
+// reporting that it cannot be assigned or that memory ran out.
+static int def_operand(Compiler *c, const Token *tok, int line_no) {
+    if (is_literal(tok)) {
+        set_error(c->err, TAKO_ERR_SYNTAX, line_no, "Syntax Error: Cannot assign to the number '%.*s' on line %d.", tok->len, tok->start, line_no);
+        return -1;
+    }
+    return intern_tracked(c, tok);
+}
+
+// Classify a tokenized line as a block opener ('if', 'loop', 'ploop'), a
+// block 'end', or neither.
+static bool is_loop_start(const Token *toks, int n) { return n >= 2 && (token_is(&toks[0], "loop") || token_is(&toks[0], "ploop")); }
+static bool is_block_start(const Token *toks, int n) { return is_loop_start(toks, n) || (n >= 2 && token_is(&toks[0], "if")); }
+static bool is_block_end(const Token *toks, int n) { return n == 1 && token_is(&toks[0], "end"); }
+
+// Single pass over lines [first, end) that records, for every block opener,
+// the line of its matching 'end' (-1 for any other line) and, into `parent`
+// if given, the opener of the innermost block around each line.
+// The lines lie `depth` levels deep, in the block opened on line `outer` (-1
+// at the top level), and an 'end' that would close that block fails the
+// pass. With `err` set, every unclosed block is reported before giving up;
+// without it, the pass fails quietly unless the lines balance on their own.
+// Returns the deepest nesting level, or -1.
+static int match_range(const SourceFile *src, int first, int end, int outer, int depth, int *match, int *parent, TakoError *err) {
+    int stack[MAX_BLOCK_DEPTH];
+    int base = depth, max_depth = depth;
+    Token toks[MAX_TOKENS];
+
+    for (int i = first; i < end; i++) {
+        int n = source_tokens(src, i, toks, MAX_TOKENS);
+        int top = depth > base ? stack[depth - 1] : outer;
+        match[i] = -1;
+        if (parent) parent[i] = top;
+        if (is_block_start(toks, n)) {
+            if (depth == MAX_BLOCK_DEPTH) {
+                if (err) set_error(err, TAKO_ERR_SYNTAX, i + 1, "Syntax Error: Blocks nested deeper than %d on line %d.", MAX_BLOCK_DEPTH, i + 1);
+                return -1;
+            }
+            stack[depth++] = i;
+            if (depth > max_depth) max_depth = depth;
+        } else if (is_block_end(toks, n)) {
+            if (depth > base) match[stack[--depth]] = i;
+            else if (outer >= 0) return -1;
+        }
+    }
+    if (!err) return depth == base ? max_depth : -1;
+
+    // Whatever is still open never found its 'end'; report outermost first.
+    for (int d = base; d < depth; d++) {
+        source_tokens(src, stack[d], toks, 1);
+        set_error(err, TAKO_ERR_SYNTAX, stack[d] + 1, "Syntax Error: '%.*s' on line %d has no matching 'end'.", toks[0].len, toks[0].start, stack[d] + 1);
+    }
+    return depth == base ? max_depth : -1;
+}
+
+static int match_blocks(const SourceFile *src, int *match, int *parent, TakoError *err) {
+    return match_range(src, 0, src->line_count, -1, 0, match, parent, err);
+}
+
+// Where an old line (or -1) ended up after an edit that left it alone.
+static int shift_line(int line, const SourceEdit *edit) {
+    return line >= edit->old_end ? line + edit->new_end - edit->old_end : line;
+}
+
+// Block tables for a revision of a script, from those of the text it
+// replaced. The edited lines are matched again on their own if they balance
+// inside the innermost block around them; otherwise that block's body, then
+// the next one out, up to the whole script. Lines outside keep their entries,
+// shifted past the edit. Returns how many lines were matched again, or -1.
+static int rematch_blocks(const SourceFile *src, const SourceEdit *edit, const int *old_match, const int *old_parent, int old_count,
+                   int *match, int *parent, TakoError *err) {
+    int outer = edit->first < old_count ? old_parent[edit->first] : -1;
+    while (outer >= 0 && old_match[outer] < edit->old_end) outer = old_parent[outer];
+    int depth = 0;
+    for (int o = outer; o >= 0; o = old_parent[o]) depth++;
+
+    // The old lines must not have shared a block with lines outside them.
+    bool alone = true;
+    for (int i = edit->first; i < edit->old_end && alone; i++) {
+        alone = (old_parent[i] == outer || old_parent[i] >= edit->first) && old_match[i] < edit->old_end;
+    }
+    int delta = edit->new_end - edit->old_end;
+    int from = edit->first, to = edit->new_end;
+    if (!alone || match_range(src, from, to, outer, depth, match, parent, NULL) < 0) {
+        for (;; outer = old_parent[outer], depth--) {
+            if (outer < 0) return match_blocks(src, match, parent, err) < 0 ? -1 : src->line_count;
+            from = outer + 1;
+            to = old_match[outer] + delta;
+            if (match_range(src, from, to, outer, depth, match, parent, NULL) >= 0) break;
+        }
+    }
+
+    for (int i = 0; i < from; i++) {
+        match[i] = shift_line(old_match[i], edit);
+        parent[i] = shift_line(old_parent[i], edit);
+    }
+    for (int i = to; i < src->line_count; i++) {
+        match[i] = shift_line(old_match[i - delta], edit);
+        parent[i] = shift_line(old_parent[i - delta], edit);
+    }
+    return to - from;
+}
+
+// Compile a single, simple command (not control flow)
+static void compile_line(Compiler *c, const Token *toks, int n, const char *line, int len, int line_no) {
+    IrNode *node;
+    IrValue a;
+
+    // --- PARSE PRINT ---
+    if (token_is(&toks[0], "print") && n >= 2) {
+        // print "message" var
+        if (toks[1].is_string && n >= 3) {
+            a = use_operand(c, &toks[2], line_no);
+            node = ir_emit(c->ir, IR_PRINT_PAIR, line_no);
+            node->str = toks[1].start;
+            node->str_len = toks[1].len;
+            node->a = a;
+            return;
+        }
+        // print "message"
+        if (toks[1].is_string) {
+            node = ir_emit(c->ir, IR_PRINT_STR, line_no);
+            node->str = toks[1].start;
+            node->str_len = toks[1].len;
+            return;
+        }
+        // print var_or_number
+        a = use_operand(c, &toks[1], line_no);
+        ir_emit(c->ir, IR_PRINT_VAL, line_no)->a = a;
+        return;
+    }
+
+    // --- PARSE SET ---
+    // set var = value (also accepts 'set var =value')
+    if (token_is(&toks[0], "set") && n >= 3 && !toks[2].is_string && toks[2].start[0] == '=') {
+        Token value = toks[2];
+        value.start++;
+        value.len--;
+        if (value.len > 0 || n >= 4) {
+            if (value.len == 0) value = toks[3];
+            a = use_operand(c, &value, line_no);
+            int dest = def_operand(c, &toks[1], line_no);
+            if (dest < 0) return;
+            node = ir_emit(c->ir, IR_SET, line_no);
+            node->dest = dest;
+            node->a = a;
+            mark_assigned(c, dest);
+            return;
+        }
+    }
+
+    // --- PARSE YIELD / SLEEP ---
+    // yield, sleep milliseconds
+    if (token_is(&toks[0], "yield") && n == 1) {
+        ir_emit(c->ir, IR_YIELD, line_no);
+        return;
+    }
+    if (token_is(&toks[0], "sleep") && n >= 2) {
+        a = use_operand(c, &toks[1], line_no);
+        ir_emit(c->ir, IR_SLEEP, line_no)->a = a;
+        return;
+    }
+
+    // --- PARSE ADD / SUB ---
+    // add var value, sub var value
+    IrOp op = IR_BAD;
+    if (token_is(&toks[0], "add")) op = IR_ADD;
+    else if (token_is(&toks[0], "sub")) op = IR_SUB;
+    if (op != IR_BAD && n >= 3) {
+        int dest = def_operand(c, &toks[1], line_no);
+        if (dest < 0) return;
+        use_operand(c, &toks[1], line_no);
+        a = use_operand(c, &toks[2], line_no);
+        node = ir_emit(c->ir, op, line_no);
+        node->dest = dest;
+        node->a = a;
+        return;
+    }
+
+    node = ir_emit(c->ir, IR_BAD, line_no);
+    node->str = line;
+    node->str_len = len;
+}
+
+// An open block during compilation.
+typedef struct {
+    int end_line;   // line of the matching 'end'
+    int mark;       // undo log position when the block opened
+} OpenBlock;
+
+// Resolve an IR operand to a value slot; constants become literal slots.
+static int operand_slot(Program *prog, IrValue v) {
+    if (!v.is_const) return v.var;
+    char text[16];
+    Token tok = { .start = text, .len = snprintf(text, sizeof(text), "%d", (int)v.value) };
+    return intern(prog, &tok);
+}
+
+// Every ploop must be able to run its passes in parallel; report the ones
+// that cannot, as written, before optimization hides anything.
+static void check_parallel(Program *prog, const IrProgram *ir, TakoError *err) {
+    IrBlocks blocks;
+    if (!ir_blocks_build(ir, &blocks)) {
+        set_error(err, TAKO_ERR_NOMEM, 0, "Error: Out of memory");
+        return;
+    }
+    for (int i = 0; i < ir->count; i++) {
+        const IrNode *n = &ir->nodes[i];
+        if (n->op != IR_LOOP || !n->parallel) continue;
+        IrParallel plan;
+        if (!ir_parallel_plan(ir, &blocks, i, &plan)) {
+            char why[256];
+            const char *name = plan.var >= 0 ? prog->pool + prog->syms.symbols[plan.var].name : "";
+            snprintf(why, sizeof(why), plan.reason, name);
+            set_error(err, TAKO_ERR_SYNTAX, n->line, "Syntax Error: 'ploop' on line %d cannot run in parallel: line %d %s.", n->line, ir->nodes[plan.blocker].line, why);
+        }
+    }
+    ir_blocks_free(&blocks);
+}
+
+// Lower optimized IR into the instruction stream, terminated by OP_HALT.
+// Jump targets, loop ids and the control stack depth are settled here. Out
+// of memory, lowering stops with the program's `oom` set.
+static void lower_program(Program *prog, const IrProgram *ir, IrBlocks *blocks, int halt_line) {
+    static const OpCode lowered[] = {
+        [IR_SET] = OP_SET, [IR_ADD] = OP_ADD, [IR_SUB] = OP_SUB,
+        [IR_ADD_TIMES] = OP_ADD_TIMES, [IR_SUB_TIMES] = OP_SUB_TIMES,
+        [IR_PRINT_STR] = OP_PRINT_STR, [IR_PRINT_PAIR] = OP_PRINT_PAIR, [IR_PRINT_VAL] = OP_PRINT_VAL,
+        [IR_YIELD] = OP_YIELD, [IR_SLEEP] = OP_SLEEP, [IR_IF] = OP_IF, [IR_LOOP] = OP_LOOP, [IR_CHECK] = OP_CHECK, [IR_BAD] = OP_BAD,
+    };
+    int open[MAX_BLOCK_DEPTH];
+    int depth = 0, loop_depth = 0;
+
+    for (int i = 0; i < ir->count; i++) {
+        const IrNode *node = &ir->nodes[i];
+        if (node->op == IR_END) {
+            int head = open[--depth];
+            OpCode op = prog->code[head].op;
+            if (op == OP_LOOP || op == OP_PLOOP) {
+                int next = emit(prog, OP_NEXT, node->line);
+                if (next < 0) return;
+                prog->code[next].target = head + 1;
+                prog->code[next].b = prog->code[head].b;
+                loop_depth--;
+            }
+            prog->code[head].target = prog->code_count;
+            if (op == OP_PLOOP) emit(prog, OP_PEND, node->line);
+            continue;
+        }
+
+        int idx = emit(prog, lowered[node->op], node->line);
+        if (idx < 0) return;
+        Instr *in = &prog->code[idx];
+        in->dest = node->dest;
+        in->cmp = node->cmp;
+        if (node->op != IR_PRINT_STR && node->op != IR_YIELD && node->op != IR_BAD) in->a = operand_slot(prog, node->a);
+        if (node->op == IR_ADD_TIMES || node->op == IR_SUB_TIMES || node->op == IR_IF) in->b = operand_slot(prog, node->b);
+        if (node->str) in->str = pool_add(prog, node->str, node->str_len);
+        if (node->op == IR_IF || node->op == IR_LOOP) open[depth++] = idx;
+        if (node->op == IR_LOOP) {
+            in->b = prog->loop_count++;
+            if (++loop_depth > prog->loop_depth) prog->loop_depth = loop_depth;
+        }
+        // Optimization only removes uses, so a ploop that passed
+        // check_parallel still plans; if not, it simply stays sequential.
+        IrParallel plan;
+        if (node->op == IR_LOOP && node->parallel && ir_parallel_plan(ir, blocks, i, &plan)) {
+            in->op = OP_PLOOP;
+            in->dest = prog->sum_count;
+            in->str = plan.sum_count;
+            int *sums = grow_array(prog->sums, &prog->sum_cap, prog->sum_count + plan.sum_count, sizeof(int));
+            if (!sums) {
+                prog->oom = true;
+                return;
+            }
+            prog->sums = sums;
+            for (int s = 0; s < plan.sum_count; s++) prog->sums[prog->sum_count++] = plan.sums[s];
+        }
+    }
+
+    emit(prog, OP_HALT, halt_line);
+}
+
+static void free_program(Program *prog) {
+    free(prog->code);
+    free(prog->pool);
+    free(prog->sums);
+    free(prog->syms.symbols);
+    free(prog->syms.buckets);
+}
+
+// Give a program the variables of `seed` first. Variables are interned
+// while compiling and literals only while lowering, so the variables fill
+// the lowest slots and keep them here. Literals are left to be interned
+// again, so slots of literals the text dropped do not pile up. Returns the
+// number of slots taken.
+static int seed_symbols(Program *prog, const Program *seed) {
+    for (int slot = 0; slot < seed->syms.count && !seed->syms.symbols[slot].is_const; slot++) {
+        const char *name = seed->pool + seed->syms.symbols[slot].name;
+        Token tok = { name, (int)strlen(name), false };
+        intern(prog, &tok);
+    }
+    return prog->syms.count;
+}
+
+// Compile a whole script into a program terminated by OP_HALT. Blocks are
+// tracked on an explicit stack using the match table, so compilation does not
+// recurse either. Variables of `seed`, if given, keep their slots, and
+// `reused` is set to how many of them the text names. `opt_level` is passed
+// to ir_optimize. On a syntax error the program is left empty and `err`
+// says why.
+static TakoStatus compile_program(Program *prog, const SourceFile *src, const int *match, const Program *seed, int opt_level, int *reused, TakoError *err) {
+    memset(prog, 0, sizeof(Program));
+    int seeded = seed ? seed_symbols(prog, seed) : 0;
+
+    IrProgram ir;
+    ir_init(&ir, 32, false);
+    Compiler c = { .prog = prog, .ir = &ir, .err = err, .seeded = seeded };
+    c.named = calloc((size_t)seeded + 1, sizeof(bool));
+    if (!c.named) set_error(err, TAKO_ERR_NOMEM, 0, "Error: Out of memory");
+    OpenBlock blocks[MAX_BLOCK_DEPTH];
+    int depth = 0;
+    Token toks[MAX_TOKENS];
+
+    for (int i = 0; i < src->line_count && err->status == TAKO_OK; i++) {
+        int n = source_tokens(src, i, toks, MAX_TOKENS);
+
+        // Skip empty or comment lines
+        if (n == 0) {
+            continue;
+        }
+
+        // --- Close the innermost block at its 'end' ---
+        if (depth > 0 && blocks[depth - 1].end_line == i) {
+            undo_assigned(&c, blocks[--depth].mark); // the body may never run
+            ir_emit(&ir, IR_END, i + 1);
+            continue;
+        }
+
+        // --- Handle Control Flow: LOOP ---
+        if (is_loop_start(toks, n)) {
+            IrValue a = use_operand(&c, &toks[1], i + 1);
+            IrNode *head = ir_emit(&ir, IR_LOOP, i + 1);
+            head->a = a;
+            head->parallel = token_is(&toks[0], "ploop");
+            blocks[depth++] = (OpenBlock){ match[i], c.undo_count };
+            continue;
+        }
+
+        // --- Handle Control Flow: IF ---
+        if (is_block_start(toks, n)) {
+            if (n < 4) {
+                set_error(err, TAKO_ERR_SYNTAX, i + 1, "Syntax Error: Malformed 'if' statement on line %d.", i + 1);
+                break;
+            }
+
+            const Token *op = &toks[2];
+            IrCmp cmp;
+            if (token_is(op, "==")) cmp = IR_EQ;
+            else if (token_is(op, "!=")) cmp = IR_NE;
+            else if (token_is(op, ">")) cmp = IR_GT;
+            else if (token_is(op, "<")) cmp = IR_LT;
+            else if (token_is(op, ">=")) cmp = IR_GE;
+            else if (token_is(op, "<=")) cmp = IR_LE;
+            else {
+                set_error(err, TAKO_ERR_SYNTAX, i + 1, "Syntax Error: Unknown operator '%.*s' in 'if' on line %d.", op->len, op->start, i + 1);
+                break;
+            }
+
+            IrValue a = use_operand(&c, &toks[1], i + 1);
+            IrValue b = use_operand(&c, &toks[3], i + 1);
+            IrNode *head = ir_emit(&ir, IR_IF, i + 1);
+            head->cmp = cmp;
+            head->a = a;
+            head->b = b;
+            blocks[depth++] = (OpenBlock){ match[i], c.undo_count };
+            continue;
+        }
+
+        // If it's not a control flow keyword, compile it as a simple command.
+        // A stray 'end' falls through here and is reported when reached.
+        size_t len;
+        const char *line = source_line(src, i, &len);
+        const char *text = toks[0].is_string ? toks[0].start - 1 : toks[0].start;
+        int text_len = (int)(line + len - text);
+        while (text_len > 0 && isspace((unsigned char)text[text_len - 1])) text_len--;
+        compile_line(&c, toks, n, text, text_len, i + 1);
+    }
+
+    if (err->status == TAKO_OK && (ir.oom || prog->oom)) set_error(err, TAKO_ERR_NOMEM, 0, "Error: Out of memory");
+    if (err->status == TAKO_OK) check_parallel(prog, &ir, err);
+    if (err->status == TAKO_OK) {
+        ir_optimize(&ir, opt_level);
+        IrBlocks blocks;
+        if (!ir.oom && ir_blocks_build(&ir, &blocks)) {
+            lower_program(prog, &ir, &blocks, src->line_count);
+            ir_blocks_free(&blocks);
+        } else {
+            prog->oom = true;
+        }
+        if (prog->oom) set_error(err, TAKO_ERR_NOMEM, 0, "Error: Out of memory");
+    }
+    ir_free(&ir);
+    free(c.assigned);
+    free(c.undo);
+    free(c.named);
+    *reused = c.reused;
+    if (err->status != TAKO_OK) {
+        free_program(prog);
+        memset(prog, 0, sizeof(Program));
+    }
+    return err->status;
+}
+
+// --- Variable Management ---
+
+// Size the state's value array and control stack for a program, clear every
+// variable and load its literals. Returns false if the arrays could not grow.
+static bool bind_program(TakoState *state, const Program *prog) {
+    int count = prog->syms.count;
+    int depth = prog->loop_depth ? prog->loop_depth : 1;
+    state->task = NULL;
+    if (depth > state->counter_cap) {
+        int *counters = realloc(state->counters, depth * sizeof(int));
+        if (!counters) return false;
+        state->counters = counters;
+        state->counter_cap = depth;
+    }
+    if (count > state->slot_count) {
+        int *values = realloc(state->values, count * sizeof(int));
+        if (values) state->values = values;
+        bool *assigned = realloc(state->assigned, count * sizeof(bool));
+        if (assigned) state->assigned = assigned;
+        if (!values || !assigned) return false;
+        state->slot_count = count;
+    }
+    if (count > 0) {
+        memset(state->values, 0, count * sizeof(int));
+        memset(state->assigned, 0, count * sizeof(bool));
+    }
+    for (int slot = 0; slot < count; slot++) {
+        if (prog->syms.symbols[slot].is_const) {
+            state->values[slot] = prog->syms.symbols[slot].value;
+            state->assigned[slot] = true;
+        }
+    }
+    return true;
+}
+
+// --- Output ---
+
+// Printed text collects in the state and goes to the sink in blocks of up to
+// this size, and whenever a run or a task's slice ends or writes a diagnostic.
+// The buffer grows as output arrives, so states that print little stay small.
+#define OUT_BUFFER_SIZE 65536
+
+static void default_sink(void *ctx, TakoStream stream, const char *bytes, size_t len) {
+    (void)ctx;
+    if (stream == TAKO_STDERR) {
+        fflush(stdout); // keep diagnostics in order with earlier output
+        fwrite(bytes, 1, len, stderr);
+    } else {
+        fwrite(bytes, 1, len, stdout);
+    }
+}
+
+static void flush_output(TakoState *state) {
+    if (state->out_len == 0) return;
+    state->sink(state->sink_ctx, TAKO_STDOUT, state->out, state->out_len);
+    state->out_len = 0;
+}
+
+static void write_output(TakoState *state, const char *bytes, size_t len) {
+    if (state->out_len + len > state->out_cap && state->out_cap < OUT_BUFFER_SIZE) {
+        size_t cap = state->out_cap ? state->out_cap : 256;
+        while (cap < state->out_len + len && cap < OUT_BUFFER_SIZE) cap *= 2;
+        if (cap > OUT_BUFFER_SIZE) cap = OUT_BUFFER_SIZE;
+        char *grown = realloc(state->out, cap);
+        if (grown) {
+            state->out = grown;
+            state->out_cap = cap;
+        }
+    }
+    if (state->out_len + len > state->out_cap) {
+        flush_output(state);
+        if (len > state->out_cap) {
+            state->sink(state->sink_ctx, TAKO_STDOUT, bytes, len);
+            return;
+        }
+    }
+    memcpy(state->out + state->out_len, bytes, len);
+    state->out_len += len;
+}
+
+// Write `value` and a newline. Digits are produced backwards from the end of
+// a buffer big enough for INT_MIN.
+static void write_int_line(TakoState *state, int value) {
+    char buf[16];
+    char *p = buf + sizeof(buf);
+    unsigned int u = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    *--p = '\n';
+    do { *--p = (char)('0' + u % 10); u /= 10; } while (u);
+    if (value < 0) *--p = '-';
+    write_output(state, p, (size_t)(buf + sizeof(buf) - p));
+}
+
+// Execute a print or report an unknown command. Shared by the dispatch loop
+// and by JIT-compiled loops, which call back here instead of printing.
+static void exec_output(TakoState *state, const Program *prog, const int *values, const Instr *ip) {
+    const char *text = prog->pool + ip->str;
+    switch (ip->op) {
+        case OP_PRINT_STR:
+            write_output(state, text, strlen(text));
+            write_output(state, "\n", 1);
+            break;
+        case OP_PRINT_PAIR:
+            write_output(state, text, strlen(text));
+            write_output(state, " ", 1);
+            write_int_line(state, values[ip->a]);
+            break;
+        case OP_PRINT_VAL:
+            write_int_line(state, values[ip->a]);
+            break;
+        default: {
+            static const char prefix[] = "Syntax Error: Unknown command on line: '";
+            size_t len = strlen(text);
+            char *msg = malloc(sizeof(prefix) + len + 2);
+            flush_output(state);
+            if (!msg) break;
+            memcpy(msg, prefix, sizeof(prefix) - 1);
+            memcpy(msg + sizeof(prefix) - 1, text, len);
+            memcpy(msg + sizeof(prefix) - 1 + len, "'\n", 2);
+            state->sink(state->sink_ctx, TAKO_STDERR, msg, sizeof(prefix) + len + 1);
+            free(msg);
+            break;
+        }
+    }
+}
+
+// --- JIT Compilation ---
+
+// The interpreter counts how often each loop body repeats. Once a loop passes
+// JIT_THRESHOLD the whole loop, including any loops nested in it, is encoded
+// as x86-64 into executable memory and run from there, starting with the
+// remaining passes of the run that made it hot. Compiled code reads and
+// writes the interpreter's own value and assigned arrays, so the tiers hand
+// over at loop boundaries without copying any state.
+#if TAKO_JIT
+
+typedef struct JitState JitState;
+
+// Run `iterations` (> 0) passes of a loop body. Returns 0, or 1 + the index
+// of an OP_CHECK that failed, where the interpreter resumes to report it.
+typedef int (*JitFn)(JitState *jit, int iterations);
+
+struct JitLoop {
+    unsigned int hot;   // body repetitions seen by the interpreter
+    JitFn fn;           // compiled loop, or NULL
+    size_t size;        // size of its mapping
+    int body;           // instructions in the body
+    bool nested;        // has loops inside it
+    bool failed;        // could not be compiled; stays interpreted
+};
+
+struct JitState {
+    const Program *prog;
+    int *values;
+    bool *assigned;
+    JitLoop *loops;     // one per loop id, or NULL when the JIT is off
+    TakoState *state;   // where output goes
+};
+
+// Called from compiled code for every print or unknown command.
+static void jit_output(JitState *jit, int pc) {
+    exec_output(jit->state, jit->prog, jit->values, &jit->prog->code[pc]);
+}
+
+// A jump inside compiled code whose target is an instruction index.
+typedef struct {
+    size_t at;
+    int pc;
+} JitFixup;
+
+// Copy finished code into its own page-aligned mapping, then make it
+// executable. The mapping is never writable and executable at once.
+static JitFn jit_install(const X64Buf *b, size_t *size) {
+    long page = sysconf(_SC_PAGESIZE);
+    *size = (b->len + (size_t)page - 1) & ~((size_t)page - 1);
+    void *mem = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+    memcpy(mem, b->code, b->len);
+    if (mprotect(mem, *size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, *size);
+        return NULL;
+    }
+    return (JitFn)mem;
+}
+
+// Compile the loop whose OP_LOOP is at `head`. Values live in memory at
+// [rbx + 4 * slot] and assigned flags at [r12 + slot]; r13 holds the JitState
+// and loop counters sit on the native stack, one slot per nesting level.
+static bool jit_compile(JitState *jit, int head) {
+    const Instr *code = jit->prog->code;
+    JitLoop *loop = &jit->loops[code[head].b];
+    if (loop->fn || loop->failed) return loop->fn != NULL;
+    loop->failed = true;
+
+    int first = head + 1, end = code[head].target; // body, then one past OP_NEXT
+    int depth = 0, max_depth = 0;
+    for (int pc = first; pc < end; pc++) {
+        if (code[pc].op == OP_PLOOP) return false; // stays interpreted, where it can use threads
+        if (code[pc].op == OP_YIELD || code[pc].op == OP_SLEEP) return false; // and where a task can stop
+        if (code[pc].op == OP_LOOP && ++depth > max_depth) max_depth = depth;
+        if (code[pc].op == OP_NEXT) depth--;
+    }
+    int32_t frame = (int32_t)((8 * (max_depth + 1) + 15) & ~15);
+    loop->body = end - first;
+    loop->nested = max_depth > 0;
+
+    // Every instruction makes at most one jump or one failed-check exit.
+    size_t *labels = malloc((size_t)(end - first + 1) * sizeof(size_t));
+    JitFixup *fixups = malloc((size_t)(end - first) * sizeof(JitFixup));
+    JitFixup *checks = malloc((size_t)(end - first) * sizeof(JitFixup));
+    int fixup_count = 0, check_count = 0;
+    if (!labels || !fixups || !checks) { free(labels); free(fixups); free(checks); return false; }
+
+    X64Buf b = {0};
+    x64_push(&b, RBX);
+    x64_push(&b, R12);
+    x64_push(&b, R13);
+    x64_alu_ri(&b, ALU_SUB, true, RSP, frame);
+    x64_mov_rr(&b, true, R13, RDI);
+    x64_load(&b, true, RBX, RDI, (int32_t)offsetof(JitState, values));
+    x64_load(&b, true, R12, RDI, (int32_t)offsetof(JitState, assigned));
+    x64_store(&b, false, RSP, 0, RSI);
+
+    depth = 0;
+    for (int pc = first; pc < end; pc++) {
+        const Instr *in = &code[pc];
+        labels[pc - first] = b.len;
+        switch (in->op) {
+            case OP_SET:
+                x64_load(&b, false, RAX, RBX, 4 * in->a);
+                x64_store(&b, false, RBX, 4 * in->dest, RAX);
+                x64_store8_imm(&b, R12, in->dest, 1);
+                break;
+            case OP_ADD:
+            case OP_SUB:
+                x64_load(&b, false, RAX, RBX, 4 * in->a);
+                x64_alu_mr(&b, in->op == OP_ADD ? ALU_ADD : ALU_SUB, false, RBX, 4 * in->dest, RAX);
+                break;
+            case OP_ADD_TIMES:
+            case OP_SUB_TIMES: {
+                x64_load(&b, false, RAX, RBX, 4 * in->b);
+                x64_test_rr(&b, false, RAX, RAX);
+                size_t skip = x64_jcc(&b, CC_LE);
+                x64_imul_rm(&b, false, RAX, RBX, 4 * in->a);
+                x64_alu_mr(&b, in->op == OP_ADD_TIMES ? ALU_ADD : ALU_SUB, false, RBX, 4 * in->dest, RAX);
+                x64_patch(&b, skip, b.len);
+                break;
+            }
+            case OP_IF: {
+                static const X64Cond holds[] = {
+                    [IR_EQ] = CC_E, [IR_NE] = CC_NE, [IR_GT] = CC_G,
+                    [IR_LT] = CC_L, [IR_GE] = CC_GE, [IR_LE] = CC_LE,
+                };
+                x64_load(&b, false, RAX, RBX, 4 * in->a);
+                x64_alu_rm(&b, ALU_CMP, false, RAX, RBX, 4 * in->b);
+                fixups[fixup_count++] = (JitFixup){ x64_jcc(&b, x64_negate(holds[in->cmp])), in->target };
+                break;
+            }
+            case OP_LOOP:
+                depth++;
+                x64_load(&b, false, RAX, RBX, 4 * in->a);
+                x64_test_rr(&b, false, RAX, RAX);
+                fixups[fixup_count++] = (JitFixup){ x64_jcc(&b, CC_LE), in->target };
+                x64_store(&b, false, RSP, 8 * depth, RAX);
+                break;
+            case OP_NEXT:
+                x64_dec_m(&b, false, RSP, 8 * depth);
+                fixups[fixup_count++] = (JitFixup){ x64_jcc(&b, CC_NE), in->target };
+                depth--;
+                break;
+            case OP_CHECK:
+                x64_cmp8_mi(&b, R12, in->a, 0);
+                checks[check_count++] = (JitFixup){ x64_jcc(&b, CC_E), pc };
+                break;
+            default: // print and unknown commands go back to the interpreter
+                x64_mov_rr(&b, true, RDI, R13);
+                x64_mov_ri(&b, RSI, (uint32_t)pc);
+                x64_mov_ri64(&b, RAX, (uint64_t)(uintptr_t)jit_output);
+                x64_call_r(&b, RAX);
+                break;
+        }
+    }
+
+    // Falling out of the loop returns 0; failed checks return their index.
+    labels[end - first] = b.len;
+    x64_alu_rr(&b, ALU_XOR, false, RAX, RAX);
+    size_t exit = b.len;
+    x64_alu_ri(&b, ALU_ADD, true, RSP, frame);
+    x64_pop(&b, R13);
+    x64_pop(&b, R12);
+    x64_pop(&b, RBX);
+    x64_ret(&b);
+    for (int i = 0; i < check_count; i++) {
+        x64_patch(&b, checks[i].at, b.len);
+        x64_mov_ri(&b, RAX, (uint32_t)checks[i].pc + 1);
+        x64_patch(&b, x64_jmp(&b), exit);
+    }
+    for (int i = 0; i < fixup_count; i++) x64_patch(&b, fixups[i].at, labels[fixups[i].pc - first]);
+
+    if (!b.oom) loop->fn = jit_install(&b, &loop->size);
+    loop->failed = loop->fn == NULL;
+    x64_free(&b);
+    free(labels);
+    free(fixups);
+    free(checks);
+    return loop->fn != NULL;
+}
+
+// How many of a compiled loop's `left` passes to run natively: all of them,
+// except in a task, which runs only as many as its slice's budget covers (at
+// least one, so it always moves on) and charges them to the budget at the
+// body's length per pass. A pass of a loop with loops inside has no such
+// cost, so a task runs those in the interpreter and their inner loops here.
+static inline int jit_passes(const JitLoop *loop, bool task, uint64_t *budget, int left) {
+    if (!task) return left;
+    if (loop->nested) return 0;
+    uint64_t passes = *budget / (uint64_t)loop->body;
+    if (passes < 1) passes = 1;
+    if (passes > (uint64_t)left) passes = (uint64_t)left;
+    uint64_t cost = passes * (uint64_t)loop->body;
+    *budget = cost < *budget ? *budget - cost : 0;
+    return (int)passes;
+}
+
+// Drop a state's compiled loops, e.g. when it moves on to another script.
+static void jit_release(TakoState *state) {
+    if (!state->jit_loops) return;
+    for (int i = 0; i < state->jit_loop_count; i++) {
+        if (state->jit_loops[i].fn) munmap((void *)state->jit_loops[i].fn, state->jit_loops[i].size);
+    }
+    free(state->jit_loops);
+    state->jit_loops = NULL;
+    state->jit_loop_count = 0;
+    state->jit_program = 0;
+}
+
+// The loop table for `prog`, kept from earlier runs of the same script so hot
+// loops stay compiled. NULL if it cannot be allocated; the run then stays in
+// the interpreter.
+static JitLoop *jit_loops_for(TakoState *state, const Program *prog) {
+    if (state->jit_loops && state->jit_program == prog->id) return state->jit_loops;
+    jit_release(state);
+    state->jit_loops = calloc(prog->loop_count, sizeof(JitLoop));
+    if (!state->jit_loops) return NULL;
+    state->jit_loop_count = prog->loop_count;
+    state->jit_program = prog->id;
+    return state->jit_loops;
+}
+
+#endif
+
+// --- Profiling ---
+
+// With profiling on, run_program sends every dispatch through profile_step
+// before the instruction runs; without it it never does (see run_program), so
+// unprofiled runs pay nothing. TAKO_PROFILE_LINES also counts each
+// instruction and charges the ticks until the next dispatch to it.
+#if TAKO_RDTSC
+static inline uint64_t profile_ticks(void) { return __rdtsc(); }
+#else
+static inline uint64_t profile_ticks(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+struct Profile {
+    TakoProfileMode mode;
+    uint64_t dispatches;
+    uint64_t *counts;   // per instruction, or NULL for TAKO_PROFILE_STATS
+    uint64_t *ticks;
+    int count_cap;
+    uint64_t last;      // ticks at the previous dispatch
+    int last_pc;
+    int jit_loops;      // loops that were compiled to native code
+};
+
+// Clear the counters for a run of `prog`. Returns false if the per-instruction
+// arrays could not grow.
+static bool profile_reset(Profile *p, const Program *prog) {
+    p->dispatches = 0;
+    p->last_pc = 0;
+    p->jit_loops = 0;
+    if (p->mode != TAKO_PROFILE_LINES) return true;
+    if (prog->code_count > p->count_cap) {
+        uint64_t *counts = realloc(p->counts, prog->code_count * sizeof(uint64_t));
+        if (counts) p->counts = counts;
+        uint64_t *ticks = realloc(p->ticks, prog->code_count * sizeof(uint64_t));
+        if (ticks) p->ticks = ticks;
+        if (!counts || !ticks) return false;
+        p->count_cap = prog->code_count;
+    }
+    memset(p->counts, 0, prog->code_count * sizeof(uint64_t));
+    memset(p->ticks, 0, prog->code_count * sizeof(uint64_t));
+    return true;
+}
+
+static inline void profile_step(Profile *p, int pc) {
+    p->dispatches++;
+    if (!p->counts) return;
+    uint64_t now = profile_ticks();
+    p->ticks[p->last_pc] += now - p->last;
+    p->last = now;
+    p->last_pc = pc;
+    p->counts[pc]++;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *op_names[OP_COUNT] = {
+    [OP_SET] = "set", [OP_ADD] = "add", [OP_SUB] = "sub", [OP_ADD_TIMES] = "add_times",
+    [OP_SUB_TIMES] = "sub_times", [OP_PRINT_STR] = "print_str", [OP_PRINT_PAIR] = "print_pair",
+    [OP_PRINT_VAL] = "print_val", [OP_YIELD] = "yield", [OP_SLEEP] = "sleep", [OP_IF] = "if", [OP_PLOOP] = "ploop", [OP_LOOP] = "loop",
+    [OP_NEXT] = "next", [OP_PEND] = "pend", [OP_CHECK] = "check", [OP_BAD] = "bad", [OP_HALT] = "halt",
+};
+
+// Per-line totals. A line runs as many times as its busiest instruction
+// (checks run alongside the statement they guard); its time is their sum.
+typedef struct {
+    int line;
+    int parent;         // line of the innermost enclosing if/loop, or 0
+    uint64_t count;
+    uint64_t ticks;
+} LineProfile;
+
+static int compare_line_ticks(const void *a, const void *b) {
+    const LineProfile *x = a, *y = b;
+    if (x->ticks != y->ticks) return x->ticks < y->ticks ? 1 : -1;
+    return x->line - y->line;
+}
+
+// The statement on a 1-based line, trimmed. Empty when the line is not in
+// `src`, as for a script loaded from an image, which keeps no source.
+static const char *line_text(const SourceFile *src, int line, int *len) {
+    size_t n = 0;
+    const char *s = line >= 1 && line <= src->line_count ? source_line(src, line - 1, &n) : "";
+    while (n > 0 && isspace((unsigned char)*s)) { s++; n--; }
+    while (n > 0 && isspace((unsigned char)s[n - 1])) n--;
+    *len = (int)n;
+    return s;
+}
+
+// One collapsed-stack frame: "line: statement", with the separator removed.
+static void write_frame(FILE *out, const SourceFile *src, int line) {
+    int len;
+    const char *text = line_text(src, line, &len);
+    fprintf(out, "%d: ", line);
+    for (int i = 0; i < len; i++) fputc(text[i] == ';' ? ',' : text[i], out);
+}
+
+static void write_stack(FILE *out, const SourceFile *src, const LineProfile *lines, int line) {
+    if (lines[line].parent) { write_stack(out, src, lines, lines[line].parent); fputc(';', out); }
+    write_frame(out, src, line);
+}
+
+// Print the hot-line and opcode reports to `report` and, when `folded_path`
+// is set, write one collapsed stack per line (time in nanoseconds) for
+// flamegraph tools.
+static int profile_report(const Profile *p, const Program *prog, const SourceFile *src, double seconds, FILE *report, const char *folded_path) {
+    uint64_t total = 0;
+    int rows = 2;
+    for (int pc = 0; pc < prog->code_count; pc++) {
+        total += p->ticks[pc];
+        if (prog->code[pc].line + 2 > rows) rows = prog->code[pc].line + 2;
+    }
+    double ns_per_tick = total ? seconds * 1e9 / total : 0;
+
+    // Enclosing blocks come from the jump structure: an if or loop at `pc`
+    // covers every instruction before its target. The table is sized from the
+    // code, since an image-loaded script has no source lines to count.
+    LineProfile *lines = calloc(rows, sizeof(LineProfile));
+    int *open = malloc((prog->code_count + 1) * sizeof(int)), depth = 0;
+    if (!lines || !open) {
+        free(lines);
+        free(open);
+        return -1;
+    }
+    for (int pc = 0; pc < prog->code_count; pc++) {
+        const Instr *in = &prog->code[pc];
+        while (depth > 0 && pc >= prog->code[open[depth - 1]].target) depth--;
+        LineProfile *l = &lines[in->line];
+        if (l->line == 0) { l->line = in->line; l->parent = depth > 0 ? prog->code[open[depth - 1]].line : 0; }
+        if (p->counts[pc] > l->count) l->count = p->counts[pc];
+        l->ticks += p->ticks[pc];
+        if (in->op == OP_IF || in->op == OP_LOOP) open[depth++] = pc;
+    }
+    free(open);
+
+    int result = 0;
+    if (folded_path) {
+        FILE *out = fopen(folded_path, "w");
+        if (!out) result = -1;
+        for (int i = 1; out && i < rows; i++) {
+            if (lines[i].ticks == 0) continue;
+            write_stack(out, src, lines, i);
+            fprintf(out, " %llu\n", (unsigned long long)(lines[i].ticks * ns_per_tick + 0.5));
+        }
+        if (out && fclose(out) != 0) result = -1;
+    }
+
+    fprintf(report, "\n--- profile: %llu instructions in %.3f ms ---\n", (unsigned long long)p->dispatches, seconds * 1e3);
+    fprintf(report, "%6s %14s %12s %7s  %s\n", "line", "count", "time (ms)", "share", "statement");
+    qsort(lines, rows, sizeof(LineProfile), compare_line_ticks);
+    for (int i = 0; i < rows && i < 25 && lines[i].count > 0; i++) {
+        int len;
+        const char *text = line_text(src, lines[i].line, &len);
+        fprintf(report, "%6d %14llu %12.3f %6.1f%%  %.*s\n", lines[i].line, (unsigned long long)lines[i].count,
+                lines[i].ticks * ns_per_tick / 1e6, total ? 100.0 * lines[i].ticks / total : 0, len, text);
+    }
+    free(lines);
+
+    uint64_t op_counts[OP_COUNT] = {0}, op_ticks[OP_COUNT] = {0};
+    for (int pc = 0; pc < prog->code_count; pc++) {
+        op_counts[prog->code[pc].op] += p->counts[pc];
+        op_ticks[prog->code[pc].op] += p->ticks[pc];
+    }
+    fprintf(report, "\n%-11s %14s %12s %7s\n", "opcode", "count", "time (ms)", "share");
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (op_counts[op] == 0) continue;
+        fprintf(report, "%-11s %14llu %12.3f %6.1f%%\n", op_names[op], (unsigned long long)op_counts[op],
+                op_ticks[op] * ns_per_tick / 1e6, total ? 100.0 * op_ticks[op] / total : 0);
+    }
+    if (folded_path && result == 0) fprintf(report, "\ncollapsed stacks written to %s\n", folded_path);
+    return result;
+}
+
+// --- Core Execution Logic ---
+
+// Computed goto is a GCC/Clang extension; other compilers use a switch.
+#if defined(__GNUC__)
+#define TAKO_COMPUTED_GOTO 1
+#else
+#define TAKO_COMPUTED_GOTO 0
+#endif
+
+#if TAKO_COMPUTED_GOTO
+#define TARGET(op) L_##op:
+#define DISPATCH() goto *table[ip->op]
+#else
+#define TARGET(op) case op:
+#define DISPATCH() goto dispatch
+#endif
+
+// One thread's view of a run. The main run works on the state's variables;
+// a ploop worker runs its share of the passes on private copies, with no
+// profiling and no JIT of its own. A task's slice runs on the state's
+// variables too, and may stop early, leaving `resume` and the control stack
+// to carry on from.
+typedef struct {
+    TakoState *state;
+    const Program *prog;
+    int *values;
+    bool *assigned;
+    TakoError *err;
+    bool worker;
+    int *counters;          // loop control stack, prog->loop_depth deep
+    int depth;              // counters in use on entry, and when a slice stops
+    bool task;              // a task's slice: 'yield', 'sleep' and the budget end it
+    uint64_t budget;        // instructions the slice may still dispatch
+    int sleep_ms;           // how long the 'sleep' that ended the slice asked for
+    const Instr *resume;    // where a stopped slice carries on; NULL once the run is over
+} Exec;
+
+static bool run_parallel(Exec *ex, const Instr *head, int passes, JitLoop *compiled);
+
+void tako_sleep_ms(int ms) {
+#if !defined(_WIN32)
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+#else
+    (void)ms;
+#endif
+}
+
+// Execute from `ip` to OP_HALT, or until a runtime error or, in a task, the
+// end of the slice. A worker starts at the first body instruction of a ploop
+// with its passes on the only counter, and stops at the loop's OP_PEND.
+static TakoStatus execute(Exec *ex, const Instr *ip) {
+    TakoState *state = ex->state;
+    const Program *prog = ex->prog;
+    Profile *profile = ex->worker ? NULL : state->profile;
+    const Instr *code = prog->code;
+    const char *pool = prog->pool;
+    int *values = ex->values;
+    bool *assigned = ex->assigned;
+    TakoError *err = ex->err;
+    TakoStatus status = TAKO_OK;
+    bool task = ex->task;
+    uint64_t budget = ex->budget;
+    if (profile) profile->last = profile_ticks();
+    // Loop counters live on an explicit control stack sized at compile
+    // time, so neither nesting nor iteration count consumes C stack.
+    int *counters = ex->counters;
+    int *top = counters + ex->depth - 1;
+#if TAKO_JIT
+    // Per-instruction counts need every instruction to go through the
+    // dispatch loop, so line profiling keeps the JIT off.
+    JitState jit = { prog, values, assigned, NULL, state };
+    if (state->jit && !ex->worker && prog->loop_count && !(profile && profile->counts)) jit.loops = jit_loops_for(state, prog);
+#endif
+
+#if TAKO_COMPUTED_GOTO
+    static void *dispatch_table[OP_COUNT] = {
+        [OP_SET] = &&L_OP_SET, [OP_ADD] = &&L_OP_ADD, [OP_SUB] = &&L_OP_SUB,
+        [OP_ADD_TIMES] = &&L_OP_ADD_TIMES, [OP_SUB_TIMES] = &&L_OP_SUB_TIMES,
+        [OP_PRINT_STR] = &&L_OP_PRINT_STR, [OP_PRINT_PAIR] = &&L_OP_PRINT_PAIR,
+        [OP_PRINT_VAL] = &&L_OP_PRINT_VAL, [OP_YIELD] = &&L_OP_YIELD, [OP_SLEEP] = &&L_OP_SLEEP,
+        [OP_IF] = &&L_OP_IF, [OP_PLOOP] = &&L_OP_PLOOP,
+        [OP_LOOP] = &&L_OP_LOOP, [OP_NEXT] = &&L_OP_NEXT, [OP_PEND] = &&L_OP_PEND, [OP_CHECK] = &&L_OP_CHECK,
+        [OP_BAD] = &&L_OP_BAD, [OP_HALT] = &&L_OP_HALT,
+    };
+    // Profiled runs and tasks send every dispatch through L_HOOK first. The
+    // table is picked once, so other runs do no extra work per instruction.
+    static void *const hook_table[OP_COUNT] = { [0 ... OP_COUNT - 1] = &&L_HOOK };
+    void *const *table = profile || task ? hook_table : dispatch_table;
+    DISPATCH();
+#else
+dispatch:
+    if (task) {
+        if (budget == 0) goto suspend;
+        budget--;
+    }
+    if (profile) profile_step(profile, (int)(ip - code));
+    switch (ip->op) {
+#endif
+
+    TARGET(OP_SET) {
+        values[ip->dest] = values[ip->a];
+        assigned[ip->dest] = true;
+        ip++;
+        DISPATCH();
+    }
+    TARGET(OP_ADD) {
+        values[ip->dest] += values[ip->a];
+        ip++;
+        DISPATCH();
+    }
+    TARGET(OP_SUB) {
+        values[ip->dest] -= values[ip->a];
+        ip++;
+        DISPATCH();
+    }
+    TARGET(OP_ADD_TIMES)
+    TARGET(OP_SUB_TIMES) {
+        if (values[ip->b] > 0) {
+            unsigned int amount = (unsigned int)values[ip->a] * (unsigned int)values[ip->b];
+            values[ip->dest] = (int)(ip->op == OP_ADD_TIMES ? (unsigned int)values[ip->dest] + amount : (unsigned int)values[ip->dest] - amount);
+        }
+        ip++;
+        DISPATCH();
+    }
+    TARGET(OP_PRINT_STR)
+    TARGET(OP_PRINT_PAIR)
+    TARGET(OP_PRINT_VAL) {
+        exec_output(state, prog, values, ip);
+        ip++;
+        DISPATCH();
+    }
+    TARGET(OP_YIELD) {
+        ip++;
+        if (task) goto suspend;
+        DISPATCH();
+    }
+    TARGET(OP_SLEEP) {
+        int ms = values[ip->a] > 0 ? values[ip->a] : 0;
+        ip++;
+        if (task) {
+            ex->sleep_ms = ms;
+            goto suspend;
+        }
+        if (ms > 0) {
+            flush_output(state); // so what came before the pause shows before it
+            tako_sleep_ms(ms);
+        }
+        DISPATCH();
+    }
+    TARGET(OP_IF) {
+        int left_val = values[ip->a];
+        int right_val = values[ip->b];
+        bool condition;
+        switch (ip->cmp) {
+            case IR_EQ: condition = (left_val == right_val); break;
+            case IR_NE: condition = (left_val != right_val); break;
+            case IR_GT: condition = (left_val > right_val); break;
+            case IR_LT: condition = (left_val < right_val); break;
+            case IR_GE: condition = (left_val >= right_val); break;
+            default:     condition = (left_val <= right_val); break;
+        }
+        ip = condition ? ip + 1 : code + ip->target;
+        DISPATCH();
+    }
+    TARGET(OP_PLOOP) {
+        // A task runs it on its own thread, a slice at a time.
+        if (!ex->worker && !task && values[ip->a] >= 2 * PLOOP_MIN_PASSES) {
+            JitLoop *compiled = NULL;
+#if TAKO_JIT
+            if (jit.loops && jit_compile(&jit, (int)(ip - code))) compiled = &jit.loops[ip->b];
+#endif
+            if (run_parallel(ex, ip, values[ip->a], compiled)) {
+                ip = code + ip->target;
+                DISPATCH();
+            }
+        }
+        // Otherwise, and inside workers, it is an ordinary loop.
+    }
+    // fall through
+    TARGET(OP_LOOP) {
+        int loop_count = values[ip->a];
+#if TAKO_JIT
+        int passes;
+        if (loop_count > 0 && jit.loops && jit.loops[ip->b].fn && (passes = jit_passes(&jit.loops[ip->b], task, &budget, loop_count)) > 0) {
+            int failed = jit.loops[ip->b].fn(&jit, passes);
+            if (failed) ip = code + failed - 1;
+            else if (passes == loop_count) ip = code + ip->target;
+            else {
+                // The slice's budget ran out first: go on from the OP_NEXT.
+                *++top = loop_count - passes + 1;
+                ip = code + ip->target - 1;
+            }
+            DISPATCH();
+        }
+#endif
+        if (loop_count > 0) {
+            *++top = loop_count;
+            ip++;
+        } else {
+            ip = code + ip->target;
+        }
+        DISPATCH();
+    }
+    TARGET(OP_NEXT) {
+        if (--*top > 0) {
+#if TAKO_JIT
+            // Hot loop: compile it and run the remaining passes natively. A
+            // task also comes back here for each further share of them.
+            JitLoop *loop = jit.loops ? &jit.loops[ip->b] : NULL;
+            int passes;
+            if (loop && (loop->fn || ++loop->hot == JIT_THRESHOLD) && jit_compile(&jit, ip->target - 1) && (passes = jit_passes(loop, task, &budget, *top)) > 0) {
+                int failed = loop->fn(&jit, passes);
+                *top -= passes;
+                if (failed || *top == 0) {
+                    top--;
+                    ip = failed ? code + failed - 1 : ip + 1;
+                } else {
+                    ++*top; // passes remain: this OP_NEXT again
+                }
+                DISPATCH();
+            }
+#endif
+            ip = code + ip->target;
+        } else {
+            top--;
+            ip++;
+        }
+        DISPATCH();
+    }
+    TARGET(OP_PEND) {
+        // A worker is done once its own ploop's counter is popped.
+        if (ex->worker && top < counters) goto halt;
+        ip++;
+        DISPATCH();
+    }
+    TARGET(OP_CHECK) {
+        if (!assigned[ip->a]) {
+            // Error: Undeclared variable
+            status = set_error(err, TAKO_ERR_RUNTIME, ip->line, "Runtime Error: Unknown variable or invalid number '%s'", pool + prog->syms.symbols[ip->a].name);
+            goto halt;
+        }
+        ip++;
+        DISPATCH();
+    }
+    TARGET(OP_BAD) {
+        exec_output(state, prog, values, ip);
+        ip++;
+        DISPATCH();
+    }
+    TARGET(OP_HALT) {
+        goto halt;
+    }
+
+#if TAKO_COMPUTED_GOTO
+L_HOOK:
+    if (task) {
+        if (budget == 0) goto suspend;
+        budget--;
+    }
+    if (profile) profile_step(profile, (int)(ip - code));
+    goto *dispatch_table[ip->op];
+#else
+    default:
+        break;
+    }
+#endif
+
+halt:
+    ip = NULL;
+suspend:
+    ex->resume = ip;
+    ex->depth = (int)(top - counters) + 1;
+    ex->budget = budget;
+#if TAKO_JIT
+    if (profile && jit.loops) {
+        profile->jit_loops = 0;
+        for (int i = 0; i < prog->loop_count; i++) profile->jit_loops += jit.loops[i].fn != NULL;
+    }
+#endif
+    return status;
+}
+
+#undef TARGET
+#undef DISPATCH
+
+// Execute a compiled program from its first instruction to OP_HALT, or until
+// a runtime error. Output is flushed to the sink before returning.
+static TakoStatus run_program(TakoState *state, const Program *prog, TakoError *err) {
+    if (!bind_program(state, prog) || (state->profile && !profile_reset(state->profile, prog))) {
+        return set_error(err, TAKO_ERR_NOMEM, 0, "Runtime Error: Out of memory");
+    }
+    Exec ex = { .state = state, .prog = prog, .values = state->values, .assigned = state->assigned, .err = err, .counters = state->counters };
+    TakoStatus status = execute(&ex, prog->code);
+    flush_output(state);
+    return status;
+}
+
+// --- Parallel Loops ---
+
+// Split a ploop's passes into chunks, one per thread, each run on its own
+// copy of the variables. The calling thread takes the last chunk. Afterwards
+// every sum gets the change made by each chunk, and every other variable
+// takes its value from the last chunk, as if the passes had run in order.
+// Returns false, having changed nothing, when the loop should run
+// sequentially instead: too few passes or threads, or a chunk that failed
+// (the sequential run then reports the error where it happens).
+
+typedef struct {
+    Exec ex;
+    const Instr *body;
+    int passes;
+    JitLoop *compiled;
+    TakoError err;
+    TakoStatus status;
+#if TAKO_THREADS
+    pthread_t thread;
+    bool started;
+#endif
+} PloopChunk;
+
+static void *run_chunk(void *arg) {
+    PloopChunk *c = arg;
+#if TAKO_JIT
+    if (c->compiled && c->compiled->fn) {
+        JitState jit = { c->ex.prog, c->ex.values, c->ex.assigned, NULL, c->ex.state };
+        c->status = c->compiled->fn(&jit, c->passes) ? TAKO_ERR_RUNTIME : TAKO_OK;
+        return NULL;
+    }
+#endif
+    c->ex.counters[0] = c->passes;
+    c->ex.depth = 1;
+    c->status = execute(&c->ex, c->body);
+    return NULL;
+}
+
+static int ploop_threads(const TakoState *state) {
+#if TAKO_THREADS
+    if (state->threads > 0) return state->threads;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+#else
+    (void)state;
+    return 1;
+#endif
+}
+
+static bool run_parallel(Exec *ex, const Instr *head, int passes, JitLoop *compiled) {
+    TakoState *state = ex->state;
+    const Program *prog = ex->prog;
+    // Line profiles should count every pass.
+    if (state->profile && state->profile->counts) return false;
+    int threads = ploop_threads(state);
+    if (threads > passes / PLOOP_MIN_PASSES) threads = passes / PLOOP_MIN_PASSES;
+    if (threads < 2) return false;
+
+    int slots = prog->syms.count, depth = prog->loop_depth;
+    PloopChunk *chunks = calloc(threads, sizeof(PloopChunk));
+    int *values = malloc((size_t)threads * slots * sizeof(int) + 1);
+    bool *assigned = malloc((size_t)threads * slots * sizeof(bool) + 1);
+    int *counters = malloc((size_t)threads * depth * sizeof(int));
+    if (!chunks || !values || !assigned || !counters) {
+        free(chunks);
+        free(values);
+        free(assigned);
+        free(counters);
+        return false;
+    }
+    for (int t = 0; t < threads; t++) {
+        PloopChunk *c = &chunks[t];
+        c->ex = (Exec){ .state = state, .prog = prog, .values = values + (size_t)t * slots, .assigned = assigned + (size_t)t * slots,
+                        .err = &c->err, .worker = true, .counters = counters + (size_t)t * depth };
+        memcpy(c->ex.values, ex->values, slots * sizeof(int));
+        memcpy(c->ex.assigned, ex->assigned, slots * sizeof(bool));
+        c->body = head + 1;
+        c->passes = t < threads - 1 ? passes / threads : passes - (passes / threads) * (threads - 1);
+        c->compiled = compiled;
+    }
+    for (int t = 0; t < threads - 1; t++) {
+#if TAKO_THREADS
+        chunks[t].started = pthread_create(&chunks[t].thread, NULL, run_chunk, &chunks[t]) == 0;
+        if (!chunks[t].started) run_chunk(&chunks[t]);
+#else
+        run_chunk(&chunks[t]);
+#endif
+    }
+    run_chunk(&chunks[threads - 1]);
+
+    bool ok = true;
+    for (int t = 0; t < threads; t++) {
+#if TAKO_THREADS
+        if (chunks[t].started) pthread_join(chunks[t].thread, NULL);
+#endif
+        ok = ok && chunks[t].status == TAKO_OK;
+    }
+    if (ok) {
+        const int *sums = prog->sums + head->dest;
+        for (int s = 0; s < head->str; s++) {
+            unsigned int base = (unsigned int)ex->values[sums[s]], total = base;
+            for (int t = 0; t < threads; t++) total += (unsigned int)chunks[t].ex.values[sums[s]] - base;
+            chunks[threads - 1].ex.values[sums[s]] = (int)total;
+        }
+        memcpy(ex->values, chunks[threads - 1].ex.values, slots * sizeof(int));
+        memcpy(ex->assigned, chunks[threads - 1].ex.assigned, slots * sizeof(bool));
+    }
+    free(chunks);
+    free(values);
+    free(assigned);
+    free(counters);
+    return ok;
+}
+
+
+// --- Library Interface ---
+
+// Hand out a finished script with a fresh program id.
+static TakoStatus publish_script(TakoScript *script, double start, TakoScript **out) {
+#if TAKO_JIT
+    static uint64_t next_id;
+    script->prog.id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+#endif
+    script->compile_seconds = now_seconds() - start;
+    *out = script;
+    return TAKO_OK;
+}
+
+// Compile a script whose source is loaded, matching its blocks unless it
+// already has a match table. Takes ownership of the source; on failure
+// everything is freed.
+static TakoStatus compile_script(TakoScript *script, const Program *seed, int opt_level, double start, TakoScript **out, TakoError *err) {
+    if (opt_level == TAKO_OPT_DEFAULT) opt_level = IR_OPT_DEFAULT;
+    int *match = script->match ? script->match : malloc((script->src.line_count ? script->src.line_count : 1) * sizeof(int));
+    if (!match) {
+        set_error(err, TAKO_ERR_NOMEM, 0, "Error: Out of memory");
+    } else if (script->match || match_blocks(&script->src, match, NULL, err) >= 0) {
+        compile_program(&script->prog, &script->src, match, seed, opt_level, &script->reused, err);
+    }
+    if (match != script->match) free(match);
+    if (err->status != TAKO_OK) {
+        source_free(&script->src);
+        free(script->match);
+        free(script->parent);
+        free(script);
+        return err->status;
+    }
+    script->line_count = script->src.line_count;
+    return publish_script(script, start, out);
+}
+
+TakoStatus tako_compile_file(const char *path, int opt_level, TakoScript **out, TakoError *err) {
+    double start = now_seconds();
+    TakoError local;
+    if (!err) err = &local;
+    clear_error(err);
+    *out = NULL;
+    TakoScript *script = calloc(1, sizeof(TakoScript));
+    if (!script) return set_error(err, TAKO_ERR_NOMEM, 0, "Error: Out of memory");
+    if (source_load(&script->src, path) != 0) {
+        set_error(err, TAKO_ERR_IO, 0, "Error opening file: %s", strerror(errno));
+        free(script);
+        return err->status;
+    }
+    return compile_script(script, NULL, opt_level, start, out, err);
+}
+
+TakoStatus tako_compile_string(const char *text, size_t len, int opt_level, TakoScript **out, TakoError *err) {
+    double start = now_seconds();
+    TakoError local;
+    if (!err) err = &local;
+    clear_error(err);
+    *out = NULL;
+    TakoScript *script = calloc(1, sizeof(TakoScript));
+    if (!script || source_load_buffer(&script->src, text, len) != 0) {
+        free(script);
+        return set_error(err, TAKO_ERR_NOMEM, 0, "Error: Out of memory");
+    }
+    return compile_script(script, NULL, opt_level, start, out, err);
+}
+
+TakoStatus tako_compile_edit(const TakoScript *prev, const char *path, int opt_level, TakoScript **out, TakoReuse *reuse, TakoError *err) {
+    double start = now_seconds();
+    TakoError local;
+    if (!err) err = &local;
+    clear_error(err);
+    *out = NULL;
+    if (reuse) memset(reuse, 0, sizeof(TakoReuse));
+    TakoScript *script = calloc(1, sizeof(TakoScript));
+    if (!script) return set_error(err, TAKO_ERR_NOMEM, 0, "Error: Out of memory");
+    if (source_read_copy(&script->src, path) != 0) {
+        set_error(err, TAKO_ERR_IO, 0, "Error opening file: %s", strerror(errno));
+        free(script);
+        return err->status;
+    }
+
+    // Lex only the lines the edit touched. A cached script kept no text.
+    if (prev && !prev->src.lines) prev = NULL;
+    SourceEdit edit;
+    if ((prev ? source_reindex(&script->src, &prev->src, &edit) : source_index(&script->src)) != 0) {
+        free(script);
+        return set_error(err, TAKO_ERR_NOMEM, 0, "Error: Out of memory");
+    }
+    int count = script->src.line_count;
+    if (!prev) edit = (SourceEdit){ 0, 0, count, script->src.size };
+
+    // Match blocks again only around the edit.
+    script->match = malloc((count ? count : 1) * sizeof(int));
+    script->parent = malloc((count ? count : 1) * sizeof(int));
+    int matched = -1;
+    if (!script->match || !script->parent) {
+        set_error(err, TAKO_ERR_NOMEM, 0, "Error: Out of memory");
+    } else {
+        matched = prev && prev->match ? rematch_blocks(&script->src, &edit, prev->match, prev->parent, prev->src.line_count, script->match, script->parent, err)
+                                      : (match_blocks(&script->src, script->match, script->parent, err) < 0 ? -1 : count);
+    }
+    if (reuse) {
+        reuse->lines = count;
+        reuse->lines_lexed = edit.new_end - edit.first;
+        reuse->bytes_lexed = edit.bytes_lexed;
+        reuse->lines_matched = matched < 0 ? count : matched;
+    }
+    if (matched < 0) {
+        source_free(&script->src);
+        free(script->match);
+        free(script->parent);
+        free(script);
+        return err->status;
+    }
+
+    if (compile_script(script, prev ? &prev->prog : NULL, opt_level, start, out, err) != TAKO_OK) return err->status;
+    if (reuse) {
+        reuse->symbols = script->prog.syms.count;
+        reuse->symbols_reused = script->reused;
+    }
+    return TAKO_OK;
+}
+
+void tako_script_free(TakoScript *script) {
+    if (!script) return;
+#if TAKO_CACHE
+    if (script->image) munmap(script->image, script->image_size);
+    else
+#endif
+    free_program(&script->prog);
+    source_free(&script->src);
+    free(script->match);
+    free(script->parent);
+    free(script);
+}
+
+TakoState *tako_state_new(void) {
+    TakoState *state = calloc(1, sizeof(TakoState));
+    if (!state) return NULL;
+    state->jit = true;
+    state->sink = default_sink;
+    return state;
+}
+
+void tako_state_free(TakoState *state) {
+    if (!state) return;
+#if TAKO_JIT
+    jit_release(state);
+#endif
+    tako_state_set_profile(state, TAKO_PROFILE_OFF);
+    free(state->values);
+    free(state->assigned);
+    free(state->out);
+    free(state->counters);
+    free(state);
+}
+
+void tako_state_set_sink(TakoState *state, TakoSink sink, void *ctx) {
+    state->sink = sink ? sink : default_sink;
+    state->sink_ctx = sink ? ctx : NULL;
+}
+
+void tako_state_set_jit(TakoState *state, bool jit) {
+    state->jit = jit;
+}
+
+void tako_state_set_threads(TakoState *state, int threads) {
+    state->threads = threads > 0 ? threads : 0;
+}
+
+void tako_state_set_profile(TakoState *state, TakoProfileMode mode) {
+    Profile *p = state->profile;
+    if (mode == TAKO_PROFILE_OFF) {
+        if (p) {
+            free(p->counts);
+            free(p->ticks);
+            free(p);
+        }
+        state->profile = NULL;
+        return;
+    }
+    // Allocated on first use; the counters are sized by the next run.
+    if (!p) p = state->profile = calloc(1, sizeof(Profile));
+    if (p) p->mode = mode;
+}
+
+TakoStatus tako_run(const TakoScript *script, TakoState *state, TakoError *err) {
+    TakoError local;
+    if (!err) err = &local;
+    clear_error(err);
+    double start = now_seconds();
+    TakoStatus status = run_program(state, &script->prog, err);
+    state->run_seconds = now_seconds() - start;
+    return status;
+}
+
+TakoStatus tako_task_start(const TakoScript *script, TakoState *state, TakoError *err) {
+    TakoError local;
+    if (!err) err = &local;
+    clear_error(err);
+    const Program *prog = &script->prog;
+    if (!bind_program(state, prog) || (state->profile && !profile_reset(state->profile, prog))) {
+        return set_error(err, TAKO_ERR_NOMEM, 0, "Runtime Error: Out of memory");
+    }
+    state->task = prog;
+    state->task_pc = 0;
+    state->task_depth = 0;
+    state->run_seconds = 0;
+    return TAKO_OK;
+}
+
+TakoStatus tako_task_step(const TakoScript *script, TakoState *state, uint64_t budget, TakoSlice *slice, TakoError *err) {
+    TakoError local;
+    if (!err) err = &local;
+    clear_error(err);
+    memset(slice, 0, sizeof(TakoSlice));
+    const Program *prog = &script->prog;
+    if (state->task != prog) {
+        slice->done = true;
+        return set_error(err, TAKO_ERR_RUNTIME, 0, "Runtime Error: No task of this script is under way");
+    }
+    if (budget == 0) budget = UINT64_MAX;
+    double start = now_seconds();
+    Exec ex = { .state = state, .prog = prog, .values = state->values, .assigned = state->assigned, .err = err,
+                .counters = state->counters, .depth = state->task_depth, .task = true, .budget = budget };
+    TakoStatus status = execute(&ex, prog->code + state->task_pc);
+    flush_output(state);
+    state->run_seconds += now_seconds() - start;
+    slice->dispatched = budget - ex.budget;
+    if (status != TAKO_OK || !ex.resume) {
+        state->task = NULL;
+        slice->done = true;
+        return status;
+    }
+    state->task_pc = (int)(ex.resume - prog->code);
+    state->task_depth = ex.depth;
+    slice->sleep_ms = ex.sleep_ms;
+    return TAKO_OK;
+}
+
+size_t tako_state_memory(const TakoState *state) {
+    size_t bytes = sizeof(TakoState) + (size_t)state->slot_count * (sizeof(int) + sizeof(bool)) + (size_t)state->counter_cap * sizeof(int) + state->out_cap;
+#if TAKO_JIT
+    bytes += (size_t)state->jit_loop_count * sizeof(JitLoop);
+    for (int i = 0; i < state->jit_loop_count; i++) bytes += state->jit_loops[i].size;
+#endif
+    if (state->profile) bytes += sizeof(Profile) + (size_t)state->profile->count_cap * 2 * sizeof(uint64_t);
+    return bytes;
+}
+
+void tako_stats(const TakoScript *script, const TakoState *state, TakoStats *out) {
+    const Program *prog = &script->prog;
+    memset(out, 0, sizeof(TakoStats));
+    out->compile_seconds = script->compile_seconds;
+    out->cached = script->image != NULL;
+    out->line_count = script->line_count;
+    out->instruction_count = prog->code_count;
+    for (int slot = 0; slot < prog->syms.count; slot++) out->variable_count += !prog->syms.symbols[slot].is_const;
+    out->literal_count = prog->syms.count - out->variable_count;
+    if (state) {
+        out->run_seconds = state->run_seconds;
+        if (state->profile) {
+            out->dispatches = state->profile->dispatches;
+            out->jit_loops = state->profile->jit_loops;
+        }
+    }
+}
+
+int tako_profile_report(const TakoScript *script, const TakoState *state, FILE *out, const char *folded_path) {
+    const Profile *p = state->profile;
+    if (!p || !p->counts) return 0;
+    return profile_report(p, &script->prog, &script->src, state->run_seconds, out, folded_path);
+}
+
+// --- Script Cache ---
+
+// A .takoc image is a compiled Program laid out for mmap: a header, then the
+// instructions, the symbols, the ploop sums and the string pool, exactly as
+// the interpreter holds them in memory. Everything refers to other data by
+// index or pool offset, so the image runs wherever it is mapped. Images are named after a
+// hash of the source text and the optimization level, and carry enough to
+// reject anything stale, foreign or damaged; those fall back to the source.
+#define TAKOC_MAGIC "TAKOC\r\n\032"
+#define TAKOC_VERSION 3     // bump whenever Instr, Symbol, OpCode or lowering change
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t instr_size;    // sizeof(Instr) and sizeof(Symbol) of the writer
+    uint32_t symbol_size;
+    uint32_t op_count;
+    uint32_t byte_order;    // 0x01020304 as the writer stored it
+    uint64_t source_hash;
+    uint64_t source_size;
+    int32_t opt_level;
+    int32_t line_count;
+    int32_t code_count;
+    int32_t loop_depth;
+    int32_t loop_count;
+    int32_t symbol_count;
+    int32_t sum_count;
+    uint32_t reserved;      // zero
+    uint64_t code_offset;
+    uint64_t symbols_offset;
+    uint64_t sums_offset;
+    uint64_t pool_offset;
+    uint64_t pool_size;
+    uint64_t image_size;
+    uint64_t checksum;      // see image_checksum
+} TakocHeader;
+
+// 64-bit hash used for cache keys and image checksums. It takes eight bytes
+// per step, so hashing a script costs far less than lexing it.
+static uint64_t hash_content(const void *data, size_t size) {
+    const unsigned char *p = data;
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ size;
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    uint64_t w = 0;
+    memcpy(&w, p, size);
+    h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    return h ^ (h >> 33);
+}
+
+#if TAKO_CACHE
+
+// Hash of the whole image, taking the header's checksum field as zero.
+static uint64_t image_checksum(const TakocHeader *h, const char *image) {
+    TakocHeader copy = *h;
+    copy.checksum = 0;
+    return hash_content(&copy, sizeof(copy)) * 31 ^ hash_content(image + sizeof(TakocHeader), h->image_size - sizeof(TakocHeader));
+}
+
+// Blocks must nest as lower_program lays them out: an OP_IF jumps forward to
+// the end of its body, and a loop's target is one past the OP_NEXT that
+// closes it (then an OP_PEND for a ploop), all inside the enclosing block.
+// Loops may nest no deeper than loop_depth, which sizes the control stack.
+static bool image_blocks_valid(const Program *prog) {
+    const Instr *code = prog->code;
+    int *open = malloc((size_t)prog->code_count * sizeof(int));
+    if (!open) return false;
+    int depth = 0, loops = 0, pend = -1;
+    bool ok = true;
+    for (int pc = 0; pc < prog->code_count && ok; pc++) {
+        const Instr *in = &code[pc];
+        while (depth > 0 && code[open[depth - 1]].op == OP_IF && code[open[depth - 1]].target == pc) depth--;
+        int limit = prog->code_count - 1; // the innermost block ends before this
+        if (depth > 0) {
+            const Instr *head = &code[open[depth - 1]];
+            limit = head->op == OP_IF ? head->target : head->target - 1;
+        }
+        if (in->op == OP_PEND) {
+            ok = pc == pend;
+        } else if (in->op == OP_NEXT) {
+            const Instr *head = depth > 0 ? &code[open[depth - 1]] : NULL;
+            ok = head && head->op != OP_IF && head->target - 1 == pc && in->target == open[depth - 1] + 1 && in->b == head->b;
+            if (ok && head->op == OP_PLOOP) pend = pc + 1;
+            depth--;
+            loops--;
+        } else if (in->op == OP_IF) {
+            ok = in->target > pc && in->target <= limit;
+            open[depth++] = pc;
+        } else if (in->op == OP_LOOP || in->op == OP_PLOOP) {
+            int end = in->op == OP_PLOOP ? in->target + 1 : in->target;
+            ok = in->target - 1 > pc && end <= limit && ++loops <= prog->loop_depth &&
+                 (in->op == OP_LOOP || code[in->target].op == OP_PEND);
+            open[depth++] = pc;
+        }
+    }
+    free(open);
+    return ok && depth == 0;
+}
+
+// Every operand of every instruction must name something in the image, so
+// a damaged image cannot make the interpreter read out of bounds.
+static bool image_program_valid(const Program *prog, int pool_size, int line_count) {
+    const SymbolTable *t = &prog->syms;
+    for (int slot = 0; slot < t->count; slot++) {
+        if (t->symbols[slot].name < 0 || t->symbols[slot].name >= pool_size) return false;
+        // Read the flag as a byte; any value but 0 or 1 is not a valid bool.
+        unsigned char is_const;
+        memcpy(&is_const, &t->symbols[slot].is_const, 1);
+        if (is_const > 1) return false;
+    }
+    for (int s = 0; s < prog->sum_count; s++) {
+        if ((unsigned)prog->sums[s] >= (unsigned)t->count) return false;
+    }
+    if (prog->code_count < 1 || prog->code[prog->code_count - 1].op != OP_HALT) return false;
+    for (int pc = 0; pc < prog->code_count; pc++) {
+        const Instr *in = &prog->code[pc];
+        if ((unsigned)in->op >= OP_COUNT || in->target < 0 || in->target > prog->code_count) return false;
+        if ((unsigned)in->cmp > IR_LE || in->line < 0 || in->line > line_count) return false;
+        if (in->op == OP_PLOOP) {
+            if (in->dest < 0 || in->str < 0 || in->dest > prog->sum_count - in->str) return false;
+        } else if ((unsigned)in->dest >= (unsigned)t->count + (t->count == 0) || in->str < 0 || in->str >= pool_size) {
+            return false;
+        }
+        if ((unsigned)in->a >= (unsigned)t->count + (t->count == 0)) return false;
+        if (in->op == OP_LOOP || in->op == OP_PLOOP || in->op == OP_NEXT) {
+            if (in->b < 0 || in->b >= prog->loop_count) return false;
+        } else if ((unsigned)in->b >= (unsigned)t->count + (t->count == 0)) {
+            return false;
+        }
+    }
+    return image_blocks_valid(prog);
+}
+
+// Map the image at `path` into `script` if it is a sound image of this
+// source at this level.
+static bool load_image(TakoScript *script, const char *path, uint64_t hash, size_t source_size, int opt_level) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(TakocHeader)) {
+        base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) return false;
+
+    size_t size = (size_t)st.st_size;
+    const TakocHeader *h = base;
+    bool ok = memcmp(h->magic, TAKOC_MAGIC, 8) == 0 && h->version == TAKOC_VERSION &&
+        h->header_size == sizeof(TakocHeader) && h->instr_size == sizeof(Instr) &&
+        h->symbol_size == sizeof(Symbol) && h->op_count == OP_COUNT && h->byte_order == 0x01020304 &&
+        h->source_hash == hash && h->source_size == source_size && h->opt_level == opt_level &&
+        h->image_size == size && h->code_count > 0 && h->symbol_count >= 0 &&
+        h->line_count >= 0 && h->loop_count >= 0 && h->loop_depth >= 0 && h->loop_depth <= h->loop_count &&
+        h->sum_count >= 0 && h->code_offset % sizeof(int) == 0 && h->symbols_offset % sizeof(int) == 0 &&
+        h->sums_offset % sizeof(int) == 0 && h->code_offset >= sizeof(TakocHeader) &&
+        h->code_offset + (uint64_t)h->code_count * sizeof(Instr) <= h->symbols_offset &&
+        h->symbols_offset + (uint64_t)h->symbol_count * sizeof(Symbol) <= h->sums_offset &&
+        h->sums_offset + (uint64_t)h->sum_count * sizeof(int) <= h->pool_offset &&
+        h->pool_size > 0 && h->pool_size <= INT32_MAX && h->pool_offset + h->pool_size == size &&
+        ((const char *)base)[size - 1] == '\0' && image_checksum(h, base) == h->checksum;
+    if (ok) {
+        Program *prog = &script->prog;
+        memset(prog, 0, sizeof(Program));
+        prog->code = (Instr *)((char *)base + h->code_offset);
+        prog->code_count = h->code_count;
+        prog->pool = (char *)base + h->pool_offset;
+        prog->pool_len = (int)h->pool_size;
+        prog->syms.symbols = (Symbol *)((char *)base + h->symbols_offset);
+        prog->syms.count = h->symbol_count;
+        prog->sums = (int *)((char *)base + h->sums_offset);
+        prog->sum_count = h->sum_count;
+        prog->loop_depth = h->loop_depth;
+        prog->loop_count = h->loop_count;
+        ok = image_program_valid(prog, prog->pool_len, h->line_count);
+    }
+    if (!ok) {
+        munmap(base, size);
+        return false;
+    }
+    script->image = base;
+    script->image_size = size;
+    script->line_count = h->line_count;
+    return true;
+}
+
+// Write a compiled script's image. It goes to a temporary file first and is
+// renamed into place, so readers never see a partial image.
+static void save_image(const TakoScript *script, const char *path, uint64_t hash, int opt_level) {
+    const Program *prog = &script->prog;
+    TakocHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TAKOC_MAGIC, 8);
+    h.version = TAKOC_VERSION;
+    h.header_size = sizeof(TakocHeader);
+    h.instr_size = sizeof(Instr);
+    h.symbol_size = sizeof(Symbol);
+    h.op_count = OP_COUNT;
+    h.byte_order = 0x01020304;
+    h.source_hash = hash;
+    h.source_size = script->src.size;
+    h.opt_level = opt_level;
+    h.line_count = script->line_count;
+    h.code_count = prog->code_count;
+    h.loop_depth = prog->loop_depth;
+    h.loop_count = prog->loop_count;
+    h.symbol_count = prog->syms.count;
+    h.sum_count = prog->sum_count;
+    h.code_offset = sizeof(TakocHeader);
+    h.symbols_offset = h.code_offset + (uint64_t)prog->code_count * sizeof(Instr);
+    h.sums_offset = h.symbols_offset + (uint64_t)prog->syms.count * sizeof(Symbol);
+    h.pool_offset = h.sums_offset + (uint64_t)prog->sum_count * sizeof(int);
+    h.pool_size = prog->pool_len ? (uint64_t)prog->pool_len : 1;
+    h.image_size = h.pool_offset + h.pool_size;
+
+    // Symbols are copied field by field so their padding is zero.
+    char *image = calloc(1, h.image_size);
+    if (!image) return;
+    memcpy(image + h.code_offset, prog->code, (size_t)prog->code_count * sizeof(Instr));
+    Symbol *symbols = (Symbol *)(image + h.symbols_offset);
+    for (int slot = 0; slot < prog->syms.count; slot++) {
+        symbols[slot].name = prog->syms.symbols[slot].name;
+        symbols[slot].is_const = prog->syms.symbols[slot].is_const;
+        symbols[slot].value = prog->syms.symbols[slot].value;
+    }
+    if (prog->sum_count) memcpy(image + h.sums_offset, prog->sums, (size_t)prog->sum_count * sizeof(int));
+    if (prog->pool_len) memcpy(image + h.pool_offset, prog->pool, prog->pool_len);
+    h.checksum = image_checksum(&h, image);
+    memcpy(image, &h, sizeof(h));
+
+    char tmp[4096];
+    // Unique per writer.
+    snprintf(tmp, sizeof(tmp), "%s.%ld.%p.tmp", path, (long)getpid(), (const void *)script);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        size_t done = 0;
+        while (done < h.image_size) {
+            ssize_t n = write(fd, image + done, h.image_size - done);
+            if (n <= 0) break;
+            done += (size_t)n;
+        }
+        if (close(fd) != 0 || done != h.image_size || rename(tmp, path) != 0) unlink(tmp);
+    }
+    free(image);
+}
+
+// mkdir -p, ignoring failures; a missing directory just means no cache.
+static void make_dirs(const char *dir) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s", dir);
+    for (char *p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        mkdir(path, 0755);
+        *p = '/';
+    }
+    mkdir(path, 0755);
+}
+
+#endif
+
+TakoStatus tako_compile_cached(const char *path, int opt_level, const char *cache_dir, TakoScript **out, TakoError *err) {
+#if TAKO_CACHE
+    if (!cache_dir) return tako_compile_file(path, opt_level, out, err);
+    double start = now_seconds();
+    TakoError local;
+    if (!err) err = &local;
+    clear_error(err);
+    *out = NULL;
+    if (opt_level == TAKO_OPT_DEFAULT) opt_level = IR_OPT_DEFAULT;
+    TakoScript *script = calloc(1, sizeof(TakoScript));
+    if (!script) return set_error(err, TAKO_ERR_NOMEM, 0, "Error: Out of memory");
+    if (source_read(&script->src, path) != 0) {
+        set_error(err, TAKO_ERR_IO, 0, "Error opening file: %s", strerror(errno));
+        free(script);
+        return err->status;
+    }
+
+    uint64_t hash = hash_content(script->src.data, script->src.size);
+    char image_path[4096];
+    snprintf(image_path, sizeof(image_path), "%s/%016llx-O%d.takoc", cache_dir, (unsigned long long)hash, opt_level);
+    if (load_image(script, image_path, hash, script->src.size, opt_level)) {
+        source_free(&script->src);
+        return publish_script(script, start, out);
+    }
+
+    if (source_index(&script->src) != 0) {
+        free(script);
+        return set_error(err, TAKO_ERR_NOMEM, 0, "Error: Out of memory");
+    }
+    if (compile_script(script, NULL, opt_level, start, out, err) != TAKO_OK) return err->status;
+    make_dirs(cache_dir);
+    save_image(script, image_path, hash, opt_level);
+    return TAKO_OK;
+#else
+    (void)cache_dir;
+    return tako_compile_file(path, opt_level, out, err);
+#endif
+}
@@ -0,0 +1,241 @@
+#include "source.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// --- Script Loading ---
+
+// Read a whole stream into a heap buffer. Used for pipes, stdin, and
+// platforms without mmap.
+static int read_stream(SourceFile *src, FILE *fp) {
+    size_t cap = 1 << 16, size = 0;
+    char *buf = malloc(cap);
+    if (!buf) return -1;
+    for (;;) {
+        size_t n = fread(buf + size, 1, cap - size, fp);
+        size += n;
+        if (n == 0) break;
+        if (size == cap) {
+            char *grown = realloc(buf, cap * 2);
+            if (!grown) { free(buf); errno = ENOMEM; return -1; }
+            buf = grown;
+            cap *= 2;
+        }
+    }
+    if (ferror(fp)) { free(buf); errno = EIO; return -1; }
+    src->data = buf;
+    src->size = size;
+    src->mapped = false;
+    return 0;
+}
+
+// Map a regular file read-only. Falls back to reading for anything that
+// cannot be mapped (pipes, character devices, empty files).
+static int map_file(SourceFile *src, const char *path) {
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            close(fd);
+            src->data = p;
+            src->size = (size_t)st.st_size;
+            src->mapped = true;
+            return 0;
+        }
+    }
+    FILE *fp = fdopen(fd, "rb");
+    if (!fp) { close(fd); return -1; }
+#else
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return -1;
+#endif
+    int rc = read_stream(src, fp);
+    fclose(fp);
+    return rc;
+}
+
+int source_index(SourceFile *src) {
+    LexResult lex;
+    if (lex_buffer(src->data, src->size, &lex) != 0) {
+        source_free(src);
+        errno = ENOMEM;
+        return -1;
+    }
+    src->lines = lex.lines;
+    src->line_count = lex.line_count;
+    src->line_tokens = lex.line_tokens;
+    src->tokens = lex.tokens;
+    src->token_count = lex.token_count;
+    return 0;
+}
+
+int source_read(SourceFile *src, const char *path) {
+    memset(src, 0, sizeof(SourceFile));
+    return strcmp(path, "-") == 0 ? read_stream(src, stdin) : map_file(src, path);
+}
+
+int source_load(SourceFile *src, const char *path) {
+    if (source_read(src, path) != 0) return -1;
+    return source_index(src);
+}
+
+int source_load_buffer(SourceFile *src, const char *data, size_t size) {
+    memset(src, 0, sizeof(SourceFile));
+    char *copy = malloc(size ? size : 1);
+    if (!copy) { errno = ENOMEM; return -1; }
+    memcpy(copy, data, size);
+    src->data = copy;
+    src->size = size;
+    return source_index(src);
+}
+
+void source_free(SourceFile *src) {
+#ifndef _WIN32
+    if (src->mapped) munmap((void *)src->data, src->size);
+    else
+#endif
+    free((void *)src->data);
+    free(src->lines);
+    free(src->line_tokens);
+    free(src->tokens);
+    memset(src, 0, sizeof(SourceFile));
+}
+
+int source_read_copy(SourceFile *src, const char *path) {
+    memset(src, 0, sizeof(SourceFile));
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return -1;
+    int rc = read_stream(src, fp);
+    fclose(fp);
+    return rc;
+}
+
+// --- Incremental Indexing ---
+
+// The last line of an indexed source that starts at or before `offset`.
+static int line_at(const SourceFile *src, size_t offset) {
+    int lo = 0, hi = src->line_count - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (src->lines[mid] <= offset) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+int source_reindex(SourceFile *src, const SourceFile *prev, SourceEdit *edit) {
+    size_t common = src->size < prev->size ? src->size : prev->size;
+
+    // Leading lines: those that end before the first byte that differs.
+    size_t p = 0;
+    while (p < common && src->data[p] == prev->data[p]) p++;
+    int first = 0;
+    if (prev->line_count > 0) {
+        first = line_at(prev, p);
+        if (p == prev->size && prev->data[p - 1] == '\n') first = prev->line_count;
+    }
+    size_t head = first < prev->line_count ? prev->lines[first] : prev->size;
+
+    // Trailing lines: those that start, after a newline, inside the longest
+    // common tail that does not overlap the leading lines.
+    size_t s = 0, limit = common - head;
+    while (s < limit && src->data[src->size - 1 - s] == prev->data[prev->size - 1 - s]) s++;
+    int old_end = prev->line_count;
+    if (s > 0) {
+        size_t from = prev->size - s, to = src->size - s;
+        old_end = line_at(prev, from);
+        if (prev->lines[old_end] < from || (to > head && src->data[to - 1] != '\n')) old_end++;
+    }
+    size_t tail = old_end < prev->line_count ? src->size - (prev->size - prev->lines[old_end]) : src->size;
+
+    // Lex what lies between; both ends of it are line boundaries.
+    LexResult lex;
+    if (lex_buffer(src->data + head, tail - head, &lex) != 0) {
+        source_free(src);
+        errno = ENOMEM;
+        return -1;
+    }
+    int kept_tail = prev->line_count - old_end;
+    int tok_head = prev->line_tokens[first];
+    int tok_tail = prev->token_count - prev->line_tokens[old_end];
+    int count = first + lex.line_count + kept_tail;
+    int tokens = tok_head + lex.token_count + tok_tail;
+    src->lines = malloc((count ? count : 1) * sizeof(size_t));
+    src->line_tokens = malloc((count + 1) * sizeof(int));
+    src->tokens = malloc((tokens ? tokens : 1) * sizeof(LexToken));
+    if (!src->lines || !src->line_tokens || !src->tokens) {
+        lex_free(&lex);
+        source_free(src);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Token offsets are relative to their line, so kept tokens copy as they
+    // are; only line starts and token indices after the edit shift.
+    memcpy(src->lines, prev->lines, first * sizeof(size_t));
+    memcpy(src->line_tokens, prev->line_tokens, first * sizeof(int));
+    memcpy(src->tokens, prev->tokens, tok_head * sizeof(LexToken));
+    for (int i = 0; i < lex.line_count; i++) {
+        src->lines[first + i] = head + lex.lines[i];
+        src->line_tokens[first + i] = tok_head + lex.line_tokens[i];
+    }
+    memcpy(src->tokens + tok_head, lex.tokens, lex.token_count * sizeof(LexToken));
+    int at = first + lex.line_count, shift = tok_head + lex.token_count - prev->line_tokens[old_end];
+    for (int i = 0; i < kept_tail; i++) {
+        src->lines[at + i] = prev->lines[old_end + i] + src->size - prev->size;
+        src->line_tokens[at + i] = prev->line_tokens[old_end + i] + shift;
+    }
+    memcpy(src->tokens + tok_head + lex.token_count, prev->tokens + prev->line_tokens[old_end], tok_tail * sizeof(LexToken));
+    src->line_tokens[count] = tokens;
+    src->line_count = count;
+    src->token_count = tokens;
+
+    edit->first = first;
+    edit->old_end = old_end;
+    edit->new_end = at;
+    edit->bytes_lexed = tail - head;
+    lex_free(&lex);
+    return 0;
+}
+
+const char *source_line(const SourceFile *src, int i, size_t *len) {
+    size_t start = src->lines[i];
+    size_t end = i + 1 < src->line_count ? src->lines[i + 1] - 1 : src->size;
+    if (end > start && src->data[end - 1] == '\n') end--;
+    if (end > start && src->data[end - 1] == '\r') end--;
+    *len = end - start;
+    return src->data + start;
+}
+
+// --- Tokens ---
+
+int source_tokens(const SourceFile *src, int i, Token *toks, int max) {
+    const char *line = src->data + src->lines[i];
+    int first = src->line_tokens[i];
+    int count = src->line_tokens[i + 1] - first;
+    if (count > max) count = max;
+    for (int t = 0; t < count; t++) {
+        const LexToken *lt = &src->tokens[first + t];
+        toks[t].start = line + lt->offset;
+        toks[t].len = (int)(lt->len & ~LEX_STRING);
+        toks[t].is_string = (lt->len & LEX_STRING) != 0;
+    }
+    return count;
+}
+
+bool token_is(const Token *tok, const char *word) {
+    size_t n = strlen(word);
+    return !tok->is_string && (size_t)tok->len == n && memcmp(tok->start, word, n) == 0;
+}
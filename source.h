@@ -0,0 +1,80 @@
+#ifndef TAKO_SOURCE_H
+#define TAKO_SOURCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lexer.h"
+
+// --- Script Loading ---
+
+// A loaded script. The bytes are mapped (or, for pipes, read) once and never
+// copied per line; a single lexer pass indexes every line and token in them.
+typedef struct {
+    const char *data;
+    size_t size;
+    size_t *lines;      // byte offset where each line starts
+    int line_count;
+    int *line_tokens;   // index of each line's first token, plus an end entry
+    LexToken *tokens;
+    int token_count;
+    bool mapped;        // data came from mmap rather than malloc
+} SourceFile;
+
+// Load a script from a path, or from stdin when the path is "-".
+// Returns 0 on success, or -1 with errno set.
+int source_load(SourceFile *src, const char *path);
+
+// The two halves of source_load: read or map the text, then split it into
+// lines and tokens. A source that is only read has no lines yet.
+int source_read(SourceFile *src, const char *path);
+int source_index(SourceFile *src);
+
+// Load a script from memory. The text is copied, so `data` need not outlive
+// the SourceFile.
+int source_load_buffer(SourceFile *src, const char *data, size_t size);
+
+void source_free(SourceFile *src);
+
+// Read a script from a path into memory, never mapping it, so the text stays
+// as read even if the file is rewritten in place afterwards.
+int source_read_copy(SourceFile *src, const char *path);
+
+// --- Incremental Indexing ---
+
+// Where a new revision of a script differs from the one it replaces: lines
+// [first, old_end) of the old text became lines [first, new_end) of the new.
+typedef struct {
+    int first;
+    int old_end;
+    int new_end;
+    size_t bytes_lexed;
+} SourceEdit;
+
+// Index `src`, read but not yet indexed, as a revision of the indexed `prev`.
+// Only the lines between the longest runs of identical leading and trailing
+// lines are lexed; all others take their tokens from `prev`. Returns 0, or
+// -1 with errno set and `src` freed, as source_index does.
+int source_reindex(SourceFile *src, const SourceFile *prev, SourceEdit *edit);
+
+// Return the start of line `i` and store its length, excluding the line
+// terminator, in `*len`.
+const char *source_line(const SourceFile *src, int i, size_t *len);
+
+// --- Tokens ---
+
+// A word or string literal inside a line. String tokens exclude the quotes.
+typedef struct {
+    const char *start;
+    int len;
+    bool is_string;
+} Token;
+
+// Fetch up to `max` tokens of line `i` and return how many were stored.
+// Comments are already gone; tokens past `max` are ignored.
+int source_tokens(const SourceFile *src, int i, Token *toks, int max);
+
+// Compare a token against a NUL-terminated keyword.
+bool token_is(const Token *tok, const char *word);
+
+#endif
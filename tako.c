@@ -1,282 +1,629 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 #include <stdbool.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// --batch runs scripts on POSIX threads.
+#if !defined(_WIN32)
+#define TAKO_BATCH 1
+#include <pthread.h>
+#include <unistd.h>
+#else
+#define TAKO_BATCH 0
+#endif
+
+// --watch waits for saves with inotify.
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "tako.h"
+
+// Compiled images go to $TAKO_CACHE_DIR, else $XDG_CACHE_HOME/tako, else
+// ~/.cache/tako. NULL when none of these is set.
+static const char *default_cache_dir(char *buf, size_t size) {
+    const char *dir = getenv("TAKO_CACHE_DIR");
+    if (dir && *dir) return dir;
+    if ((dir = getenv("XDG_CACHE_HOME")) && *dir) snprintf(buf, size, "%s/tako", dir);
+    else if ((dir = getenv("HOME")) && *dir) snprintf(buf, size, "%s/.cache/tako", dir);
+    else return NULL;
+    return buf;
+}
 
-// --- Configuration Constants ---
-#define MAX_VARS 100
-#define MAX_VAR_NAME 32
-#define MAX_ARG_LEN 128
-#define MAX_LINES 1000
-#define MAX_LINE_LEN 256
-
-// --- Type Definitions ---
+// --- Job Lists ---
+// Shared by --batch and --tasks.
 
-// Represents a variable in our language
-typedef struct {
-    char name[MAX_VAR_NAME];
-    int value;
-} Variable;
+static double batch_clock(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-// Encapsulates the entire state of the interpreter
-typedef struct {
-    Variable vars[MAX_VARS];
-    int var_count;
-    // We could add more state here later, like function call stacks
-} InterpreterState;
-
-// --- Variable Management ---
-
-// Find a variable and return a pointer to it, or NULL if not found.
-Variable* find_var(InterpreterState *state, const char *name) {
-    for (int i = 0; i < state->var_count; ++i) {
-        if (strcmp(state->vars[i].name, name) == 0) {
-            return &state->vars[i];
-        }
-    }
-    return NULL;
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
 }
 
-// Get the integer value of a variable or a numeric literal.
-// Exits on error if the identifier is not a variable and not a number.
-int resolve_value(InterpreterState *state, const char *name_or_literal) {
-    // Check if it's a number (handles negative numbers)
-    if (isdigit((unsigned char)name_or_literal[0]) || (name_or_literal[0] == '-' && isdigit((unsigned char)name_or_literal[1]))) {
-        return atoi(name_or_literal);
+static bool add_path(char ***paths, int *count, int *cap, const char *dir, const char *name, size_t len) {
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        char **grown = realloc(*paths, *cap * sizeof(char *));
+        if (!grown) return false;
+        *paths = grown;
     }
-    
-    // If not a number, it must be a variable
-    Variable *var = find_var(state, name_or_literal);
-    if (var) {
-        return var->value;
+    size_t dir_len = dir ? strlen(dir) : 0;
+    char *path = malloc(dir_len + len + 2);
+    if (!path) return false;
+    if (dir_len) {
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
     }
-
-    // Error: Undeclared variable
-    fprintf(stderr, "Runtime Error: Unknown variable or invalid number '%s'\n", name_or_literal);
-    exit(1);
+    memcpy(path + dir_len + (dir_len > 0), name, len);
+    path[dir_len + (dir_len > 0) + len] = '\0';
+    (*paths)[(*count)++] = path;
+    return true;
 }
 
-// Set a variable's value. Creates it if it doesn't exist.
-void set_var(InterpreterState *state, const char *name, int value) {
-    Variable *var = find_var(state, name);
-    if (var) {
-        // Variable exists, update it
-        var->value = value;
-    } else {
-        // Variable is new, create it
-        if (state->var_count >= MAX_VARS) {
-            fprintf(stderr, "Runtime Error: Maximum number of variables (%d) reached.\n", MAX_VARS);
-            exit(1);
+// The scripts to run: every *.tako file in a directory, sorted by name, or
+// the paths listed one per line in a manifest ('#' starts a comment). Paths
+// in a manifest are relative to the manifest's directory.
+static int list_jobs(const char *source, char ***paths) {
+    int count = 0, cap = 0;
+    *paths = NULL;
+    struct stat st;
+    if (stat(source, &st) != 0) return -1;
+    if (S_ISDIR(st.st_mode)) {
+        DIR *d = opendir(source);
+        if (!d) return -1;
+        for (struct dirent *e; (e = readdir(d));) {
+            size_t len = strlen(e->d_name);
+            if (len < 6 || strcmp(e->d_name + len - 5, ".tako") != 0) continue;
+            if (!add_path(paths, &count, &cap, source, e->d_name, len)) { closedir(d); return -1; }
         }
-        strncpy(state->vars[state->var_count].name, name, MAX_VAR_NAME - 1);
-        state->vars[state->var_count].name[MAX_VAR_NAME - 1] = '\0'; // Ensure null-termination
-        state->vars[state->var_count].value = value;
-        state->var_count++;
+        closedir(d);
+        if (count > 1) qsort(*paths, count, sizeof(char *), compare_paths);
+        return count;
     }
+
+    FILE *fp = fopen(source, "r");
+    if (!fp) return -1;
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s", source);
+    char *slash = strrchr(dir, '/');
+    if (slash) *slash = '\0';
+    char line[4096];
+    while (fgets(line, sizeof(line), fp)) {
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char *start = line;
+        while (*start == ' ' || *start == '\t') start++;
+        size_t len = strlen(start);
+        while (len > 0 && (start[len - 1] == '\n' || start[len - 1] == '\r' || start[len - 1] == ' ' || start[len - 1] == '\t')) len--;
+        if (len == 0) continue;
+        if (!add_path(paths, &count, &cap, *start == '/' || !slash ? NULL : dir, start, len)) { fclose(fp); return -1; }
+    }
+    fclose(fp);
+    return count;
 }
 
-// --- String and Parsing Helpers ---
+// --- Batch Mode ---
+// --batch runs many scripts in one process. Each worker thread has a queue
+// of jobs, takes them from the front in order, and when it runs dry steals
+// from the back of another worker's queue. A job's output is captured in its
+// own buffers and written once every earlier job has been written, so the
+// combined output does not depend on scheduling.
 
-// Trim leading and trailing whitespace from a string, in-place.
-char* trim_whitespace(char *str) {
-    // Trim leading space
-    while (isspace((unsigned char)*str)) str++;
+#if TAKO_BATCH
+typedef struct {
+    char *bytes;
+    size_t len, cap;
+} Buffer;
+
+typedef struct {
+    char *path;
+    Buffer out, err;    // captured stdout and stderr of the script
+    TakoStatus status;
+    double seconds;     // compile and run
+    bool done;
+} BatchJob;
 
-    if (*str == 0) // All spaces?
-        return str;
+typedef struct {
+    pthread_mutex_t lock;
+    int *jobs;          // job indices; the owner takes from head, thieves from tail
+    int head, tail;
+} WorkQueue;
 
-    // Trim trailing space
-    char *end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) end--;
-    
-    // Write new null terminator
-    *(end + 1) = 0;
+typedef struct {
+    BatchJob *jobs;
+    int job_count;
+    WorkQueue *queues;
+    int worker_count;
+    int opt_level;
+    bool jit;
+    const char *cache_dir;
+    pthread_mutex_t emit_lock;
+    int next_emit;      // first job whose output has not been written
+} Batch;
 
-    return str;
+typedef struct {
+    Batch *batch;
+    int id;
+} Worker;
+
+static void buffer_append(Buffer *b, const char *bytes, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        while (cap < b->len + len) cap *= 2;
+        char *grown = realloc(b->bytes, cap);
+        if (!grown) return; // the job's output is cut short rather than lost entirely
+        b->bytes = grown;
+        b->cap = cap;
+    }
+    memcpy(b->bytes + b->len, bytes, len);
+    b->len += len;
 }
 
-// --- Core Execution Logic ---
-
-void run_script(InterpreterState *state, char lines[][MAX_LINE_LEN], int line_count, int start_line, int end_line);
-
-// Helper to find the matching 'end' for a block statement ('if', 'loop')
-int find_matching_end(char lines[][MAX_LINE_LEN], int line_count, int start_line) {
-    int depth = 1;
-    for (int i = start_line; i < line_count; i++) {
-        char *line = trim_whitespace(lines[i]);
-        if (strncmp(line, "if ", 3) == 0 || strncmp(line, "loop ", 5) == 0) {
-            depth++;
-        } else if (strcmp(line, "end") == 0) {
-            depth--;
-            if (depth == 0) {
-                return i;
-            }
+static void capture_sink(void *ctx, TakoStream stream, const char *bytes, size_t len) {
+    BatchJob *job = ctx;
+    buffer_append(stream == TAKO_STDOUT ? &job->out : &job->err, bytes, len);
+}
+
+// Next job for worker `id`: its own queue first, then one stolen from the
+// back of the others. -1 once every queue is empty.
+static int next_job(Batch *batch, int id) {
+    for (int i = 0; i < batch->worker_count; i++) {
+        WorkQueue *q = &batch->queues[(id + i) % batch->worker_count];
+        int job = -1;
+        pthread_mutex_lock(&q->lock);
+        if (q->head < q->tail) job = i == 0 ? q->jobs[q->head++] : q->jobs[--q->tail];
+        pthread_mutex_unlock(&q->lock);
+        if (job >= 0) return job;
+    }
+    return -1;
+}
+
+// Mark a job finished and write out every finished job that is next in line.
+static void finish_job(Batch *batch, BatchJob *job) {
+    pthread_mutex_lock(&batch->emit_lock);
+    job->done = true;
+    while (batch->next_emit < batch->job_count && batch->jobs[batch->next_emit].done) {
+        BatchJob *j = &batch->jobs[batch->next_emit++];
+        printf("==> %s <==\n", j->path);
+        fwrite(j->out.bytes, 1, j->out.len, stdout);
+        if (j->err.len > 0) {
+            fflush(stdout);
+            fwrite(j->err.bytes, 1, j->err.len, stderr);
         }
+        free(j->out.bytes);
+        free(j->err.bytes);
+        j->out = j->err = (Buffer){0};
     }
-    return -1; // No matching 'end' found
+    pthread_mutex_unlock(&batch->emit_lock);
 }
 
-// Executes a single, simple command (not control flow)
-void execute_line(InterpreterState *state, char *line) {
-    char command[MAX_ARG_LEN];
-    char arg1[MAX_ARG_LEN], arg2[MAX_ARG_LEN];
-
-    // --- PARSE PRINT ---
-    // print "message" var
-    if (sscanf(line, "print \"%[^\"]\" %s", arg1, arg2) == 2) {
-        int val = resolve_value(state, arg2);
-        printf("%s %d\n", arg1, val);
-        return;
+static void *batch_worker(void *arg) {
+    Worker *w = arg;
+    Batch *batch = w->batch;
+    // One state per worker: every run starts with fresh variables, so a
+    // state can be reused for job after job.
+    TakoState *state = tako_state_new();
+    for (int i; (i = next_job(batch, w->id)) >= 0;) {
+        BatchJob *job = &batch->jobs[i];
+        double start = batch_clock();
+        TakoError err;
+        TakoScript *script;
+        if (!state) {
+            job->status = TAKO_ERR_NOMEM;
+            snprintf(err.message, sizeof(err.message), "Error: Out of memory");
+        } else if ((job->status = tako_compile_cached(job->path, batch->opt_level, batch->cache_dir, &script, &err)) == TAKO_OK) {
+            tako_state_set_jit(state, batch->jit);
+            tako_state_set_threads(state, 1); // the batch already keeps every CPU busy
+            tako_state_set_sink(state, capture_sink, job);
+            job->status = tako_run(script, state, &err);
+            tako_script_free(script);
+        }
+        if (job->status != TAKO_OK) {
+            buffer_append(&job->err, err.message, strlen(err.message));
+            buffer_append(&job->err, "\n", 1);
+        }
+        job->seconds = batch_clock() - start;
+        finish_job(batch, job);
     }
-    // print "message"
-    if (sscanf(line, "print \"%[^\"]\"", arg1) == 1) {
-        printf("%s\n", arg1);
-        return;
+    tako_state_free(state);
+    return NULL;
+}
+
+static int run_batch(const char *source, int workers, int opt_level, bool jit, const char *cache_dir) {
+    char **paths;
+    int count = list_jobs(source, &paths);
+    if (count < 0) {
+        perror(source);
+        return 1;
     }
-    // print var_or_number
-    if (sscanf(line, "print %s", arg1) == 1) {
-        printf("%d\n", resolve_value(state, arg1));
-        return;
+    if (workers <= 0) workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0) workers = 1;
+    if (workers > count) workers = count > 0 ? count : 1;
+
+    double start = batch_clock();
+    Batch batch = { .job_count = count, .worker_count = workers, .opt_level = opt_level, .jit = jit, .cache_dir = cache_dir };
+    batch.jobs = calloc(count ? count : 1, sizeof(BatchJob));
+    batch.queues = calloc(workers, sizeof(WorkQueue));
+    int *order = malloc((count ? count : 1) * sizeof(int));
+    Worker *ws = malloc(workers * sizeof(Worker));
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    if (!batch.jobs || !batch.queues || !order || !ws || !threads) {
+        perror("malloc");
+        return 1;
     }
+    pthread_mutex_init(&batch.emit_lock, NULL);
 
-    // --- PARSE SET ---
-    // set var = value
-    if (sscanf(line, "set %s = %s", arg1, arg2) == 2) {
-        int val = resolve_value(state, arg2);
-        set_var(state, arg1, val);
-        return;
+    // Worker w starts with the w-th contiguous slice, so each one works
+    // forwards through the order output is written in.
+    for (int i = 0; i < count; i++) {
+        batch.jobs[i].path = paths[i];
+        order[i] = i;
     }
-
-    // --- PARSE ADD ---
-    // add var value
-    if (sscanf(line, "add %s %s", arg1, arg2) == 2) {
-        int current_val = resolve_value(state, arg1);
-        int amount = resolve_value(state, arg2);
-        set_var(state, arg1, current_val + amount);
-        return;
+    for (int w = 0; w < workers; w++) {
+        WorkQueue *q = &batch.queues[w];
+        pthread_mutex_init(&q->lock, NULL);
+        q->jobs = order;
+        q->head = (int)((long long)count * w / workers);
+        q->tail = (int)((long long)count * (w + 1) / workers);
     }
 
-    // --- PARSE SUBTRACT (Example of how easy it is to add a command) ---
-    // sub var value
-    if (sscanf(line, "sub %s %s", arg1, arg2) == 2) {
-        int current_val = resolve_value(state, arg1);
-        int amount = resolve_value(state, arg2);
-        set_var(state, arg1, current_val - amount);
-        return;
+    int started = 0;
+    for (int w = 0; w < workers; w++) {
+        ws[w] = (Worker){ &batch, w };
+        if (w > 0 && pthread_create(&threads[w], NULL, batch_worker, &ws[w]) != 0) break;
+        started = w + 1;
     }
-
-    fprintf(stderr, "Syntax Error: Unknown command on line: '%s'\n", line);
+    batch_worker(&ws[0]); // the main thread is worker 0; its queue drains any a missing thread would have had
+    for (int w = 1; w < started; w++) pthread_join(threads[w], NULL);
+    fflush(stdout);
+
+    // Summary: one line per script, in order, then the totals.
+    int failed = 0;
+    double busy = 0;
+    fprintf(stderr, "\n--- batch summary ---\n");
+    fprintf(stderr, "%-14s %10s  %s\n", "status", "time (ms)", "script");
+    for (int i = 0; i < count; i++) {
+        BatchJob *job = &batch.jobs[i];
+        failed += job->status != TAKO_OK;
+        busy += job->seconds;
+        fprintf(stderr, "%-14s %10.3f  %s\n", tako_status_name(job->status), job->seconds * 1e3, job->path);
+        free(job->path);
+    }
+    fprintf(stderr, "%d scripts, %d failed, -j %d: %.3f ms wall, %.3f ms in scripts\n",
+            count, failed, workers, (batch_clock() - start) * 1e3, busy * 1e3);
+
+    for (int w = 0; w < workers; w++) pthread_mutex_destroy(&batch.queues[w].lock);
+    pthread_mutex_destroy(&batch.emit_lock);
+    free(threads);
+    free(ws);
+    free(order);
+    free(batch.queues);
+    free(batch.jobs);
+    free(paths);
+    return failed ? 1 : 0;
+}
+#else
+static int run_batch(const char *source, int workers, int opt_level, bool jit, const char *cache_dir) {
+    (void)workers, (void)opt_level, (void)jit, (void)cache_dir;
+    fprintf(stderr, "%s: --batch needs POSIX threads, which this platform lacks\n", source);
+    return 1;
 }
+#endif
 
-// Main recursive function to execute a script or a block of it
-void run_script(InterpreterState *state, char lines[][MAX_LINE_LEN], int line_count, int start_line, int end_line) {
-    for (int i = start_line; i < end_line; i++) {
-        char line_buffer[MAX_LINE_LEN];
-        strncpy(line_buffer, lines[i], MAX_LINE_LEN - 1);
-        line_buffer[MAX_LINE_LEN-1] = '\0';
+// --- Task Mode ---
+// --tasks runs many scripts as cooperative tasks on the main thread, round
+// robin: each gets a slice of at most --budget instructions, and gives up the
+// rest of it at 'yield' or 'sleep'. A sleeping task is passed over until it
+// is due, and when every task is asleep the process sleeps until the first
+// one wakes. Output goes to stdout as each slice ends, so tasks interleave.
 
-        char *clean_line = trim_whitespace(line_buffer);
+typedef struct {
+    char *path;
+    TakoScript *script;
+    TakoState *state;
+    TakoStatus status;
+    bool done;
+    double ready;           // when it may run next: the end of its last slice, or of its sleep
+    double wait_max, wait_total;    // time spent ready but not running
+    int slices;
+    uint64_t dispatched;
+    size_t memory;          // most bytes its state held
+} Task;
+
+static void sleep_until(double when) {
+    double left = when - batch_clock();
+    if (left > 0) tako_sleep_ms((int)(left * 1e3 + 0.999));
+}
 
-        // Skip empty or comment lines
-        if (*clean_line == '\0' || *clean_line == '#') {
-            continue;
-        }
+static void end_task(Task *t, const TakoError *err) {
+    t->done = true;
+    if (t->status != TAKO_OK) {
+        fflush(stdout);
+        fprintf(stderr, "%s: %s\n", t->path, err->message);
+    }
+    tako_state_free(t->state);
+    tako_script_free(t->script);
+    t->state = NULL;
+    t->script = NULL;
+}
 
-        // --- Handle Control Flow: LOOP ---
-        if (strncmp(clean_line, "loop ", 5) == 0) {
-            int loop_count = resolve_value(state, clean_line + 5);
-            int block_start = i + 1;
-            int block_end = find_matching_end(lines, line_count, block_start);
+static int run_tasks(const char *source, uint64_t budget, int opt_level, bool jit, const char *cache_dir) {
+    char **paths;
+    int count = list_jobs(source, &paths);
+    if (count < 0) {
+        perror(source);
+        return 1;
+    }
+    Task *tasks = calloc(count ? count : 1, sizeof(Task));
+    if (!tasks) {
+        perror("calloc");
+        return 1;
+    }
 
-            if (block_end == -1) {
-                fprintf(stderr, "Syntax Error: 'loop' on line %d has no matching 'end'.\n", i + 1);
-                exit(1);
-            }
-            
-            for (int j = 0; j < loop_count; j++) {
-                run_script(state, lines, line_count, block_start, block_end);
+    double start = batch_clock();
+    int live = 0;
+    for (int i = 0; i < count; i++) {
+        Task *t = &tasks[i];
+        TakoError err;
+        t->path = paths[i];
+        if ((t->status = tako_compile_cached(t->path, opt_level, cache_dir, &t->script, &err)) == TAKO_OK) {
+            if ((t->state = tako_state_new())) {
+                tako_state_set_jit(t->state, jit);
+                t->status = tako_task_start(t->script, t->state, &err);
+            } else {
+                t->status = TAKO_ERR_NOMEM;
+                snprintf(err.message, sizeof(err.message), "Error: Out of memory");
             }
-            i = block_end; // Skip interpreter past the handled block
-            continue;
         }
+        if (t->status != TAKO_OK) end_task(t, &err);
+        else live++;
+        t->ready = batch_clock();
+    }
 
-        // --- Handle Control Flow: IF ---
-        if (strncmp(clean_line, "if ", 3) == 0) {
-            char var_name[MAX_ARG_LEN], op[3], val_str[MAX_ARG_LEN];
-            if (sscanf(clean_line, "if %s %2s %s", var_name, op, val_str) != 3) {
-                 fprintf(stderr, "Syntax Error: Malformed 'if' statement on line %d.\n", i + 1);
-                 exit(1);
-            }
-
-            int left_val = resolve_value(state, var_name);
-            int right_val = resolve_value(state, val_str);
-            bool condition = false;
-
-            if (strcmp(op, "==") == 0) condition = (left_val == right_val);
-            else if (strcmp(op, "!=") == 0) condition = (left_val != right_val);
-            else if (strcmp(op, ">") == 0) condition = (left_val > right_val);
-            else if (strcmp(op, "<") == 0) condition = (left_val < right_val);
-            else if (strcmp(op, ">=") == 0) condition = (left_val >= right_val);
-            else if (strcmp(op, "<=") == 0) condition = (left_val <= right_val);
-            else {
-                fprintf(stderr, "Syntax Error: Unknown operator '%s' in 'if' on line %d.\n", op, i + 1);
-                exit(1);
-            }
-
-            int block_start = i + 1;
-            int block_end = find_matching_end(lines, line_count, block_start);
-            
-            if (block_end == -1) {
-                fprintf(stderr, "Syntax Error: 'if' on line %d has no matching 'end'.\n", i + 1);
-                exit(1);
+    while (live > 0) {
+        double wake = 0;    // earliest end of a sleep, if nothing ran
+        bool ran = false;
+        for (int i = 0; i < count; i++) {
+            Task *t = &tasks[i];
+            if (t->done) continue;
+            double now = batch_clock();
+            if (t->ready > now) {
+                if (wake == 0 || t->ready < wake) wake = t->ready;
+                continue;
             }
-
-            if (condition) {
-                run_script(state, lines, line_count, block_start, block_end);
+            double wait = now - t->ready;
+            if (wait > t->wait_max) t->wait_max = wait;
+            t->wait_total += wait;
+
+            TakoSlice slice;
+            TakoError err;
+            t->status = tako_task_step(t->script, t->state, budget, &slice, &err);
+            t->slices++;
+            t->dispatched += slice.dispatched;
+            size_t memory = tako_state_memory(t->state);
+            if (memory > t->memory) t->memory = memory;
+            t->ready = batch_clock() + slice.sleep_ms / 1e3;
+            ran = true;
+            if (slice.done) {
+                end_task(t, &err);
+                live--;
             }
-            i = block_end; // Skip interpreter past the handled block
-            continue;
         }
+        if (!ran && live > 0) sleep_until(wake);
+    }
+    fflush(stdout);
+
+    // Summary: one line per task, in order, then the totals.
+    int failed = 0;
+    double wait_max = 0;
+    uint64_t dispatched = 0;
+    fprintf(stderr, "\n--- task summary ---\n");
+    fprintf(stderr, "%-14s %8s %14s %14s %12s  %s\n", "status", "slices", "max wait (ms)", "avg wait (ms)", "memory (B)", "script");
+    for (int i = 0; i < count; i++) {
+        Task *t = &tasks[i];
+        failed += t->status != TAKO_OK;
+        dispatched += t->dispatched;
+        if (t->wait_max > wait_max) wait_max = t->wait_max;
+        fprintf(stderr, "%-14s %8d %14.3f %14.3f %12zu  %s\n", tako_status_name(t->status), t->slices, t->wait_max * 1e3,
+                t->slices ? t->wait_total / t->slices * 1e3 : 0.0, t->memory, t->path);
+        free(t->path);
+    }
+    fprintf(stderr, "%d tasks, %d failed, budget %llu: %.3f ms wall, %llu instructions, %.3f ms longest wait\n",
+            count, failed, (unsigned long long)budget, (batch_clock() - start) * 1e3, (unsigned long long)dispatched, wait_max * 1e3);
+    free(tasks);
+    free(paths);
+    return failed ? 1 : 0;
+}
 
-        // If it's not a control flow keyword, execute it as a simple command
-        execute_line(state, clean_line);
+// --- Watch Mode ---
+// --watch runs a script, then runs it again every time the file is saved.
+// Each revision is compiled with tako_compile_edit against the last one that
+// compiled, and a line on stderr says how much of it had to be redone. The
+// directory is watched rather than the file, so editors that save by
+// renaming a new file over the old one are seen as well.
+
+#ifdef __linux__
+// Block until `name` in the watched directory is written or replaced, then
+// let the rest of that save's events settle. Returns false if inotify fails.
+static bool wait_for_save(int fd, const char *name) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool saved = false;
+    while (!saved) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) return false;
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->len > 0 && strcmp(ev->name, name) == 0) saved = true;
+        }
     }
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    while (poll(&pfd, 1, 20) > 0 && read(fd, buf, sizeof(buf)) > 0) {}
+    return true;
 }
 
+static int run_watch(const char *path, int opt_level, bool jit, int workers) {
+    char dir[4096];
+    const char *name = strrchr(path, '/');
+    if (name) snprintf(dir, sizeof(dir), "%.*s", name == path ? 1 : (int)(name - path), path);
+    else snprintf(dir, sizeof(dir), ".");
+    name = name ? name + 1 : path;
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror(dir);
+        return 1;
+    }
+    TakoState *state = tako_state_new();
+    if (!state) {
+        perror("tako_state_new");
+        return 1;
+    }
+    tako_state_set_jit(state, jit);
+    tako_state_set_threads(state, workers);
+
+    TakoScript *script = NULL;  // the last revision that compiled
+    do {
+        TakoScript *next;
+        TakoReuse reuse;
+        TakoError err;
+        if (tako_compile_edit(script, path, opt_level, &next, &reuse, &err) != TAKO_OK) {
+            fprintf(stderr, "%s\n", err.message);
+            continue;
+        }
+        tako_script_free(script);
+        script = next;
+        if (tako_run(script, state, &err) != TAKO_OK) {
+            fflush(stdout);
+            fprintf(stderr, "%s\n", err.message);
+        }
+        fflush(stdout);
+        TakoStats st;
+        tako_stats(script, state, &st);
+        fprintf(stderr, "--- %s: lexed %d of %d lines (%zu bytes), matched %d, reused %d of %d slots; compiled in %.3f ms, ran in %.3f ms\n",
+                path, reuse.lines_lexed, reuse.lines, reuse.bytes_lexed, reuse.lines_matched, reuse.symbols_reused, reuse.symbols,
+                st.compile_seconds * 1e3, st.run_seconds * 1e3);
+    } while (wait_for_save(fd, name));
+
+    perror("inotify");
+    tako_state_free(state);
+    tako_script_free(script);
+    close(fd);
+    return 1;
+}
+#else
+static int run_watch(const char *path, int opt_level, bool jit, int workers) {
+    (void)opt_level, (void)jit, (void)workers;
+    fprintf(stderr, "%s: --watch needs inotify, which this platform lacks\n", path);
+    return 1;
+}
+#endif
 
 // --- Main Program ---
+// The tako command: compile one script with libtako and run it once.
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <script_file.tako>\n", argv[0]);
+    // Options come before the script path ('-' alone is standard input).
+    bool jit = true, profile = false, stats = false, cache = true, watch = false;
+    const char *folded_path = NULL, *cache_dir = NULL, *batch = NULL, *tasks = NULL;
+    int opt_level = TAKO_OPT_DEFAULT, workers = 0;
+    unsigned long long budget = 10000;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0'; arg++) {
+        if (strcmp(argv[arg], "--no-jit") == 0) jit = false;
+        else if (argv[arg][1] == 'O' && argv[arg][2] >= '0' && argv[arg][2] <= '2' && argv[arg][3] == '\0') opt_level = argv[arg][2] - '0';
+        else if (strcmp(argv[arg], "--profile") == 0) profile = true;
+        else if (strncmp(argv[arg], "--profile=", 10) == 0) { profile = true; folded_path = argv[arg] + 10; }
+        else if (strcmp(argv[arg], "--stats") == 0) stats = true;
+        else if (strcmp(argv[arg], "--watch") == 0) watch = true;
+        else if (strcmp(argv[arg], "--no-cache") == 0) cache = false;
+        else if (strncmp(argv[arg], "--cache-dir=", 12) == 0) cache_dir = argv[arg] + 12;
+        else if (strcmp(argv[arg], "--batch") == 0 && arg + 1 < argc) batch = argv[++arg];
+        else if (strcmp(argv[arg], "--tasks") == 0 && arg + 1 < argc) tasks = argv[++arg];
+        else if (strcmp(argv[arg], "--budget") == 0 && arg + 1 < argc) budget = strtoull(argv[++arg], NULL, 10);
+        else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc) workers = atoi(argv[++arg]);
+        else if (strncmp(argv[arg], "-j", 2) == 0 && argv[arg][2] >= '0' && argv[arg][2] <= '9') workers = atoi(argv[arg] + 2);
+        else {
+            fprintf(stderr, "Unknown option '%s'\n", argv[arg]);
+            return 1;
+        }
+    }
+    if (arg >= argc && !batch && !tasks) {
+        fprintf(stderr, "Usage: %s [--no-jit] [-O0|-O1|-O2] [--profile[=FILE]] [--stats] [--no-cache] [--cache-dir=DIR] [-j N] <script_file.tako | ->\n", argv[0]);
+        fprintf(stderr, "       %s [--no-jit] [-O0|-O1|-O2] [--no-cache] [--cache-dir=DIR] --batch <dir | manifest> [-j N]\n", argv[0]);
+        fprintf(stderr, "       %s [--no-jit] [-O0|-O1|-O2] [--no-cache] [--cache-dir=DIR] --tasks <dir | manifest> [--budget N]\n", argv[0]);
+        fprintf(stderr, "       %s [--no-jit] [-O0|-O1|-O2] [-j N] --watch <script_file.tako>\n", argv[0]);
         return 1;
     }
 
-    FILE *fp = fopen(argv[1], "r");
-    if (!fp) {
-        perror("Error opening file");
+    // Compile once (or load the cached image), then run the script! The
+    // profile report wants the source text, so --profile skips the cache.
+    char dir_buf[4096];
+    if (!cache_dir) cache_dir = default_cache_dir(dir_buf, sizeof(dir_buf));
+    if (!cache || profile) cache_dir = NULL;
+    if (batch) {
+        if (profile || stats || tasks || watch || arg < argc) {
+            fprintf(stderr, "--batch takes no script and cannot be combined with --tasks, --watch, --profile or --stats\n");
+            return 1;
+        }
+        return run_batch(batch, workers, opt_level, jit, cache_dir);
+    }
+    if (tasks) {
+        if (profile || stats || watch || arg < argc) {
+            fprintf(stderr, "--tasks takes no script and cannot be combined with --watch, --profile or --stats\n");
+            return 1;
+        }
+        return run_tasks(tasks, budget, opt_level, jit, cache_dir);
+    }
+    if (watch) {
+        if (profile || stats || strcmp(argv[arg], "-") == 0) {
+            fprintf(stderr, "--watch needs a script file and cannot be combined with --profile or --stats\n");
+            return 1;
+        }
+        return run_watch(argv[arg], opt_level, jit, workers);
+    }
+    TakoError err;
+    TakoScript *script;
+    if (tako_compile_cached(argv[arg], opt_level, cache_dir, &script, &err) != TAKO_OK) {
+        fprintf(stderr, "%s\n", err.message);
         return 1;
     }
 
-    char lines[MAX_LINES][MAX_LINE_LEN];
-    int line_count = 0;
-    while (line_count < MAX_LINES && fgets(lines[line_count], MAX_LINE_LEN, fp)) {
-        // Remove newline characters
-        lines[line_count][strcspn(lines[line_count], "\r\n")] = 0;
-        line_count++;
+    TakoState *state = tako_state_new();
+    if (!state) {
+        perror("tako_state_new");
+        tako_script_free(script);
+        return 1;
     }
-    fclose(fp);
-    
-    if (line_count >= MAX_LINES) {
-        fprintf(stderr, "Warning: Reached maximum line limit of %d. File may be truncated.\n", MAX_LINES);
+    tako_state_set_jit(state, jit);
+    tako_state_set_threads(state, workers); // for ploop
+    if (profile) tako_state_set_profile(state, TAKO_PROFILE_LINES);
+    else if (stats) tako_state_set_profile(state, TAKO_PROFILE_STATS);
+
+    TakoStatus status = tako_run(script, state, &err);
+    fflush(stdout);
+    if (status != TAKO_OK) {
+        fprintf(stderr, "%s\n", err.message);
+    } else {
+        if (profile && tako_profile_report(script, state, stderr, folded_path) != 0) perror(folded_path ? folded_path : "profile");
+        if (stats) {
+            TakoStats st;
+            tako_stats(script, state, &st);
+            fprintf(stderr, "\n--- stats ---\n");
+            fprintf(stderr, "parse:       %10.3f ms  (%d lines, %d instructions%s)\n", st.compile_seconds * 1e3, st.line_count,
+                    st.instruction_count, st.cached ? ", from cache" : "");
+            fprintf(stderr, "execution:   %10.3f ms\n", st.run_seconds * 1e3);
+            fprintf(stderr, "dispatches:  %10llu     (%d loops compiled to native code)\n", (unsigned long long)st.dispatches, st.jit_loops);
+            fprintf(stderr, "variables:   %10d     (%d slots with literals)\n", st.variable_count, st.literal_count);
+        }
     }
 
-    // Initialize the interpreter state
-    InterpreterState state;
-    memset(&state, 0, sizeof(InterpreterState));
-
-    // Run the script!
-    run_script(&state, lines, line_count, 0, line_count);
-
-    return 0;
+    tako_state_free(state);
+    tako_script_free(script);
+    return status == TAKO_OK ? 0 : 1;
 }
@@ -0,0 +1,163 @@
+#ifndef TAKO_H
+#define TAKO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// --- libtako ---
+// The interpreter as a library. A script is compiled once into a TakoScript,
+// which is immutable and may be shared by any number of threads. Each run
+// executes a script against a TakoState, which holds the variables, output
+// sink and options of one line of execution. Independent states may run at
+// the same time on different threads; one state must not be used by two
+// threads at once.
+//
+// Nothing here exits the process or writes to stdout on its own: failures
+// come back as a TakoStatus with the message in a TakoError, and output goes
+// to the state's sink. Running out of memory, while compiling as anywhere
+// else, is reported as TAKO_ERR_NOMEM.
+
+typedef enum {
+    TAKO_OK = 0,
+    TAKO_ERR_IO,        // the script could not be read
+    TAKO_ERR_SYNTAX,    // the script could not be compiled
+    TAKO_ERR_RUNTIME,   // the run stopped on an error (an unassigned variable)
+    TAKO_ERR_NOMEM      // compiling or running could not allocate memory
+} TakoStatus;
+
+// Details of a failure. `message` is what the tako command prints, one line
+// per problem; `line` is the first 1-based source line involved, or 0.
+typedef struct {
+    TakoStatus status;
+    int line;
+    char message[512];
+} TakoError;
+
+typedef struct TakoScript TakoScript;
+typedef struct TakoState TakoState;
+
+const char *tako_status_name(TakoStatus status);
+
+// --- Compiling ---
+// `opt_level` is 0, 1 or 2 as with -O; TAKO_OPT_DEFAULT picks the usual.
+// On failure *out is NULL and `err`, if given, says why.
+#define TAKO_OPT_DEFAULT (-1)
+
+TakoStatus tako_compile_file(const char *path, int opt_level, TakoScript **out, TakoError *err);
+TakoStatus tako_compile_string(const char *text, size_t len, int opt_level, TakoScript **out, TakoError *err);
+void tako_script_free(TakoScript *script);
+
+// tako_compile_file through a cache of compiled images in `cache_dir`, keyed
+// by a hash of the source text and the optimization level. A matching image
+// is mapped and run as it is, without lexing or parsing; otherwise the script
+// is compiled and its image written for next time. Stale, foreign or damaged
+// images are ignored and replaced, and failing to write one is not an error.
+// Scripts from the cache keep no source, so profile reports show no line text.
+TakoStatus tako_compile_cached(const char *path, int opt_level, const char *cache_dir, TakoScript **out, TakoError *err);
+
+// --- Reloading ---
+// tako_compile_edit compiles the file at `path` as a new revision of `prev`,
+// the script compiled from its last text, and redoes only the front-end work
+// the edit touched: lines outside the changed region keep their tokens,
+// blocks outside the innermost one around the edit keep their matching 'end',
+// and every variable keeps its slot (slots of variables the edit removed
+// stay allocated; literals are given slots afresh). Checks, optimization
+// and code generation still cover the whole script. `prev` may be NULL, is
+// only read, and is best a script from tako_compile_edit; a cached script is
+// compiled from scratch. The text is read into memory, so the file may be
+// rewritten in place afterwards.
+typedef struct {
+    int lines;              // lines in the new text
+    int lines_lexed;        // lines lexed again
+    size_t bytes_lexed;
+    int lines_matched;      // lines scanned again for blocks
+    int symbols;            // variable and literal slots
+    int symbols_reused;     // slots of `prev` the new text names again
+} TakoReuse;
+
+TakoStatus tako_compile_edit(const TakoScript *prev, const char *path, int opt_level, TakoScript **out, TakoReuse *reuse, TakoError *err);
+
+// --- Running ---
+// Output from print, and diagnostics such as unknown commands, go to the
+// sink. The default sink writes to stdout and stderr. Output is buffered in
+// the state and handed over in blocks, and always before a run returns.
+typedef enum { TAKO_STDOUT, TAKO_STDERR } TakoStream;
+typedef void (*TakoSink)(void *ctx, TakoStream stream, const char *bytes, size_t len);
+
+TakoState *tako_state_new(void);
+void tako_state_free(TakoState *state);
+void tako_state_set_sink(TakoState *state, TakoSink sink, void *ctx);
+
+// Compile hot loops to native code where supported (on by default).
+void tako_state_set_jit(TakoState *state, bool jit);
+
+// The most threads one 'ploop' may run its passes on; 0 (the default) means
+// one per CPU, and 1 runs every ploop sequentially. The extra threads exist
+// only while the loop runs.
+void tako_state_set_threads(TakoState *state, int threads);
+
+// Run a script from the top. Every run starts with no variables assigned;
+// the state keeps its buffers, and natively compiled loops while it keeps
+// running the same script.
+TakoStatus tako_run(const TakoScript *script, TakoState *state, TakoError *err);
+
+// --- Tasks ---
+// One thread can interleave many scripts by running each as a task, a slice
+// at a time. tako_task_start sets a state up to run a script from the top, as
+// tako_run would; each tako_task_step then runs it until it ends, fails,
+// reaches 'yield' or 'sleep', or has dispatched `budget` instructions (0 for
+// no limit). Between slices the task's place, loop counters and variables
+// stay in the state, so a task needs no thread or stack of its own. Loops
+// compiled to native code run in shares that fit the budget, and a 'ploop'
+// runs on the calling thread. Output reaches the sink by the end of every
+// slice. The script must outlive the task; tako_run on the state abandons it.
+//
+// Outside a task, 'yield' does nothing and 'sleep' blocks the thread.
+typedef struct {
+    bool done;            // the task ended or failed; the status says which
+    int sleep_ms;         // 'sleep' asked for this long before the next slice
+    uint64_t dispatched;  // instructions in this slice, as charged to the budget
+} TakoSlice;
+
+TakoStatus tako_task_start(const TakoScript *script, TakoState *state, TakoError *err);
+TakoStatus tako_task_step(const TakoScript *script, TakoState *state, uint64_t budget, TakoSlice *slice, TakoError *err);
+
+// Block the calling thread for `ms` milliseconds, as 'sleep' does outside a
+// task, carrying on through signals. A scheduler can wait with it until its
+// next task is due. Does nothing on platforms without nanosleep.
+void tako_sleep_ms(int ms);
+
+// Bytes the state holds: variables, control stack, output buffer and
+// compiled loops.
+size_t tako_state_memory(const TakoState *state);
+
+// --- Profiling ---
+// TAKO_PROFILE_STATS counts dispatched instructions; TAKO_PROFILE_LINES also
+// counts and times every instruction, with the JIT off. Counts cover the
+// state's most recent run.
+typedef enum { TAKO_PROFILE_OFF, TAKO_PROFILE_STATS, TAKO_PROFILE_LINES } TakoProfileMode;
+
+void tako_state_set_profile(TakoState *state, TakoProfileMode mode);
+
+typedef struct {
+    double compile_seconds;   // loading, parsing, optimizing and lowering
+    bool cached;              // loaded from a cached image instead
+    double run_seconds;       // the most recent run
+    int line_count;
+    int instruction_count;
+    int variable_count;
+    int literal_count;        // slots holding numeric literals
+    uint64_t dispatches;      // instructions run by the interpreter (not the JIT)
+    int jit_loops;            // loops compiled to native code
+} TakoStats;
+
+void tako_stats(const TakoScript *script, const TakoState *state, TakoStats *out);
+
+// Write the hot-line and opcode report for a TAKO_PROFILE_LINES run to `out`
+// and, when `folded_path` is set, collapsed stacks for flamegraph tools.
+// Returns 0, or -1 if the folded file could not be written.
+int tako_profile_report(const TakoScript *script, const TakoState *state, FILE *out, const char *folded_path);
+
+#endif
@@ -0,0 +1,309 @@
+#include "x64.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// --- Code Buffer ---
+
+static bool reserve(X64Buf *b, size_t n) {
+    if (b->oom) return false;
+    if (b->len + n <= b->cap) return true;
+    size_t cap = b->cap ? b->cap * 2 : 256;
+    while (cap < b->len + n) cap *= 2;
+    unsigned char *grown = realloc(b->code, cap);
+    if (!grown) { b->oom = true; return false; }
+    b->code = grown;
+    b->cap = cap;
+    return true;
+}
+
+void x64_free(X64Buf *b) {
+    free(b->code);
+    memset(b, 0, sizeof(X64Buf));
+}
+
+void x64_byte(X64Buf *b, uint8_t v) {
+    if (reserve(b, 1)) b->code[b->len++] = v;
+}
+
+void x64_u32(X64Buf *b, uint32_t v) {
+    if (!reserve(b, 4)) return;
+    for (int i = 0; i < 4; i++) b->code[b->len++] = (unsigned char)(v >> (8 * i));
+}
+
+void x64_u64(X64Buf *b, uint64_t v) {
+    x64_u32(b, (uint32_t)v);
+    x64_u32(b, (uint32_t)(v >> 32));
+}
+
+// --- Encoding Helpers ---
+
+// REX prefix for a `reg` field and an r/m (or opcode) register, if needed.
+static void rex(X64Buf *b, bool wide, int reg, int rm) {
+    if (rm == X64_ABS) rm = 0;
+    uint8_t r = 0x40 | (wide ? 8 : 0) | ((reg >> 3) & 1) << 2 | ((rm >> 3) & 1);
+    if (r != 0x40) x64_byte(b, r);
+}
+
+static void modrm_reg(X64Buf *b, int reg, int rm) {
+    x64_byte(b, (uint8_t)(0xC0 | (reg & 7) << 3 | (rm & 7)));
+}
+
+// ModRM (plus SIB and displacement) for [base + disp]. RSP/R12 as a base
+// need a SIB byte, and RBP/R13 cannot use the no-displacement form.
+static void modrm_mem(X64Buf *b, int reg, X64Reg base, int32_t disp) {
+    if (base == X64_ABS) {
+        x64_byte(b, (uint8_t)((reg & 7) << 3 | 4));
+        x64_byte(b, 0x25);
+        x64_u32(b, (uint32_t)disp);
+        return;
+    }
+    int rm = base & 7;
+    int mod = disp == 0 && rm != RBP ? 0 : disp >= -128 && disp <= 127 ? 1 : 2;
+    x64_byte(b, (uint8_t)(mod << 6 | (reg & 7) << 3 | rm));
+    if (rm == RSP) x64_byte(b, 0x24);
+    if (mod == 1) x64_byte(b, (uint8_t)disp);
+    else if (mod == 2) x64_u32(b, (uint32_t)disp);
+}
+
+static bool fits_i8(int32_t v) { return v >= -128 && v <= 127; }
+
+// --- Instructions ---
+
+void x64_mov_rr(X64Buf *b, bool wide, X64Reg dst, X64Reg src) {
+    rex(b, wide, src, dst);
+    x64_byte(b, 0x89);
+    modrm_reg(b, src, dst);
+}
+
+void x64_mov_ri(X64Buf *b, X64Reg dst, uint32_t imm) {
+    rex(b, false, 0, dst);
+    x64_byte(b, (uint8_t)(0xB8 + (dst & 7)));
+    x64_u32(b, imm);
+}
+
+void x64_mov_ri64(X64Buf *b, X64Reg dst, uint64_t imm) {
+    rex(b, true, 0, dst);
+    x64_byte(b, (uint8_t)(0xB8 + (dst & 7)));
+    x64_u64(b, imm);
+}
+
+void x64_mov_ri_sx(X64Buf *b, X64Reg dst, int32_t imm) {
+    rex(b, true, 0, dst);
+    x64_byte(b, 0xC7);
+    modrm_reg(b, 0, dst);
+    x64_u32(b, (uint32_t)imm);
+}
+
+void x64_load(X64Buf *b, bool wide, X64Reg dst, X64Reg base, int32_t disp) {
+    rex(b, wide, dst, base);
+    x64_byte(b, 0x8B);
+    modrm_mem(b, dst, base, disp);
+}
+
+void x64_store(X64Buf *b, bool wide, X64Reg base, int32_t disp, X64Reg src) {
+    rex(b, wide, src, base);
+    x64_byte(b, 0x89);
+    modrm_mem(b, src, base, disp);
+}
+
+void x64_store_imm(X64Buf *b, bool wide, X64Reg base, int32_t disp, int32_t imm) {
+    rex(b, wide, 0, base);
+    x64_byte(b, 0xC7);
+    modrm_mem(b, 0, base, disp);
+    x64_u32(b, (uint32_t)imm);
+}
+
+void x64_store16(X64Buf *b, X64Reg base, int32_t disp, X64Reg src) {
+    x64_byte(b, 0x66);
+    rex(b, false, src, base);
+    x64_byte(b, 0x89);
+    modrm_mem(b, src, base, disp);
+}
+
+void x64_store8(X64Buf *b, X64Reg base, int32_t disp, X64Reg src) {
+    // SPL/BPL/SIL/DIL are only reachable with a REX prefix.
+    if (src >= RSP && src <= RDI) x64_byte(b, (uint8_t)(0x40 | (base != X64_ABS && base >= R8)));
+    else rex(b, false, src, base);
+    x64_byte(b, 0x88);
+    modrm_mem(b, src, base, disp);
+}
+
+void x64_store8_imm(X64Buf *b, X64Reg base, int32_t disp, uint8_t imm) {
+    rex(b, false, 0, base);
+    x64_byte(b, 0xC6);
+    modrm_mem(b, 0, base, disp);
+    x64_byte(b, imm);
+}
+
+void x64_movzx16(X64Buf *b, X64Reg dst, X64Reg base, int32_t disp) {
+    rex(b, false, dst, base);
+    x64_byte(b, 0x0F);
+    x64_byte(b, 0xB7);
+    modrm_mem(b, dst, base, disp);
+}
+
+void x64_alu_rr(X64Buf *b, X64Alu op, bool wide, X64Reg dst, X64Reg src) {
+    rex(b, wide, src, dst);
+    x64_byte(b, (uint8_t)(op * 8 + 1));
+    modrm_reg(b, src, dst);
+}
+
+void x64_alu_rm(X64Buf *b, X64Alu op, bool wide, X64Reg dst, X64Reg base, int32_t disp) {
+    rex(b, wide, dst, base);
+    x64_byte(b, (uint8_t)(op * 8 + 3));
+    modrm_mem(b, dst, base, disp);
+}
+
+void x64_alu_mr(X64Buf *b, X64Alu op, bool wide, X64Reg base, int32_t disp, X64Reg src) {
+    rex(b, wide, src, base);
+    x64_byte(b, (uint8_t)(op * 8 + 1));
+    modrm_mem(b, src, base, disp);
+}
+
+void x64_alu_ri(X64Buf *b, X64Alu op, bool wide, X64Reg dst, int32_t imm) {
+    rex(b, wide, 0, dst);
+    x64_byte(b, fits_i8(imm) ? 0x83 : 0x81);
+    modrm_reg(b, op, dst);
+    if (fits_i8(imm)) x64_byte(b, (uint8_t)imm);
+    else x64_u32(b, (uint32_t)imm);
+}
+
+void x64_alu_mi(X64Buf *b, X64Alu op, bool wide, X64Reg base, int32_t disp, int32_t imm) {
+    rex(b, wide, 0, base);
+    x64_byte(b, fits_i8(imm) ? 0x83 : 0x81);
+    modrm_mem(b, op, base, disp);
+    if (fits_i8(imm)) x64_byte(b, (uint8_t)imm);
+    else x64_u32(b, (uint32_t)imm);
+}
+
+void x64_cmp8_mi(X64Buf *b, X64Reg base, int32_t disp, uint8_t imm) {
+    rex(b, false, 0, base);
+    x64_byte(b, 0x80);
+    modrm_mem(b, ALU_CMP, base, disp);
+    x64_byte(b, imm);
+}
+
+void x64_test_rr(X64Buf *b, bool wide, X64Reg a, X64Reg c) {
+    rex(b, wide, c, a);
+    x64_byte(b, 0x85);
+    modrm_reg(b, c, a);
+}
+
+void x64_imul_rri(X64Buf *b, bool wide, X64Reg dst, X64Reg src, int32_t imm) {
+    rex(b, wide, dst, src);
+    x64_byte(b, fits_i8(imm) ? 0x6B : 0x69);
+    modrm_reg(b, dst, src);
+    if (fits_i8(imm)) x64_byte(b, (uint8_t)imm);
+    else x64_u32(b, (uint32_t)imm);
+}
+
+void x64_imul_rr(X64Buf *b, bool wide, X64Reg dst, X64Reg src) {
+    rex(b, wide, dst, src);
+    x64_byte(b, 0x0F);
+    x64_byte(b, 0xAF);
+    modrm_reg(b, dst, src);
+}
+
+void x64_imul_rm(X64Buf *b, bool wide, X64Reg dst, X64Reg base, int32_t disp) {
+    rex(b, wide, dst, base);
+    x64_byte(b, 0x0F);
+    x64_byte(b, 0xAF);
+    modrm_mem(b, dst, base, disp);
+}
+
+void x64_shr_ri(X64Buf *b, bool wide, X64Reg r, uint8_t imm) {
+    rex(b, wide, 0, r);
+    x64_byte(b, 0xC1);
+    modrm_reg(b, 5, r);
+    x64_byte(b, imm);
+}
+
+void x64_inc_m(X64Buf *b, bool wide, X64Reg base, int32_t disp) {
+    rex(b, wide, 0, base);
+    x64_byte(b, 0xFF);
+    modrm_mem(b, 0, base, disp);
+}
+
+void x64_dec_m(X64Buf *b, bool wide, X64Reg base, int32_t disp) {
+    rex(b, wide, 0, base);
+    x64_byte(b, 0xFF);
+    modrm_mem(b, 1, base, disp);
+}
+
+// The one-operand group: FF /0 inc, FF /1 dec, F7 /3 neg, F7 /4 mul, F7 /6 div.
+static void unary(X64Buf *b, uint8_t opcode, int ext, bool wide, X64Reg r) {
+    rex(b, wide, 0, r);
+    x64_byte(b, opcode);
+    modrm_reg(b, ext, r);
+}
+
+void x64_inc_r(X64Buf *b, bool wide, X64Reg r) { unary(b, 0xFF, 0, wide, r); }
+void x64_dec_r(X64Buf *b, bool wide, X64Reg r) { unary(b, 0xFF, 1, wide, r); }
+void x64_neg_r(X64Buf *b, bool wide, X64Reg r) { unary(b, 0xF7, 3, wide, r); }
+void x64_mul_r(X64Buf *b, bool wide, X64Reg r) { unary(b, 0xF7, 4, wide, r); }
+void x64_div_r(X64Buf *b, bool wide, X64Reg r) { unary(b, 0xF7, 6, wide, r); }
+
+void x64_push(X64Buf *b, X64Reg r) {
+    rex(b, false, 0, r);
+    x64_byte(b, (uint8_t)(0x50 + (r & 7)));
+}
+
+void x64_pop(X64Buf *b, X64Reg r) {
+    rex(b, false, 0, r);
+    x64_byte(b, (uint8_t)(0x58 + (r & 7)));
+}
+
+void x64_call_r(X64Buf *b, X64Reg r) {
+    rex(b, false, 0, r);
+    x64_byte(b, 0xFF);
+    modrm_reg(b, 2, r);
+}
+
+void x64_ret(X64Buf *b) { x64_byte(b, 0xC3); }
+
+void x64_rep_movsb(X64Buf *b) {
+    x64_byte(b, 0xF3);
+    x64_byte(b, 0xA4);
+}
+
+void x64_rep_movsq(X64Buf *b) {
+    x64_byte(b, 0xF3);
+    x64_byte(b, 0x48);
+    x64_byte(b, 0xA5);
+}
+
+void x64_syscall(X64Buf *b) {
+    x64_byte(b, 0x0F);
+    x64_byte(b, 0x05);
+}
+
+// --- Jumps ---
+
+size_t x64_jmp(X64Buf *b) {
+    x64_byte(b, 0xE9);
+    size_t at = b->len;
+    x64_u32(b, 0);
+    return at;
+}
+
+size_t x64_call(X64Buf *b) {
+    x64_byte(b, 0xE8);
+    size_t at = b->len;
+    x64_u32(b, 0);
+    return at;
+}
+
+size_t x64_jcc(X64Buf *b, X64Cond cc) {
+    x64_byte(b, 0x0F);
+    x64_byte(b, (uint8_t)(0x80 + cc));
+    size_t at = b->len;
+    x64_u32(b, 0);
+    return at;
+}
+
+void x64_patch(X64Buf *b, size_t at, size_t target) {
+    if (b->oom) return;
+    uint32_t rel = (uint32_t)((int64_t)target - (int64_t)(at + 4));
+    for (int i = 0; i < 4; i++) b->code[at + i] = (unsigned char)(rel >> (8 * i));
+}
@@ -0,0 +1,101 @@
+#ifndef TAKO_X64_H
+#define TAKO_X64_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// --- Code Buffer ---
+
+// A growable buffer of x86-64 machine code. Allocation failures are sticky:
+// emitting stops and `oom` is set, so callers check once at the end.
+typedef struct {
+    unsigned char *code;
+    size_t len;
+    size_t cap;
+    bool oom;
+} X64Buf;
+
+void x64_free(X64Buf *b);
+
+void x64_byte(X64Buf *b, uint8_t v);
+void x64_u32(X64Buf *b, uint32_t v);
+void x64_u64(X64Buf *b, uint64_t v);
+
+// --- Operands ---
+
+// X64_ABS as a memory base means no base register: the displacement is an
+// absolute address (which must fit in 32 bits).
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+    X64_ABS
+} X64Reg;
+
+// Condition codes, numbered as in the Jcc/SETcc opcodes. B/AE/BE/A are the
+// unsigned comparisons.
+typedef enum {
+    CC_B = 0x2, CC_AE = 0x3, CC_BE = 0x6, CC_A = 0x7,
+    CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF
+} X64Cond;
+
+// Two-operand integer ops sharing the classic encoding (opcode = op * 8 + form).
+typedef enum { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 } X64Alu;
+
+// --- Instructions ---
+// `wide` selects 64-bit operands; otherwise they are 32-bit. Memory operands
+// are always [base + disp].
+
+void x64_mov_rr(X64Buf *b, bool wide, X64Reg dst, X64Reg src);
+void x64_mov_ri(X64Buf *b, X64Reg dst, uint32_t imm);          // zero-extends
+void x64_mov_ri64(X64Buf *b, X64Reg dst, uint64_t imm);
+void x64_mov_ri_sx(X64Buf *b, X64Reg dst, int32_t imm);        // 64-bit, sign-extends
+void x64_load(X64Buf *b, bool wide, X64Reg dst, X64Reg base, int32_t disp);
+void x64_store(X64Buf *b, bool wide, X64Reg base, int32_t disp, X64Reg src);
+void x64_store_imm(X64Buf *b, bool wide, X64Reg base, int32_t disp, int32_t imm); // sign-extends
+void x64_store16(X64Buf *b, X64Reg base, int32_t disp, X64Reg src);
+void x64_store8(X64Buf *b, X64Reg base, int32_t disp, X64Reg src);
+void x64_store8_imm(X64Buf *b, X64Reg base, int32_t disp, uint8_t imm);
+
+void x64_movzx16(X64Buf *b, X64Reg dst, X64Reg base, int32_t disp);   // 32-bit dst
+
+void x64_alu_rr(X64Buf *b, X64Alu op, bool wide, X64Reg dst, X64Reg src);
+void x64_alu_rm(X64Buf *b, X64Alu op, bool wide, X64Reg dst, X64Reg base, int32_t disp);
+void x64_alu_mr(X64Buf *b, X64Alu op, bool wide, X64Reg base, int32_t disp, X64Reg src);
+void x64_alu_ri(X64Buf *b, X64Alu op, bool wide, X64Reg dst, int32_t imm);
+void x64_alu_mi(X64Buf *b, X64Alu op, bool wide, X64Reg base, int32_t disp, int32_t imm);
+void x64_cmp8_mi(X64Buf *b, X64Reg base, int32_t disp, uint8_t imm);
+void x64_test_rr(X64Buf *b, bool wide, X64Reg a, X64Reg c);
+void x64_imul_rri(X64Buf *b, bool wide, X64Reg dst, X64Reg src, int32_t imm);
+void x64_imul_rr(X64Buf *b, bool wide, X64Reg dst, X64Reg src);
+void x64_imul_rm(X64Buf *b, bool wide, X64Reg dst, X64Reg base, int32_t disp);
+void x64_shr_ri(X64Buf *b, bool wide, X64Reg r, uint8_t imm);
+void x64_inc_m(X64Buf *b, bool wide, X64Reg base, int32_t disp);
+void x64_dec_m(X64Buf *b, bool wide, X64Reg base, int32_t disp);
+void x64_inc_r(X64Buf *b, bool wide, X64Reg r);
+void x64_dec_r(X64Buf *b, bool wide, X64Reg r);
+void x64_neg_r(X64Buf *b, bool wide, X64Reg r);
+void x64_mul_r(X64Buf *b, bool wide, X64Reg r);                // unsigned rdx:rax = rax * r
+void x64_div_r(X64Buf *b, bool wide, X64Reg r);                // unsigned rdx:rax / r
+
+void x64_push(X64Buf *b, X64Reg r);
+void x64_pop(X64Buf *b, X64Reg r);
+void x64_call_r(X64Buf *b, X64Reg r);
+void x64_ret(X64Buf *b);
+void x64_rep_movsb(X64Buf *b);                                 // copy rcx bytes [rsi] -> [rdi]
+void x64_rep_movsq(X64Buf *b);                                 // copy rcx qwords [rsi] -> [rdi]
+void x64_syscall(X64Buf *b);
+
+// --- Jumps ---
+// Jumps are emitted with a 32-bit displacement and return the buffer offset
+// of that displacement, to be filled in later with x64_patch.
+
+size_t x64_jmp(X64Buf *b);
+size_t x64_call(X64Buf *b);
+size_t x64_jcc(X64Buf *b, X64Cond cc);
+void x64_patch(X64Buf *b, size_t at, size_t target);
+
+// The condition that holds exactly when `cc` does not.
+static inline X64Cond x64_negate(X64Cond cc) { return (X64Cond)(cc ^ 1); }
+
+#endif